@@ -0,0 +1,305 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3.h"
+
+
+/*
+ * Batch runs
+ *
+ * The image is loaded once and snapshotted; each worker thread has one VM
+ * it restores from that snapshot before every input, which puts back only
+ * the pages the last run wrote and keeps the decoded code. Workers take
+ * the next input from a shared counter, so the only contention is one
+ * atomic add per input and the lock around writing results.
+ *
+ * Results come out in input order: a finished input waits in its slot
+ * until every input before it is written.
+*/
+#define BATCH_OUTPUT_MAX (1 << 20)  // output kept per input; the rest is dropped
+
+struct capture {
+    char   *data;
+    size_t  length;
+    size_t  size;
+    bool    truncated;
+};
+
+struct batch_result {
+    struct capture output;
+    uint64_t       instructions;
+    int            reason;          // LC3_*, or -1 when the input couldn't be run
+    bool           done;
+};
+
+struct batch {
+    struct lc3_snapshot *snapshot;
+    const char *const   *inputs;
+    size_t               count;
+    uint64_t             limit;
+
+    atomic_size_t        next;      // next input to take
+
+    pthread_mutex_t      lock;      // over the rest
+    struct batch_result *results;
+    size_t               written;   // results before this one are out
+    FILE                *file;
+    struct lc3_batch_stats stats;
+};
+
+struct batch_worker {
+    pthread_t      thread;
+    struct batch  *batch;
+    struct lc3_vm *vm;
+    struct capture output;
+};
+
+static const char *reason_names[] = { "halted", "trap", "input", "illegal", "budget", "watch" };
+
+
+static void capture_output(void *context, const char *data, size_t length) {
+    struct capture *capture = context;
+
+    if (length > BATCH_OUTPUT_MAX - capture->length) {
+        length = BATCH_OUTPUT_MAX - capture->length;
+        capture->truncated = true;
+    }
+
+    if (capture->length + length > capture->size) {
+        size_t size = capture->size ? capture->size : 256;
+        while (size < capture->length + length) {
+            size *= 2;
+        }
+
+        char *bigger = realloc(capture->data, size);
+        if (!bigger) {
+            capture->truncated = true;
+            return;
+        }
+        capture->data = bigger;
+        capture->size = size;
+    }
+
+    memcpy(capture->data + capture->length, data, length);
+    capture->length += length;
+}
+
+
+// The whole file in a malloc'd buffer, or NULL.
+static uint8_t *read_input(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    uint8_t *data = NULL;
+    long size = 0;
+
+    if (!file) {
+        return NULL;
+    }
+
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0
+        && (data = malloc(size ? size : 1)) && fread(data, 1, size, file) != (size_t) size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    *length = size;
+
+    return data;
+}
+
+
+// Bytes as a JSON string; anything outside printable ASCII becomes \u00XX,
+// so the output comes back byte for byte.
+static void write_string(FILE *file, const char *data, size_t length) {
+    fputc('"', file);
+
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t byte = data[i];
+
+        if (byte == '"' || byte == '\\') {
+            fputc('\\', file);
+            fputc(byte, file);
+        }
+        else if (byte == '\n') {
+            fputs("\\n", file);
+        }
+        else if (byte < 0x20 || byte >= 0x7F) {
+            fprintf(file, "\\u%04x", byte);
+        }
+        else {
+            fputc(byte, file);
+        }
+    }
+
+    fputc('"', file);
+}
+
+
+static void write_result(struct batch *batch, size_t index) {
+    struct batch_result *result = &batch->results[index];
+    const char *input = batch->inputs[index];
+
+    fputs("{\"input\":", batch->file);
+    write_string(batch->file, input, strlen(input));
+    fprintf(batch->file, ",\"reason\":\"%s\",\"instructions\":%llu,\"output\":",
+            result->reason < 0 ? "error" : reason_names[result->reason],
+            (unsigned long long) result->instructions);
+    write_string(batch->file, result->output.data, result->output.length);
+    fprintf(batch->file, ",\"truncated\":%s}\n", result->output.truncated ? "true" : "false");
+
+    free(result->output.data);
+    result->output.data = NULL;
+}
+
+
+// Mark the input finished and write out every result that is now next in line.
+static void batch_publish(struct batch *batch, size_t index) {
+    struct batch_result *result = &batch->results[index];
+
+    pthread_mutex_lock(&batch->lock);
+
+    result->done = true;
+    batch->stats.instructions += result->instructions;
+    if (result->reason < 0) {
+        ++batch->stats.failed;
+    }
+
+    while (batch->written < batch->count && batch->results[batch->written].done) {
+        write_result(batch, batch->written++);
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+}
+
+
+static void batch_run_input(struct batch_worker *worker, size_t index) {
+    struct batch *batch = worker->batch;
+    struct batch_result *result = &batch->results[index];
+    struct lc3_vm *vm = worker->vm;
+    size_t length;
+    uint8_t *keys = read_input(batch->inputs[index], &length);
+
+    result->reason = -1;
+
+    if (!keys || !lc3_restore(vm, batch->snapshot)) {
+        free(keys);
+        return;
+    }
+
+    vm->instructions = 0;
+    lc3_set_input_script(vm, keys, length, NULL);
+
+    // traps without a handler do nothing, as on the command line
+    int reason;
+    do {
+        reason = lc3_run(vm, batch->limit - vm->instructions);
+    } while (reason == LC3_TRAP && vm->instructions < batch->limit);
+
+    lc3_flush_output(vm);
+    lc3_set_input_script(vm, NULL, 0, NULL);
+    free(keys);
+
+    result->reason       = reason == LC3_TRAP ? LC3_BUDGET : reason;
+    result->instructions = vm->instructions;
+    result->output       = worker->output;
+    memset(&worker->output, 0, sizeof(worker->output));
+}
+
+
+static void *batch_worker(void *context) {
+    struct batch_worker *worker = context;
+    struct batch *batch = worker->batch;
+
+    for (;;) {
+        size_t index = atomic_fetch_add(&batch->next, 1);
+
+        if (index >= batch->count) {
+            return NULL;
+        }
+
+        batch_run_input(worker, index);
+        batch_publish(batch, index);
+    }
+}
+
+
+int lc3_batch(struct lc3_vm *vm, const char *const *inputs, size_t count, int workers,
+              uint64_t limit, FILE *results, struct lc3_batch_stats *stats) {
+    struct batch batch = { .inputs = inputs, .count = count, .file = results,
+                           .limit = limit ? limit : LC3_FOREVER };
+    int worker_count = workers > 0 ? workers : 1;
+
+    if ((size_t) worker_count > count) {
+        worker_count = count ? count : 1;
+    }
+
+    struct batch_worker *pool = calloc(worker_count, sizeof(*pool));
+    batch.results  = calloc(count ? count : 1, sizeof(*batch.results));
+    batch.snapshot = lc3_snapshot(vm);
+
+    bool ok = pool && batch.results && batch.snapshot;
+
+    for (int i = 0; ok && i < worker_count; ++i) {
+        struct lc3_vm *clone = lc3_create();
+
+        pool[i].batch = &batch;
+        pool[i].vm    = clone;
+
+        if (!clone) {
+            ok = false;
+            break;
+        }
+
+        clone->decode_cache_enabled = vm->decode_cache_enabled;
+        clone->fusion_enabled       = vm->fusion_enabled;
+        clone->core                 = vm->core;
+        clone->trap_memory_vectors  = vm->trap_memory_vectors;
+
+        for (int vector = 0; vector < 256; ++vector) {
+            lc3_set_trap(clone, vector, vm->traps[vector].handler, vm->traps[vector].context);
+        }
+
+        lc3_configure_output(clone, OUTPUT_BUFFER, OUTPUT_BLOCK);
+        lc3_set_output_sink(clone, capture_output, &pool[i].output);
+    }
+
+    if (ok) {
+        pthread_mutex_init(&batch.lock, NULL);
+        atomic_store(&batch.next, 0);
+
+        uint64_t start = monotonic_ns();
+
+        for (int i = 0; i < worker_count; ++i) {
+            pthread_create(&pool[i].thread, NULL, batch_worker, &pool[i]);
+        }
+
+        for (int i = 0; i < worker_count; ++i) {
+            pthread_join(pool[i].thread, NULL);
+        }
+
+        batch.stats.inputs     = count;
+        batch.stats.elapsed_ns = monotonic_ns() - start;
+        pthread_mutex_destroy(&batch.lock);
+        fflush(results);
+    }
+
+    for (int i = 0; pool && i < worker_count; ++i) {
+        if (pool[i].vm) {
+            lc3_destroy(pool[i].vm);
+        }
+        free(pool[i].output.data);
+    }
+
+    if (stats) {
+        *stats = batch.stats;
+    }
+
+    lc3_snapshot_release(batch.snapshot);
+    free(batch.results);
+    free(pool);
+
+    return ok;
+}
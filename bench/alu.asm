@@ -0,0 +1,25 @@
+; ALU-heavy loop: every instruction but the loop branches sets the
+; condition codes, which are read only by those branches. About 150
+; million instructions.
+        .ORIG x3000
+        LD R5, OUTER
+OLOOP   LD R4, INNER
+ILOOP   ADD R0, R0, R4
+        AND R1, R0, #7
+        NOT R2, R1
+        ADD R3, R2, R0
+        ADD R1, R1, R3
+        AND R2, R1, R4
+        NOT R3, R2
+        ADD R0, R0, R3
+        ADD R4, R4, #-1
+        BRp ILOOP
+        ADD R5, R5, #-1
+        BRp OLOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+OUTER   .FILL #1000
+INNER   .FILL #15000
+DONE    .STRINGZ "alu ok\n"
+        .END
@@ -0,0 +1,24 @@
+; Block copy: LDR/STR through two pointers, 4096 words at a time, about
+; 120 million instructions. Every store goes through mem_write.
+        .ORIG x3000
+        LD R5, ROUNDS
+RLOOP   LD R1, SRC
+        LD R2, DST
+        LD R4, COUNT
+CLOOP   LDR R0, R1, #0
+        STR R0, R2, #0
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        ADD R4, R4, #-1
+        BRp CLOOP
+        ADD R5, R5, #-1
+        BRp RLOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+ROUNDS  .FILL #5000
+SRC     .FILL x3000
+DST     .FILL x6000
+COUNT   .FILL #4096
+DONE    .STRINGZ "copy ok\n"
+        .END
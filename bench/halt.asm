@@ -0,0 +1,4 @@
+; Nothing but HALT, to time startup and teardown.
+        .ORIG x3000
+        HALT
+        .END
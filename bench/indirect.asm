@@ -0,0 +1,24 @@
+; Indirect loads and stores: LDI/STI through pointers to a far data page,
+; about 100 million instructions.
+        .ORIG x3000
+        LD R5, OUTER
+OLOOP   LD R4, INNER
+ILOOP   LDI R0, PA
+        ADD R0, R0, R4
+        STI R0, PB
+        LDI R1, PB
+        ADD R1, R1, #1
+        STI R1, PA
+        ADD R4, R4, #-1
+        BRp ILOOP
+        ADD R5, R5, #-1
+        BRp OLOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+OUTER   .FILL #1000
+INNER   .FILL #12500
+PA      .FILL x8000
+PB      .FILL x8001
+DONE    .STRINGZ "indirect ok\n"
+        .END
@@ -0,0 +1,27 @@
+; Mixed workload for the interpreter cores: ALU, loads, stores and
+; branches in a nested loop, about 120 million instructions in total.
+        .ORIG x3000
+        LD R5, OUTER
+OLOOP   LD R4, INNER
+        LEA R3, TABLE
+ILOOP   LDR R0, R3, #0
+        ADD R0, R0, R4
+        AND R1, R0, #15
+        NOT R2, R1
+        ADD R1, R1, R2
+        STR R0, R3, #1
+        ST R1, SINK
+        ADD R4, R4, #-1
+        BRp ILOOP
+        ADD R5, R5, #-1
+        BRp OLOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+OUTER   .FILL #1000
+INNER   .FILL #12000
+SINK    .FILL 0
+TABLE   .FILL #7
+        .FILL 0
+DONE    .STRINGZ "mix ok\n"
+        .END
@@ -0,0 +1,15 @@
+; String output: one 64-character line through PUTS 30000 times, 1.9 MB
+; in all, so the cost is in the trap and the output buffer.
+        .ORIG x3000
+        LD R5, ROUNDS
+LOOP    LEA R0, LINE
+        PUTS
+        ADD R5, R5, #-1
+        BRp LOOP
+        LEA R0, DONE
+        PUTS
+        HALT
+ROUNDS  .FILL #30000
+LINE    .STRINGZ "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ!\n"
+DONE    .STRINGZ "puts ok\n"
+        .END
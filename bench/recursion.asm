@@ -0,0 +1,52 @@
+; Recursive Fibonacci with JSR/RET and a stack in memory: fib(18) 1100
+; times, about 100 million instructions.
+        .ORIG x3000
+        LD R6, STACK
+        LD R5, ROUNDS
+RLOOP   LD R0, N
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp RLOOP
+        LD R2, EXPECT
+        NOT R2, R2
+        ADD R2, R2, #1
+        ADD R2, R1, R2
+        BRnp BAD
+        LEA R0, DONE
+        PUTS
+        HALT
+BAD     LEA R0, WRONG
+        PUTS
+        HALT
+STACK   .FILL xFE00
+ROUNDS  .FILL #1100
+N       .FILL #18
+EXPECT  .FILL #2584
+; R1 = fib(R0), with fib(1) = fib(2) = 1
+FIB     ADD R6, R6, #-1
+        STR R7, R6, #0
+        ADD R6, R6, #-1
+        STR R0, R6, #0
+        ADD R1, R0, #-2
+        BRp REC
+        AND R1, R1, #0
+        ADD R1, R1, #1
+        BRnzp RETURN
+REC     ADD R0, R0, #-1
+        JSR FIB
+        ADD R6, R6, #-1
+        STR R1, R6, #0
+        LDR R0, R6, #1
+        ADD R0, R0, #-2
+        JSR FIB
+        LDR R2, R6, #0
+        ADD R6, R6, #1
+        ADD R1, R1, R2
+RETURN  LDR R0, R6, #0
+        ADD R6, R6, #1
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+        RET
+DONE    .STRINGZ "recursion ok\n"
+WRONG   .STRINGZ "recursion wrong\n"
+        .END
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs every workload under every core and option, printing one JSON object
+# per run on stdout: the --bench line of ./lc3 plus the workload and the
+# options used. Startup lines give the mean wall time of a run of halt.obj.
+#
+#   bench/run.sh [path/to/lc3] > results.jsonl
+#
+# REPEAT=N runs each combination N times; STARTUP_RUNS=N sets how many
+# processes the startup mean is taken over.
+
+cd "$(dirname "$0")" || exit 1
+
+LC3=${1:-../lc3}
+REPEAT=${REPEAT:-1}
+STARTUP_RUNS=${STARTUP_RUNS:-20}
+
+CONFIGS="--core=call
+--core=call --no-cache
+--core=threaded
+--core=jit
+--core=block"
+
+WORKLOADS="alu mix copy recursion puts indirect 2048"
+
+run_workload() {
+    if [ "$1" = 2048 ]; then
+        "$LC3" --bench $2 ../2048.obj < 2048.moves
+    else
+        "$LC3" --bench $2 "$1.obj" < /dev/null
+    fi
+}
+
+echo "$CONFIGS" | while read -r options; do
+    for workload in $WORKLOADS; do
+        i=0
+        while [ $i -lt "$REPEAT" ]; do
+            run_workload "$workload" "$options" 2>&1 >/dev/null \
+                | grep '"core"' \
+                | sed "s/^{/{\"bench\":\"$workload\",\"options\":\"$options\",/"
+            i=$((i + 1))
+        done
+    done
+
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$STARTUP_RUNS" ]; do
+        "$LC3" $options halt.obj < /dev/null > /dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+
+    awk -v options="$options" -v ns=$((end - start)) -v runs="$STARTUP_RUNS" \
+        'BEGIN { printf "{\"bench\":\"startup\",\"options\":\"%s\",\"runs\":%d,\"seconds\":%.6f}\n", options, runs, ns / runs / 1e9 }'
+done
@@ -0,0 +1,208 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lc3.h"
+
+
+/*
+ * Block interpreter
+ *
+ * The block core decodes a basic block, a straight run of instructions up
+ * to and including a control transfer, once, and then runs it as a unit:
+ * no fetch, no decode cache lookup and no budget test per instruction,
+ * just the handlers in a row. Each block remembers the blocks it last
+ * went on to, so following a branch it has seen before skips the lookup.
+ *
+ * Like the JIT, a store into a word that is part of a block drops every
+ * block; it also ends the run pass, so the rest of the block running then
+ * is never used. Blocks stop short of device pages.
+*/
+#define BLOCK_MAX   64      // instructions per block
+#define BLOCK_COUNT 8192    // blocks alive at once
+#define BLOCK_OPS   (1 << 16)
+#define BLOCK_LINKS 2       // successors remembered per block
+
+struct block {
+    uint16_t        start;
+    uint16_t        length;
+    struct decoded *ops;
+    struct block   *next[BLOCK_LINKS];
+};
+
+struct blocks {
+    struct block  *at[MEMORY_MAX];      // block starting at each address
+    uint8_t        covered[MEMORY_MAX]; // words that are part of some block
+    uint32_t       generation;          // bumped every time blocks are dropped
+
+    struct block   pool[BLOCK_COUNT];
+    size_t         used;
+    struct decoded ops[BLOCK_OPS];
+    size_t         ops_used;
+};
+
+
+void blocks_flush(struct lc3_vm *vm) {
+    struct blocks *blocks = vm->blocks;
+
+    if (!blocks) {
+        return;
+    }
+
+    memset(blocks->at, 0, sizeof(blocks->at));
+    memset(blocks->covered, 0, sizeof(blocks->covered));
+    blocks->used     = 0;
+    blocks->ops_used = 0;
+    ++blocks->generation;
+}
+
+
+void blocks_destroy(struct lc3_vm *vm) {
+    if (!vm->blocks) {
+        return;
+    }
+
+    munmap(vm->blocks, sizeof(struct blocks));
+    vm->blocks         = NULL;
+    vm->blocks_covered = NULL;
+}
+
+
+static bool ends_block(uint8_t opcode) {
+    switch (opcode) {
+        case OP_BR:
+        case OP_JMP:
+        case OP_JSR:
+        case OP_TRAP:
+        case OP_RTI:
+        case OP_RES:
+            return true;
+    }
+
+    return false;
+}
+
+
+// The block starting at pc, decoded now if needed. NULL for code on a
+// device page, which only runs through fetch().
+static struct block *block_at(struct lc3_vm *vm, uint16_t pc) {
+    struct blocks *blocks = vm->blocks;
+
+    if (blocks->at[pc]) {
+        return blocks->at[pc];
+    }
+
+    if (device_page(vm, pc)) {
+        return NULL;
+    }
+
+    if (blocks->used == BLOCK_COUNT || blocks->ops_used + BLOCK_MAX > BLOCK_OPS) {
+        blocks_flush(vm);
+    }
+
+    struct block *block = &blocks->pool[blocks->used++];
+
+    block->start = pc;
+    block->ops   = &blocks->ops[blocks->ops_used];
+    memset(block->next, 0, sizeof(block->next));
+
+    uint16_t length = 0;
+
+    do {
+        decode(vm->memory[pc + length], &block->ops[length]);
+        blocks->covered[pc + length] = 1;
+    } while (!ends_block(block->ops[length++].opcode)
+             && length < BLOCK_MAX && pc + length < MEMORY_MAX && !device_page(vm, pc + length));
+
+    block->length     = length;
+    blocks->ops_used += length;
+    blocks->at[pc]    = block;
+
+    return block;
+}
+
+
+// Run the block, stopping early if a load from KBSR or a store into a
+// block stopped the pass.
+static void block_run(struct lc3_vm *vm, const struct block *block) {
+    uint16_t pc = block->start;
+
+    for (uint16_t i = 0; i < block->length; ++i) {
+        const struct decoded *op = &block->ops[i];
+
+        vm->registers[R_PC] = ++pc;
+        ++vm->instructions;
+        op->execute(vm, op);
+
+        if (!vm->running) {
+            return;
+        }
+    }
+}
+
+
+void run_blocks(struct lc3_vm *vm) {
+    if (!vm->blocks) {
+        void *blocks = mmap(NULL, sizeof(struct blocks), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (blocks == MAP_FAILED) {
+            run_call(vm);
+            return;
+        }
+        vm->blocks         = blocks;
+        vm->blocks_covered = vm->blocks->covered;
+    }
+
+    struct blocks *blocks = vm->blocks;
+    struct block *block = NULL;
+    uint32_t generation = blocks->generation;
+
+    // handlers only test the budget at control transfers, and a block cut
+    // at BLOCK_MAX has none, so it is tested here once per block
+    while (vm->running && vm->instructions < vm->budget_check) {
+        uint16_t pc = vm->registers[R_PC];
+        struct block *next = NULL;
+
+        // a flush drops every block, links included
+        if (generation != blocks->generation) {
+            generation = blocks->generation;
+            block = NULL;
+        }
+
+        for (int i = 0; block && i < BLOCK_LINKS; ++i) {
+            if (block->next[i] && block->next[i]->start == pc) {
+                next = block->next[i];
+                break;
+            }
+        }
+
+        if (!next) {
+            next = block_at(vm, pc);
+
+            if (!next) {
+                struct decoded scratch;
+                const struct decoded *op = fetch(vm, &scratch);
+                ++vm->instructions;
+                op->execute(vm, op);
+                block = NULL;
+                continue;
+            }
+
+            if (generation != blocks->generation) {
+                generation = blocks->generation;
+                block = NULL;
+            }
+
+            if (block) {
+                memmove(block->next + 1, block->next, (BLOCK_LINKS - 1) * sizeof(block->next[0]));
+                block->next[0] = next;
+            }
+        }
+
+        block = next;
+        block_run(vm, block);
+    }
+}
@@ -0,0 +1,157 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3.h"
+
+
+/*
+ * Fuzzing entry points
+ *
+ * Built in place of main.c, for libFuzzer:
+ *
+ *   clang -O2 -g -fsanitize=fuzzer -pthread -o lc3-fuzz fuzz.c lc3.c jit.c block.c image.c
+ *         sched.c snapshot.c profile.c stats.c io.c replay.c batch.c trace.c strings.c server.c
+ *
+ * or, with the same files, afl-clang-fast for AFL++'s persistent mode.
+ *
+ * With LC3_FUZZ_IMAGE=prog.obj in the environment each input is the
+ * keyboard input of that program; without it each input is an object
+ * image, loaded through read_image_file() and run with no input. Either
+ * way the VM is put back to a snapshot taken at startup before every
+ * input, which puts back only the pages the last one wrote, so there is no
+ * exec and no reload. LC3_FUZZ_LIMIT caps the instructions per input.
+ *
+ * The guest's control transfers go into libFuzzer's extra counters, or
+ * into AFL's map alongside the host edges, through lc3_set_coverage().
+*/
+#define FUZZ_LIMIT 100000
+#define FUZZ_EDGES (1 << 16)
+#define FUZZ_LOOP  100000   // AFL inputs per forked process
+
+static struct lc3_vm *vm;
+static struct lc3_snapshot *start;
+static bool image_inputs;
+static uint64_t limit = FUZZ_LIMIT;
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+__AFL_FUZZ_INIT();
+
+extern uint8_t *__afl_area_ptr;
+extern uint32_t __afl_map_size;
+#else
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t guest_edges[FUZZ_EDGES];
+#endif
+
+
+static void discard_output(void *context, const char *data, size_t length) {
+}
+
+
+static void fuzz_setup(void) {
+    const char *image = getenv("LC3_FUZZ_IMAGE");
+    const char *max = getenv("LC3_FUZZ_LIMIT");
+
+    vm = lc3_create();
+
+    if (!vm) {
+        fprintf(stderr, "memória insuficiente\n");
+        exit(1);
+    }
+
+    if (image && !lc3_load(vm, image)) {
+        fprintf(stderr, "falha ao carregar a imagem: %s\n", image);
+        exit(1);
+    }
+
+    if (max) {
+        limit = strtoull(max, NULL, 10);
+    }
+
+    image_inputs = !image;
+
+    lc3_configure_output(vm, OUTPUT_BUFFER, OUTPUT_BLOCK);
+    lc3_set_output_sink(vm, discard_output, NULL);
+
+    if (!(start = lc3_snapshot(vm))) {
+        fprintf(stderr, "memória insuficiente\n");
+        exit(1);
+    }
+}
+
+
+static void fuzz_one(const uint8_t *data, size_t size) {
+    if (!lc3_restore(vm, start)) {
+        abort();
+    }
+
+    vm->instructions = 0;
+
+    if (image_inputs) {
+        FILE *file = size ? fmemopen((void *) data, size, "rb") : NULL;
+
+        if (file) {
+            read_image_file(vm, file);
+            fclose(file);
+            invalidate_range(vm, vm->image_origin, vm->image_length);
+        }
+
+        // no keys, so reads see the end of input instead of waiting
+        lc3_set_input_script(vm, "", 0, NULL);
+    }
+    else {
+        lc3_set_input_script(vm, data, size, NULL);
+    }
+
+    // traps without a handler do nothing; an illegal instruction just ends the input
+    int reason;
+    do {
+        reason = lc3_run(vm, limit - vm->instructions);
+    } while (reason == LC3_TRAP && vm->instructions < limit);
+
+    lc3_flush_output(vm);
+    lc3_set_input_script(vm, NULL, 0, NULL);
+}
+
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+
+int main(int argc, char *argv[]) {
+    fuzz_setup();
+
+    __AFL_INIT();
+
+    // the map is only there once the fork server is up
+    uint32_t edges = FUZZ_EDGES;
+    while (edges > __afl_map_size) {
+        edges >>= 1;
+    }
+    lc3_set_coverage(vm, __afl_area_ptr, edges);
+
+    const uint8_t *data = __AFL_FUZZ_TESTCASE_BUF;
+
+    while (__AFL_LOOP(FUZZ_LOOP)) {
+        fuzz_one(data, __AFL_FUZZ_TESTCASE_LEN);
+    }
+
+    return 0;
+}
+
+#else
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    fuzz_setup();
+    lc3_set_coverage(vm, guest_edges, FUZZ_EDGES);
+    return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_one(data, size);
+    return 0;
+}
+
+#endif
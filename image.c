@@ -0,0 +1,405 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lc3.h"
+
+
+uint16_t swap16(uint16_t x) {
+    return (x << 8) | (x >> 8);
+}
+
+
+/*
+ * Block byte swap
+ *
+ * Converts runs of big-endian words (images, snapshots) to host order and
+ * back. The kernel is picked once at run time from what the CPU supports;
+ * src and dst may be the same buffer and need not be aligned.
+*/
+typedef void (*swap_kernel)(uint16_t *dst, const uint16_t *src, size_t count);
+
+
+void swap16_scalar(uint16_t *dst, const uint16_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = swap16(src[i]);
+    }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+void swap16_sse2(uint16_t *dst, const uint16_t *src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i words = _mm_loadu_si128((const __m128i *) (src + i));
+        words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128((__m128i *) (dst + i), words);
+    }
+
+    swap16_scalar(dst + i, src + i, count - i);
+}
+
+
+__attribute__((target("avx2")))
+void swap16_avx2(uint16_t *dst, const uint16_t *src, size_t count) {
+    const __m256i order = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i low  = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i high = _mm256_loadu_si256((const __m256i *) (src + i + 16));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(low, order));
+        _mm256_storeu_si256((__m256i *) (dst + i + 16), _mm256_shuffle_epi8(high, order));
+    }
+
+    swap16_sse2(dst + i, src + i, count - i);
+}
+
+#endif
+
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+
+void swap16_neon(uint16_t *dst, const uint16_t *src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint8x16_t words = vld1q_u8((const uint8_t *) (src + i));
+        vst1q_u8((uint8_t *) (dst + i), vrev16q_u8(words));
+    }
+
+    swap16_scalar(dst + i, src + i, count - i);
+}
+
+#endif
+
+
+swap_kernel select_swap_kernel(const char **name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return swap16_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return swap16_sse2;
+    }
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+    *name = "neon";
+    return swap16_neon;
+#endif
+    *name = "scalar";
+    return swap16_scalar;
+}
+
+
+swap_kernel swap_kernel_selected;
+
+
+void pick_swap_kernel() {
+    const char *name;
+    swap_kernel_selected = select_swap_kernel(&name);
+}
+
+
+// Big-endian words to host order, or the reverse.
+void swap16_block(uint16_t *dst, const uint16_t *src, size_t count) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if (dst != src) {
+        memmove(dst, src, count * sizeof(uint16_t));
+    }
+    return;
+#endif
+
+    pthread_once(&once, pick_swap_kernel);
+    swap_kernel_selected(dst, src, count);
+}
+
+
+// Throughput of each available kernel over a memory[]-sized buffer, as JSON.
+void benchmark_swap(int rounds) {
+    static uint16_t source[MEMORY_MAX], target[MEMORY_MAX];
+    struct { const char *name; swap_kernel kernel; } kernels[] = {
+        { "scalar", swap16_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2",   swap16_sse2 },
+        { "avx2",   __builtin_cpu_supports("avx2") ? swap16_avx2 : NULL },
+#endif
+#if defined(__aarch64__) || defined(__ARM_NEON)
+        { "neon",   swap16_neon },
+#endif
+    };
+
+    const char *selected;
+    select_swap_kernel(&selected);
+
+    for (size_t i = 0; i < MEMORY_MAX; ++i) {
+        source[i] = (uint16_t) (i * 40503u);
+    }
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (!kernels[k].kernel) {
+            continue;
+        }
+
+        uint64_t start = monotonic_ns();
+        for (int round = 0; round < rounds; ++round) {
+            kernels[k].kernel(target, source, MEMORY_MAX);
+            __asm__ volatile("" : : "r"(target) : "memory");
+        }
+        uint64_t elapsed = monotonic_ns() - start;
+
+        fprintf(stderr, "{\"kernel\":\"%s\",\"selected\":%s,\"bytes\":%zu,\"gb_per_second\":%.2f}\n",
+                kernels[k].name, strcmp(kernels[k].name, selected) == 0 ? "true" : "false",
+                sizeof(source), (double) sizeof(source) * rounds / elapsed);
+    }
+}
+
+
+/*
+ * Image loading
+ *
+ * .obj images are big-endian: an origin word followed by the program. A
+ * cached image holds the same words already in host byte order after a
+ * page-sized header, so they can be mapped copy-on-write straight into
+ * memory[] instead of being read and swapped on every start. The header is
+ * padded so that the words sit at the same offset within a page of the
+ * file as the origin within a page of memory[], whatever the origin.
+*/
+#define CACHED_IMAGE_MAGIC   "LC3I"
+#define CACHED_IMAGE_VERSION 2
+#define CACHED_IMAGE_DATA    4096 // header size, and the alignment the words keep
+#define BYTE_ORDER_MARK      0x0102
+
+struct cached_image_header {
+    char     magic[4];
+    uint16_t version;
+    uint16_t byte_order; // BYTE_ORDER_MARK as written by the host that made it
+    uint16_t origin;
+    uint16_t reserved;
+    uint32_t length;     // words
+};
+
+// Fallback for files that can't be mapped, such as pipes.
+void read_image_file(struct lc3_vm *vm, FILE* file) {
+    uint16_t origin;
+
+    // too short to hold even the origin: nothing is loaded
+    if (fread(&origin, sizeof(origin), 1, file) != 1) {
+        vm->image_origin = 0;
+        vm->image_length = 0;
+        return;
+    }
+    origin = swap16(origin);
+
+    size_t max_read = MEMORY_MAX - origin;
+    uint16_t *p = vm->memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+
+    vm->image_origin = origin;
+    vm->image_length = read;
+
+    swap16_block(p, p, read);
+}
+
+
+void load_object(struct lc3_vm *vm, const uint16_t *words, size_t count) {
+    uint16_t origin = swap16(words[0]);
+    size_t length = count - 1;
+
+    if (length > MEMORY_MAX - origin) {
+        length = MEMORY_MAX - origin;
+    }
+
+    swap16_block(vm->memory + origin, words + 1, length);
+
+    vm->image_origin = origin;
+    vm->image_length = length;
+}
+
+
+// Offset of the words in the file. Version 1 always put them right after the header.
+static size_t cached_image_data(const struct cached_image_header *header) {
+    size_t first = header->origin * sizeof(uint16_t);
+
+    return header->version == 1 ? CACHED_IMAGE_DATA : CACHED_IMAGE_DATA + first % CACHED_IMAGE_DATA;
+}
+
+
+bool is_cached_image(const void *data, size_t size) {
+    const struct cached_image_header *header = data;
+
+    return size >= CACHED_IMAGE_DATA
+           && memcmp(header->magic, CACHED_IMAGE_MAGIC, 4) == 0
+           && (header->version == 1 || header->version == CACHED_IMAGE_VERSION)
+           && header->byte_order == BYTE_ORDER_MARK
+           && size >= cached_image_data(header);
+}
+
+
+// Pages of memory[] wholly covered by the image are mapped from the file
+// copy-on-write. The partial pages at either end are copied, so whatever
+// other images put there is kept.
+void load_cached(struct lc3_vm *vm, int fd, const uint8_t *data, size_t size) {
+    const struct cached_image_header *header = (const void *) data;
+    uint16_t origin = header->origin;
+    size_t length = header->length;
+    size_t data_offset = cached_image_data(header);
+    size_t available = (size - data_offset) / sizeof(uint16_t);
+
+    if (length > available) {
+        length = available;
+    }
+    if (length > MEMORY_MAX - origin) {
+        length = MEMORY_MAX - origin;
+    }
+
+    const uint16_t *words = (const void *) (data + data_offset);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t first = origin * sizeof(uint16_t);
+    size_t last  = first + length * sizeof(uint16_t);
+    size_t start = (first + page - 1) / page * page;
+    size_t end   = last / page * page;
+    uint8_t *base = (uint8_t *) vm->memory;
+
+    // the padding keeps the words CACHED_IMAGE_DATA aligned, so they line
+    // up with memory[] unless the host's pages are larger than that
+    bool mappable = (uintptr_t) base % page == 0 && (data_offset - first) % page == 0;
+
+    if (!mappable || end <= start) {
+        memcpy(vm->memory + origin, words, length * sizeof(uint16_t));
+    }
+    else {
+        off_t offset = data_offset + (start - first);
+
+        if (mmap(base + start, end - start, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+            memcpy(vm->memory + origin, words, length * sizeof(uint16_t));
+        }
+        else {
+            memcpy(base + first, words, start - first);
+            memcpy(base + end, (const uint8_t *) words + (end - first), last - end);
+        }
+    }
+
+    vm->image_origin = origin;
+    vm->image_length = length;
+}
+
+
+int read_image(struct lc3_vm *vm, const char* image_path) {
+    int fd = open(image_path, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat status;
+    void *data = MAP_FAILED;
+
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size >= 2) {
+        data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (data == MAP_FAILED) {
+        FILE* file = fdopen(fd, "rb");
+
+        if (!file) {
+            close(fd);
+            return 0;
+        }
+
+        read_image_file(vm, file);
+        fclose(file);
+
+        return 1;
+    }
+
+    if (is_cached_image(data, status.st_size)) {
+        load_cached(vm, fd, data, status.st_size);
+    }
+    else {
+        load_object(vm, data, status.st_size / sizeof(uint16_t));
+    }
+
+    munmap(data, status.st_size);
+    close(fd);
+
+    return 1;
+}
+
+
+// Write the image last loaded into memory[] in the cached format.
+int write_cached_image(const struct lc3_vm *vm, const char *path) {
+    struct cached_image_header header = {
+        .magic      = CACHED_IMAGE_MAGIC,
+        .version    = CACHED_IMAGE_VERSION,
+        .byte_order = BYTE_ORDER_MARK,
+        .origin     = vm->image_origin,
+        .length     = vm->image_length
+    };
+    uint8_t padding[2 * CACHED_IMAGE_DATA] = {0};
+    size_t data_offset = cached_image_data(&header);
+
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        return 0;
+    }
+
+    memcpy(padding, &header, sizeof(header));
+
+    bool ok = fwrite(padding, 1, data_offset, file) == data_offset
+              && fwrite(vm->memory + vm->image_origin, sizeof(uint16_t), vm->image_length, file) == vm->image_length;
+
+    return fclose(file) == 0 && ok;
+}
+
+
+// Load each image `rounds` times and report the mean cost as JSON.
+void benchmark_loading(struct lc3_vm *vm, const char *image_path, int rounds) {
+    uint64_t start = monotonic_ns();
+
+    for (int i = 0; i < rounds; ++i) {
+        if (!read_image(vm, image_path)) {
+            printf("falha ao carregar a imagem: %s\n", image_path);
+            exit(1);
+        }
+    }
+
+    uint64_t elapsed = monotonic_ns() - start;
+
+    int fd = open(image_path, O_RDONLY);
+    struct cached_image_header header = {0};
+    bool cached = fd >= 0 && read(fd, &header, sizeof(header)) == sizeof(header)
+                  && memcmp(header.magic, CACHED_IMAGE_MAGIC, 4) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    fprintf(stderr, "{\"image\":\"%s\",\"format\":\"%s\",\"words\":%zu,\"ns_per_load\":%.1f}\n",
+            image_path, cached ? "cached" : "obj", vm->image_length, (double) elapsed / rounds);
+}
+
@@ -0,0 +1,626 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "lc3.h"
+
+
+/*
+ * Console event loop
+ *
+ * One thread moves the bytes that arrive on every attached console fd into
+ * its VM's keyboard ring. It sleeps in epoll_wait() or io_uring_enter()
+ * until some fd has data, and lc3_push_input() then wakes the VM if the
+ * scheduler had parked it, so a VM waiting in GETC costs nothing at all
+ * while its user types nothing. Output doesn't pass through here: each VM
+ * writes to its own fd (lc3_set_output_fd) when its buffer flushes.
+ *
+ * A console whose VM's ring is full keeps what it read and stops reading
+ * its fd until all of it went in, retried every IO_RETRY_MS. At the end of
+ * the fd the VM's input is closed, and a console whose VM halted is
+ * dropped. Consoles are only added and read on the loop thread: attaching
+ * one queues it and pokes the loop through a pipe.
+ *
+ * Console fds should be blocking sockets, pipes or terminals. Regular files
+ * can't be polled, so under epoll they read as empty.
+*/
+#if defined(__linux__)
+
+#define IO_BUFFER     4096
+#define IO_EVENTS     64
+#define IO_RETRY_MS   5
+#define URING_ENTRIES 256
+
+// user_data of the ring's own requests; consoles use their address
+#define URING_WAKE    0
+#define URING_TIMEOUT 1
+
+struct console {
+    struct lc3_vm *vm;
+    int            fd;
+    bool           added;   // known to the backend
+    bool           reading; // epoll: fd in the interest set; io_uring: a read in flight
+    bool           eof;
+    bool           done;
+    size_t         start;   // bytes read and not yet taken by the VM
+    size_t         end;
+    struct iovec   iov;
+    uint8_t        buffer[IO_BUFFER];
+};
+
+struct uring {
+    int                  fd;
+    unsigned             entries;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    void                *cq_ring;
+    size_t               sq_size;
+    size_t               cq_size;
+    unsigned             unsubmitted;
+    bool                 timeout_armed;
+    struct __kernel_timespec timeout;
+};
+
+struct lc3_io {
+    int         backend;
+    pthread_t   thread;
+    bool        started;
+    atomic_bool stopping;
+    int         wake[2];    // pipe the loop also waits on
+    uint8_t     wake_buffer[64];
+    struct iovec wake_iov;
+
+    pthread_mutex_t  lock;  // consoles and count, for lc3_io_attach()
+    struct console **consoles;
+    size_t           count;
+    size_t           capacity;
+
+    int          epoll_fd;
+    struct uring ring;
+};
+
+
+/*
+ * io_uring, straight on the system calls
+*/
+
+static int uring_enter(struct uring *ring, unsigned wait) {
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (submitted > 0) {
+        ring->unsubmitted -= submitted;
+    }
+
+    return submitted;
+}
+
+
+static void uring_push(struct uring *ring, const struct io_uring_sqe *sqe) {
+    unsigned tail = *ring->sq_tail;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries) {
+        uring_enter(ring, 0);
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+
+    ring->sqes[index]     = *sqe;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring->unsubmitted;
+}
+
+
+static void uring_read(struct uring *ring, int fd, struct iovec *iov, uint64_t user_data) {
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_READV;
+    sqe.fd        = fd;
+    sqe.addr      = (uintptr_t) iov;
+    sqe.len       = 1;
+    sqe.off       = (uint64_t) -1; // the fd's own position, like read()
+    sqe.user_data = user_data;
+    uring_push(ring, &sqe);
+}
+
+
+static void uring_timeout(struct uring *ring, int ms) {
+    struct io_uring_sqe sqe;
+
+    ring->timeout.tv_sec  = ms / 1000;
+    ring->timeout.tv_nsec = (ms % 1000) * 1000000L;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = IORING_OP_TIMEOUT;
+    sqe.fd        = -1;
+    sqe.addr      = (uintptr_t) &ring->timeout;
+    sqe.len       = 1;
+    sqe.user_data = URING_TIMEOUT;
+    uring_push(ring, &sqe);
+    ring->timeout_armed = true;
+}
+
+
+static void uring_unmap(struct uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+
+static bool uring_setup(struct uring *ring) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels put both rings in one mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    void *sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING);
+    ring->sq_ring = sq == MAP_FAILED ? NULL : sq;
+
+    if (ring->sq_ring && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else if (ring->sq_ring) {
+        void *cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+        ring->cq_ring = cq == MAP_FAILED ? NULL : cq;
+    }
+
+    void *sqes = mmap(NULL, ring->entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->sqes = sqes == MAP_FAILED ? NULL : sqes;
+
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+        uring_unmap(ring);
+        return false;
+    }
+
+    uint8_t *sq_base = ring->sq_ring;
+    uint8_t *cq_base = ring->cq_ring;
+
+    ring->sq_head  = (unsigned *) (sq_base + params.sq_off.head);
+    ring->sq_tail  = (unsigned *) (sq_base + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq_base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_base + params.sq_off.array);
+    ring->cq_head  = (unsigned *) (cq_base + params.cq_off.head);
+    ring->cq_tail  = (unsigned *) (cq_base + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *) (cq_base + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq_base + params.cq_off.cqes);
+
+    return true;
+}
+
+
+/*
+ * Consoles
+*/
+
+static bool vm_halted(struct lc3_vm *vm) {
+    pthread_mutex_lock(&vm->keyboard.lock);
+    bool halted = vm->halted;
+    pthread_mutex_unlock(&vm->keyboard.lock);
+
+    return halted;
+}
+
+
+// Start or stop waiting for the console's fd.
+static void console_arm(struct lc3_io *io, struct console *console, bool reading) {
+    if (console->reading == reading) {
+        return;
+    }
+
+    if (io->backend == LC3_IO_URING) {
+        // a read in flight can't be taken back, so only arming happens here
+        if (reading) {
+            uring_read(&io->ring, console->fd, &console->iov, (uintptr_t) console);
+            console->reading = true;
+        }
+        return;
+    }
+
+    struct epoll_event event = { .events = reading ? EPOLLIN : 0, .data.ptr = console };
+
+    epoll_ctl(io->epoll_fd, EPOLL_CTL_MOD, console->fd, &event);
+    console->reading = reading;
+}
+
+
+static void console_finish(struct lc3_io *io, struct console *console) {
+    if (io->backend == LC3_IO_EPOLL) {
+        epoll_ctl(io->epoll_fd, EPOLL_CTL_DEL, console->fd, NULL);
+    }
+
+    console->done    = true;
+    console->reading = false;
+}
+
+
+// Hand the VM what it has room for; at the end of the fd, and once it has
+// it all, the input is closed.
+static void console_push(struct lc3_io *io, struct console *console) {
+    console->start += lc3_push_input(console->vm, console->buffer + console->start,
+                                     console->end - console->start);
+
+    if (console->start < console->end) {
+        if (vm_halted(console->vm)) {
+            console_finish(io, console);
+        }
+        else {
+            console_arm(io, console, false);
+        }
+        return;
+    }
+
+    console->start = console->end = 0;
+
+    if (console->eof) {
+        lc3_close_input(console->vm);
+        console_finish(io, console);
+    }
+    else {
+        console_arm(io, console, true);
+    }
+}
+
+
+static void console_result(struct lc3_io *io, struct console *console, ssize_t result) {
+    if (io->backend == LC3_IO_URING) {
+        console->reading = false;
+    }
+
+    if (result > 0) {
+        console->end = (size_t) result;
+    }
+    else if (result == 0 || (result != -EAGAIN && result != -EINTR)) {
+        console->eof = true;
+    }
+
+    console_push(io, console);
+}
+
+
+static void console_add(struct lc3_io *io, struct console *console) {
+    console->added = true;
+
+    if (io->backend == LC3_IO_URING) {
+        console_arm(io, console, true);
+        return;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = console };
+
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, console->fd, &event) == 0) {
+        console->reading = true;
+    }
+    else {
+        console->eof = true;
+        console_push(io, console);
+    }
+}
+
+
+/*
+ * The loop
+*/
+
+// Give consoles queued by lc3_io_attach() to the backend and retry the
+// ones the VM had no room for; true if some still wait for room.
+static bool io_tend(struct lc3_io *io) {
+    bool waiting = false;
+
+    pthread_mutex_lock(&io->lock);
+
+    for (size_t i = 0; i < io->count; ++i) {
+        struct console *console = io->consoles[i];
+
+        if (!console->added) {
+            console_add(io, console);
+        }
+        else if (!console->done && console->start < console->end) {
+            console_push(io, console);
+        }
+
+        waiting |= !console->done && console->start < console->end;
+    }
+
+    pthread_mutex_unlock(&io->lock);
+
+    return waiting;
+}
+
+
+// Anything left in the pipe just wakes the loop once more.
+static void io_drain_wake(struct lc3_io *io) {
+    if (read(io->wake[0], io->wake_buffer, sizeof(io->wake_buffer)) < 0) {
+        // interrupted; the pipe stays readable
+    }
+}
+
+
+static void epoll_step(struct lc3_io *io, int timeout_ms) {
+    struct epoll_event events[IO_EVENTS];
+    int count = epoll_wait(io->epoll_fd, events, IO_EVENTS, timeout_ms);
+
+    for (int i = 0; i < count; ++i) {
+        struct console *console = events[i].data.ptr;
+
+        if (!console) {
+            io_drain_wake(io);
+            continue;
+        }
+
+        if (console->done || !console->reading) {
+            continue;
+        }
+
+        ssize_t result = read(console->fd, console->buffer, IO_BUFFER);
+        console_result(io, console, result < 0 ? -errno : result);
+    }
+}
+
+
+static void uring_step(struct lc3_io *io, int timeout_ms) {
+    struct uring *ring = &io->ring;
+
+    if (timeout_ms >= 0 && !ring->timeout_armed) {
+        uring_timeout(ring, timeout_ms);
+    }
+
+    if (uring_enter(ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+        return;
+    }
+
+    unsigned head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int result = cqe->res;
+
+        // CQ space goes back now: handling a console can queue new reads
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if (user_data == URING_WAKE) {
+            uring_read(ring, io->wake[0], &io->wake_iov, URING_WAKE);
+        }
+        else if (user_data == URING_TIMEOUT) {
+            ring->timeout_armed = false;
+        }
+        else {
+            console_result(io, (struct console *) (uintptr_t) user_data, result);
+        }
+    }
+}
+
+
+static void *io_loop(void *context) {
+    struct lc3_io *io = context;
+
+    if (io->backend == LC3_IO_URING) {
+        uring_read(&io->ring, io->wake[0], &io->wake_iov, URING_WAKE);
+    }
+
+    while (!atomic_load(&io->stopping)) {
+        int timeout_ms = io_tend(io) ? IO_RETRY_MS : -1;
+
+        if (io->backend == LC3_IO_URING) {
+            uring_step(io, timeout_ms);
+        }
+        else {
+            epoll_step(io, timeout_ms);
+        }
+    }
+
+    return NULL;
+}
+
+
+struct lc3_io *lc3_io_create(int backend) {
+    struct lc3_io *io = calloc(1, sizeof(*io));
+
+    if (!io) {
+        return NULL;
+    }
+
+    io->epoll_fd = -1;
+    io->ring.fd  = -1;
+
+    // only writes must not block: io_uring would fail a read of an empty
+    // non-blocking pipe instead of waiting for it
+    if (pipe2(io->wake, O_CLOEXEC) != 0) {
+        free(io);
+        return NULL;
+    }
+
+    fcntl(io->wake[1], F_SETFL, O_NONBLOCK);
+
+    io->wake_iov.iov_base = io->wake_buffer;
+    io->wake_iov.iov_len  = sizeof(io->wake_buffer);
+
+    if (backend != LC3_IO_EPOLL && uring_setup(&io->ring)) {
+        io->backend = LC3_IO_URING;
+    }
+    else if (backend != LC3_IO_URING && (io->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) >= 0) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+
+        io->backend = LC3_IO_EPOLL;
+        epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->wake[0], &event);
+    }
+    else {
+        close(io->wake[0]);
+        close(io->wake[1]);
+        free(io);
+        return NULL;
+    }
+
+    pthread_mutex_init(&io->lock, NULL);
+    atomic_init(&io->stopping, false);
+
+    if (pthread_create(&io->thread, NULL, io_loop, io) != 0) {
+        lc3_io_destroy(io);
+        return NULL;
+    }
+
+    io->started = true;
+
+    return io;
+}
+
+
+static void io_poke(struct lc3_io *io) {
+    char byte = 0;
+
+    if (write(io->wake[1], &byte, 1) < 0) {
+        // the pipe is full, so the loop has a wake-up pending anyway
+    }
+}
+
+
+void lc3_io_destroy(struct lc3_io *io) {
+    if (!io) {
+        return;
+    }
+
+    if (io->started) {
+        atomic_store(&io->stopping, true);
+        io_poke(io);
+        pthread_join(io->thread, NULL);
+    }
+
+    // closing the ring cancels the reads still in flight
+    if (io->backend == LC3_IO_URING) {
+        uring_unmap(&io->ring);
+    }
+    if (io->epoll_fd >= 0) {
+        close(io->epoll_fd);
+    }
+
+    for (size_t i = 0; i < io->count; ++i) {
+        free(io->consoles[i]);
+    }
+
+    close(io->wake[0]);
+    close(io->wake[1]);
+    pthread_mutex_destroy(&io->lock);
+    free(io->consoles);
+    free(io);
+}
+
+
+int lc3_io_attach(struct lc3_io *io, struct lc3_vm *vm, int fd) {
+    struct console *console = calloc(1, sizeof(*console));
+
+    if (!console) {
+        return 0;
+    }
+
+    console->vm           = vm;
+    console->fd           = fd;
+    console->iov.iov_base = console->buffer;
+    console->iov.iov_len  = IO_BUFFER;
+
+    pthread_mutex_lock(&io->lock);
+
+    if (io->count == io->capacity) {
+        size_t capacity = io->capacity ? 2 * io->capacity : 64;
+        struct console **consoles = realloc(io->consoles, capacity * sizeof(*consoles));
+
+        if (!consoles) {
+            pthread_mutex_unlock(&io->lock);
+            free(console);
+            return 0;
+        }
+
+        io->consoles = consoles;
+        io->capacity = capacity;
+    }
+
+    io->consoles[io->count++] = console;
+    pthread_mutex_unlock(&io->lock);
+
+    io_poke(io);
+
+    return 1;
+}
+
+
+const char *lc3_io_backend(const struct lc3_io *io) {
+    return io->backend == LC3_IO_URING ? "io_uring" : "epoll";
+}
+
+#else
+
+// epoll and io_uring are Linux only
+struct lc3_io *lc3_io_create(int backend) {
+    return NULL;
+}
+
+
+void lc3_io_destroy(struct lc3_io *io) {
+}
+
+
+int lc3_io_attach(struct lc3_io *io, struct lc3_vm *vm, int fd) {
+    return 0;
+}
+
+
+const char *lc3_io_backend(const struct lc3_io *io) {
+    return "none";
+}
+
+#endif
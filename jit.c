@@ -0,0 +1,547 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "lc3.h"
+
+
+
+/*
+ * Basic-block JIT
+ *
+ * The JIT core interprets one basic block at a time and counts how often
+ * each block entry is reached. Hot blocks are translated to x86-64 working
+ * directly on the VM's registers, memory and flags_result, so they leave the
+ * machine in the same state the interpreter would. A block returns to the interpreter
+ * before a TRAP, RTI or RES, before a load from a device or watched page, and
+ * right after a store into translated code, which drops all translations.
+*/
+#define JIT_THRESHOLD  64         // entries into a block before it is translated
+#define JIT_NEVER      UINT16_MAX // counter value of blocks that can't be translated
+#define JIT_MAX_BLOCK  64         // LC-3 instructions per translated block
+#define JIT_BLOCK_SIZE 8192       // upper bound of the host code of one block
+#define JIT_CODE_SIZE  (4 << 20)
+
+// returns the number of LC-3 instructions it retired, with R_PC already set
+typedef uint32_t (*jit_block)(struct lc3_vm *vm, uint16_t *memory);
+
+struct jit {
+    jit_block entry[MEMORY_MAX];   // translated block starting at each address
+    uint16_t  counters[MEMORY_MAX];
+    uint8_t   covered[MEMORY_MAX]; // words that are part of some translated block
+    uint32_t  generation;          // bumped every time translations are dropped
+
+    uint8_t *code;
+    size_t   used;
+};
+
+
+void jit_flush(struct lc3_vm *vm) {
+    struct jit *jit = vm->jit;
+
+    if (!jit) {
+        return;
+    }
+
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->counters, 0, sizeof(jit->counters));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->used = 0;
+    ++jit->generation;
+}
+
+
+void jit_destroy(struct lc3_vm *vm) {
+    if (!vm->jit) {
+        return;
+    }
+
+    if (vm->jit->code) {
+        munmap(vm->jit->code, JIT_CODE_SIZE);
+    }
+    munmap(vm->jit, sizeof(struct jit));
+    vm->jit         = NULL;
+    vm->jit_covered = NULL;
+}
+
+
+// Interpret up to and including the next control transfer.
+void jit_interpret_block(struct lc3_vm *vm) {
+    while (vm->running) {
+        struct decoded scratch;
+        const struct decoded *op = fetch(vm, &scratch);
+        ++vm->instructions;
+        op->execute(vm, op);
+
+        // a superinstruction ends where its last instruction does
+        if (op->fused) {
+            op += op->fused - 1;
+        }
+
+        switch (op->opcode) {
+            case OP_BR:
+            case OP_JMP:
+            case OP_JSR:
+            case OP_TRAP:
+                return;
+        }
+    }
+}
+
+
+#if defined(__x86_64__)
+
+// Store helper called by translated code. Returns nonzero when the store
+// hit translated code or stopped the VM, in which case the block has to
+// exit right away.
+uint32_t jit_store(struct lc3_vm *vm, uint32_t address, uint32_t value) {
+    uint32_t generation = vm->jit->generation;
+    mem_write(vm, address, value);
+    return generation != vm->jit->generation || !vm->running;
+}
+
+
+struct emitter {
+    uint8_t *code;
+    size_t   length;
+};
+
+
+void emit8(struct emitter *e, uint8_t byte) {
+    e->code[e->length++] = byte;
+}
+
+
+void emit_bytes(struct emitter *e, const uint8_t *bytes, size_t count) {
+    memcpy(e->code + e->length, bytes, count);
+    e->length += count;
+}
+
+
+void emit32(struct emitter *e, uint32_t value) {
+    memcpy(e->code + e->length, &value, sizeof(value));
+    e->length += sizeof(value);
+}
+
+
+// Host registers: rbx = vm, r12 = memory, eax/ecx/edx/edi/esi scratch.
+#define REG(r) ((uint8_t) (offsetof(struct lc3_vm, registers) + 2 * (r)))
+#define FLAGS  ((uint8_t) offsetof(struct lc3_vm, flags_result))
+
+void emit_load_register(struct emitter *e, uint8_t modrm_reg, int lc3_register) {
+    // movzx r32, word [rbx + disp8]
+    uint8_t bytes[] = { 0x0F, 0xB7, 0x43 | (modrm_reg << 3), REG(lc3_register) };
+    emit_bytes(e, bytes, sizeof(bytes));
+}
+
+
+void emit_store_ax(struct emitter *e, int lc3_register) {
+    // mov word [rbx + disp8], ax
+    uint8_t bytes[] = { 0x66, 0x89, 0x43, REG(lc3_register) };
+    emit_bytes(e, bytes, sizeof(bytes));
+}
+
+
+void emit_store_immediate(struct emitter *e, int lc3_register, uint16_t value) {
+    // mov word [rbx + disp8], imm16
+    uint8_t bytes[] = { 0x66, 0xC7, 0x43, REG(lc3_register), value & 0xFF, value >> 8 };
+    emit_bytes(e, bytes, sizeof(bytes));
+}
+
+
+void emit_mov_immediate(struct emitter *e, uint8_t host_register, uint32_t value) {
+    emit8(e, 0xB8 + host_register); // mov r32, imm32
+    emit32(e, value);
+}
+
+
+// Records ax as the flags result, like update_flags().
+void emit_update_flags(struct emitter *e) {
+    static const uint8_t bytes[] = {
+        0x0F, 0xB7, 0xC0,           // movzx eax, ax
+        0x89, 0x43, FLAGS           // mov [rbx + flags_result], eax
+    };
+    emit_bytes(e, bytes, sizeof(bytes));
+}
+
+
+// Derives the condition codes into ecx, like condition_flags().
+void emit_condition_flags(struct emitter *e) {
+    static const uint8_t bytes[] = {
+        0x8B, 0x43, FLAGS,                      // mov eax, [rbx + flags_result]
+        0x31, 0xC9,                             // xor ecx, ecx
+        0x3D, 0x00, 0x00, 0x01, 0x00,           // cmp eax, FLAGS_NONE
+        0x74, 0x18,                             // je done
+        0xB9, FLG_POS, 0x00, 0x00, 0x00,        // mov ecx, FLG_POS
+        0xBA, FLG_NEG, 0x00, 0x00, 0x00,        // mov edx, FLG_NEG
+        0x66, 0x85, 0xC0,                       // test ax, ax
+        0x0F, 0x48, 0xCA,                       // cmovs ecx, edx
+        0xBA, FLG_ZRO, 0x00, 0x00, 0x00,        // mov edx, FLG_ZRO
+        0x0F, 0x44, 0xCA                        // cmovz ecx, edx
+                                                // done:
+    };
+    emit_bytes(e, bytes, sizeof(bytes));
+}
+
+
+void emit_return(struct emitter *e, uint32_t retired) {
+    static const uint8_t epilogue[] = {
+        0x48, 0x83, 0xC4, 0x08, // add rsp, 8
+        0x41, 0x5C,             // pop r12
+        0x5B,                   // pop rbx
+        0xC3                    // ret
+    };
+    emit_mov_immediate(e, 0, retired);
+    emit_bytes(e, epilogue, sizeof(epilogue));
+}
+
+
+void emit_exit(struct emitter *e, uint16_t pc, uint32_t retired) {
+    emit_store_immediate(e, R_PC, pc);
+    emit_return(e, retired);
+}
+
+
+// Emits a jcc rel8 over an exit stub, taken when the exit is not needed.
+void emit_guarded_exit(struct emitter *e, uint8_t skip_opcode, uint16_t pc, uint32_t retired) {
+    emit8(e, skip_opcode);
+    emit8(e, 0);
+    size_t patch = e->length;
+    emit_exit(e, pc, retired);
+    e->code[patch - 1] = (uint8_t) (e->length - patch);
+}
+
+
+// Load memory[eax] into eax, leaving the block at pc when eax is on one
+// of the `special` pages.
+void emit_load_dynamic(struct emitter *e, uint32_t special, uint16_t pc, uint32_t retired) {
+    static const uint8_t page[] = {
+        0x89, 0xC1,                 // mov ecx, eax
+        0xC1, 0xE9, PAGE_SHIFT      // shr ecx, PAGE_SHIFT
+    };
+    static const uint8_t test[] = { 0x0F, 0xA3, 0xCA };             // bt edx, ecx
+    static const uint8_t load[] = { 0x41, 0x0F, 0xB7, 0x04, 0x44 }; // movzx eax, word [r12 + rax*2]
+
+    emit_bytes(e, page, sizeof(page));
+    emit_mov_immediate(e, 2, special);       // edx
+    emit_bytes(e, test, sizeof(test));
+    emit_guarded_exit(e, 0x73, pc, retired); // jnc
+    emit_bytes(e, load, sizeof(load));
+}
+
+
+// Loads here have to be left to the interpreter.
+static bool on_special_page(uint32_t special, uint16_t address) {
+    return special >> (address >> PAGE_SHIFT) & 1;
+}
+
+
+void emit_load_constant(struct emitter *e, uint16_t address) {
+    static const uint8_t load[] = { 0x41, 0x0F, 0xB7, 0x84, 0x24 }; // movzx eax, word [r12 + disp32]
+    emit_bytes(e, load, sizeof(load));
+    emit32(e, 2u * address);
+}
+
+
+// mem_write(vm, esi, edx) through jit_store, leaving the block at next_pc
+// when the store invalidated translated code.
+void emit_store_call(struct emitter *e, uint16_t next_pc, uint32_t retired) {
+    static const uint8_t vm[]   = { 0x48, 0x89, 0xDF }; // mov rdi, rbx
+    static const uint8_t call[] = { 0xFF, 0xD0 };       // call rax
+    static const uint8_t test[] = { 0x85, 0xC0 };       // test eax, eax
+    uint64_t target = (uint64_t) (uintptr_t) jit_store;
+
+    emit_bytes(e, vm, sizeof(vm));
+    emit8(e, 0x48);                                     // movabs rax, jit_store
+    emit8(e, 0xB8);
+    emit32(e, (uint32_t) target);
+    emit32(e, (uint32_t) (target >> 32));
+    emit_bytes(e, call, sizeof(call));
+    emit_bytes(e, test, sizeof(test));
+    emit_guarded_exit(e, 0x74, next_pc, retired);       // jz
+}
+
+
+// Wrap the address computed in eax to 16 bits.
+void emit_wrap_ax(struct emitter *e) {
+    static const uint8_t movzx[] = { 0x0F, 0xB7, 0xC0 }; // movzx eax, ax
+    emit_bytes(e, movzx, sizeof(movzx));
+}
+
+
+// Translates the block starting at start. Returns false when not even its
+// first instruction can be translated.
+bool jit_compile(struct lc3_vm *vm, uint16_t start) {
+    static const uint8_t prologue[] = {
+        0x53,                   // push rbx
+        0x41, 0x54,             // push r12
+        0x48, 0x83, 0xEC, 0x08, // sub rsp, 8, keeps calls 16-byte aligned
+        0x48, 0x89, 0xFB,       // mov rbx, rdi
+        0x49, 0x89, 0xF4        // mov r12, rsi
+    };
+    struct jit *jit = vm->jit;
+
+    if (!jit->code) {
+        void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+            return false;
+        }
+        jit->code = code;
+    }
+
+    if (jit->used + JIT_BLOCK_SIZE > JIT_CODE_SIZE) {
+        jit_flush(vm);
+    }
+
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+
+    struct emitter e = { jit->code + jit->used, 0 };
+    emit_bytes(&e, prologue, sizeof(prologue));
+
+    // watches change only between runs, and flush translations when they do
+    uint32_t special = vm->special_pages;
+    uint16_t pc = start;
+    uint32_t count = 0;
+    bool open = true;
+
+    while (open) {
+        if (count == JIT_MAX_BLOCK || device_page(vm, pc)) {
+            emit_exit(&e, pc, count);
+            break;
+        }
+
+        struct decoded op;
+        decode(vm->memory[pc], &op);
+
+        uint16_t next = pc + 1;
+        uint16_t target;
+
+        switch (op.opcode) {
+            case OP_ADD:
+            case OP_AND: {
+                static const uint8_t add_ecx[] = { 0x01, 0xC8 }; // add eax, ecx
+                static const uint8_t and_ecx[] = { 0x21, 0xC8 }; // and eax, ecx
+
+                emit_load_register(&e, 0, op.register1);
+                if (op.flag) {
+                    emit8(&e, op.opcode == OP_ADD ? 0x05 : 0x25); // add/and eax, imm32
+                    emit32(&e, op.offset);
+                }
+                else {
+                    emit_load_register(&e, 1, op.register2);
+                    emit_bytes(&e, op.opcode == OP_ADD ? add_ecx : and_ecx, 2);
+                }
+                emit_store_ax(&e, op.register0);
+                emit_update_flags(&e);
+                break;
+            }
+            case OP_NOT: {
+                static const uint8_t not_eax[] = { 0xF7, 0xD0 };
+
+                emit_load_register(&e, 0, op.register1);
+                emit_bytes(&e, not_eax, sizeof(not_eax));
+                emit_store_ax(&e, op.register0);
+                emit_update_flags(&e);
+                break;
+            }
+            case OP_LEA:
+                emit_mov_immediate(&e, 0, (uint16_t) (next + op.offset));
+                emit_store_ax(&e, op.register0);
+                emit_update_flags(&e);
+                break;
+            case OP_LD:
+                target = next + op.offset;
+                if (on_special_page(special, target)) {
+                    emit_exit(&e, pc, count);
+                    open = false;
+                    continue;
+                }
+                emit_load_constant(&e, target);
+                emit_store_ax(&e, op.register0);
+                emit_update_flags(&e);
+                break;
+            case OP_LDI:
+                target = next + op.offset;
+                if (on_special_page(special, target)) {
+                    emit_exit(&e, pc, count);
+                    open = false;
+                    continue;
+                }
+                emit_load_constant(&e, target);
+                emit_load_dynamic(&e, special, pc, count);
+                emit_store_ax(&e, op.register0);
+                emit_update_flags(&e);
+                break;
+            case OP_LDR:
+                emit_load_register(&e, 0, op.register1);
+                emit8(&e, 0x05);                        // add eax, offset6
+                emit32(&e, op.offset);
+                emit_wrap_ax(&e);
+                emit_load_dynamic(&e, special, pc, count);
+                emit_store_ax(&e, op.register0);
+                emit_update_flags(&e);
+                break;
+            case OP_ST:
+                emit_mov_immediate(&e, 6, (uint16_t) (next + op.offset)); // esi
+                emit_load_register(&e, 2, op.register0);                  // edx
+                emit_store_call(&e, next, count + 1);
+                break;
+            case OP_STI: {
+                static const uint8_t mov_esi_eax[] = { 0x89, 0xC6 };
+
+                target = next + op.offset;
+                if (on_special_page(special, target)) {
+                    emit_exit(&e, pc, count);
+                    open = false;
+                    continue;
+                }
+                emit_load_constant(&e, target);
+                emit_bytes(&e, mov_esi_eax, sizeof(mov_esi_eax));
+                emit_load_register(&e, 2, op.register0);
+                emit_store_call(&e, next, count + 1);
+                break;
+            }
+            case OP_STR: {
+                static const uint8_t mov_esi_eax[] = { 0x89, 0xC6 };
+
+                emit_load_register(&e, 0, op.register1);
+                emit8(&e, 0x05);
+                emit32(&e, op.offset);
+                emit_wrap_ax(&e);
+                emit_bytes(&e, mov_esi_eax, sizeof(mov_esi_eax));
+                emit_load_register(&e, 2, op.register0);
+                emit_store_call(&e, next, count + 1);
+                break;
+            }
+            case OP_BR:
+                target = next + op.offset;
+                if (op.register0 == 0x7) {
+                    emit_exit(&e, target, count + 1);
+                }
+                else if (op.register0 == 0) {
+                    emit_exit(&e, next, count + 1);
+                }
+                else {
+                    static const uint8_t select[] = {
+                        0x0F, 0x45, 0xF2,           // cmovnz esi, edx
+                        0x66, 0x89, 0x73, REG(R_PC) // mov word [rbx + R_PC], si
+                    };
+
+                    emit_condition_flags(&e);
+                    emit8(&e, 0xF6);                // test cl, nzp
+                    emit8(&e, 0xC1);
+                    emit8(&e, op.register0);
+                    emit_mov_immediate(&e, 6, next);
+                    emit_mov_immediate(&e, 2, target);
+                    emit_bytes(&e, select, sizeof(select));
+                    emit_return(&e, count + 1);
+                }
+                open = false;
+                break;
+            case OP_JMP:
+                emit_load_register(&e, 0, op.register1);
+                emit_store_ax(&e, R_PC);
+                emit_return(&e, count + 1);
+                open = false;
+                break;
+            case OP_JSR:
+                emit_store_immediate(&e, R7, next);
+                if (op.flag) {
+                    emit_store_immediate(&e, R_PC, next + op.offset);
+                }
+                else {
+                    emit_load_register(&e, 0, op.register1);
+                    emit_store_ax(&e, R_PC);
+                }
+                emit_return(&e, count + 1);
+                open = false;
+                break;
+            default:
+                // TRAP, RTI and RES are left to the interpreter
+                emit_exit(&e, pc, count);
+                open = false;
+                continue;
+        }
+
+        ++count;
+        pc = next;
+    }
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+
+    if (count == 0) {
+        return false;
+    }
+
+    for (uint16_t address = start; address != pc; ++address) {
+        jit->covered[address] = 1;
+    }
+
+    jit->entry[start] = (jit_block) (void *) (jit->code + jit->used);
+    jit->used += e.length;
+
+    return true;
+}
+
+
+void run_jit(struct lc3_vm *vm) {
+    if (!vm->jit) {
+        void *jit = mmap(NULL, sizeof(struct jit), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit == MAP_FAILED) {
+            run_call(vm);
+            return;
+        }
+        vm->jit         = jit;
+        vm->jit_covered = vm->jit->covered;
+    }
+
+    struct jit *jit = vm->jit;
+
+    // translated blocks don't run the handlers' budget checks, so they are
+    // made here, once per block
+    while (vm->running && vm->instructions < vm->budget_check) {
+        uint16_t pc = vm->registers[R_PC];
+        jit_block block = jit->entry[pc];
+
+        if (block) {
+            uint32_t retired = block(vm, vm->memory);
+            vm->instructions += retired;
+
+            if (retired > 0) {
+                continue;
+            }
+        }
+        else if (jit->counters[pc] < JIT_THRESHOLD) {
+            ++jit->counters[pc];
+        }
+        else if (jit->counters[pc] == JIT_THRESHOLD) {
+            if (jit_compile(vm, pc)) {
+                continue;
+            }
+            jit->counters[pc] = JIT_NEVER;
+        }
+
+        jit_interpret_block(vm);
+    }
+}
+
+#else
+
+void run_jit(struct lc3_vm *vm) {
+    static bool warned;
+
+    if (!warned) {
+        fprintf(stderr, "JIT disponível apenas em x86-64, usando o núcleo call\n");
+        warned = true;
+    }
+    run_call(vm);
+}
+
+#endif
@@ -0,0 +1,2015 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "lc3.h"
+
+
+const char *core_names[CORE_COUNT] = { "call", "threaded", "jit", "block" };
+
+
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+
+/*
+ * Keyboard device
+*/
+
+size_t lc3_push_input(struct lc3_vm *vm, const void *data, size_t length) {
+    struct lc3_keyboard *keyboard = &vm->keyboard;
+    unsigned head = atomic_load_explicit(&keyboard->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&keyboard->tail, memory_order_acquire);
+    size_t room = KEYBOARD_BUFFER - (head - tail);
+    size_t count = length < room ? length : room;
+
+    for (size_t i = 0; i < count; ++i) {
+        keyboard->buffer[(head + i) % KEYBOARD_BUFFER] = ((const uint8_t *) data)[i];
+    }
+
+    pthread_mutex_lock(&keyboard->lock);
+    atomic_store_explicit(&keyboard->head, head + (unsigned) count, memory_order_release);
+    pthread_cond_broadcast(&keyboard->changed);
+    pthread_mutex_unlock(&keyboard->lock);
+
+    if (vm->sched && count > 0) {
+        sched_wake(vm);
+    }
+
+    return count;
+}
+
+
+int lc3_wait_input_space(struct lc3_vm *vm) {
+    struct lc3_keyboard *keyboard = &vm->keyboard;
+    unsigned head = atomic_load_explicit(&keyboard->head, memory_order_relaxed);
+
+    pthread_mutex_lock(&keyboard->lock);
+    atomic_store(&keyboard->producer_waiting, true);
+    while (head - atomic_load(&keyboard->tail) == KEYBOARD_BUFFER && !vm->halted) {
+        pthread_cond_wait(&keyboard->changed, &keyboard->lock);
+    }
+    atomic_store(&keyboard->producer_waiting, false);
+    bool halted = vm->halted;
+    pthread_mutex_unlock(&keyboard->lock);
+
+    return !halted;
+}
+
+
+void lc3_close_input(struct lc3_vm *vm) {
+    pthread_mutex_lock(&vm->keyboard.lock);
+    atomic_store(&vm->keyboard.eof, true);
+    pthread_cond_broadcast(&vm->keyboard.changed);
+    pthread_mutex_unlock(&vm->keyboard.lock);
+
+    if (vm->sched) {
+        sched_wake(vm);
+    }
+}
+
+
+void lc3_interrupt(struct lc3_vm *vm) {
+    // a lone lock-free store, so a signal handler may call this
+    atomic_store(&vm->keyboard.interrupted, true);
+}
+
+
+void lc3_reset_input(struct lc3_vm *vm) {
+    pthread_mutex_lock(&vm->keyboard.lock);
+    atomic_store(&vm->keyboard.tail, atomic_load(&vm->keyboard.head));
+    atomic_store(&vm->keyboard.eof, false);
+    pthread_mutex_unlock(&vm->keyboard.lock);
+}
+
+
+void lc3_set_input_script(struct lc3_vm *vm, const void *keys, size_t length, const uint64_t *at) {
+    vm->keyboard.script        = keys;
+    vm->keyboard.script_at     = at;
+    vm->keyboard.script_length = length;
+    vm->keyboard.script_next   = 0;
+    vm->keyboard.script_end    = 0;
+}
+
+
+// A key is pending, or input is closed and getchar() would give EOF.
+bool keyboard_ready(struct lc3_vm *vm) {
+    const struct lc3_keyboard *keyboard = &vm->keyboard;
+
+    if (keyboard->script) {
+        if (!keyboard->script_at) {
+            return true;
+        }
+
+        return keyboard->script_next == keyboard->script_length
+               ? keyboard->script_end <= vm->instructions
+               : keyboard->script_at[keyboard->script_next] <= vm->instructions;
+    }
+
+    return atomic_load_explicit(&vm->keyboard.head, memory_order_acquire)
+             != atomic_load_explicit(&vm->keyboard.tail, memory_order_relaxed)
+           || atomic_load_explicit(&vm->keyboard.eof, memory_order_relaxed);
+}
+
+
+// Sleep until a key is pending, the VM is interrupted or timeout_ns passes;
+// 0 waits for one of the first two. lc3_interrupt() can't signal the
+// condition, so the sleep is cut into naps of at most KEYBOARD_POLL_NS.
+void keyboard_wait(struct lc3_vm *vm, uint64_t timeout_ns) {
+    struct lc3_keyboard *keyboard = &vm->keyboard;
+
+    if (keyboard->script) {
+        return;
+    }
+
+    uint64_t start = monotonic_ns();
+
+    pthread_mutex_lock(&keyboard->lock);
+    while (!keyboard_ready(vm) && !atomic_load(&keyboard->interrupted)) {
+        uint64_t waited = monotonic_ns() - start;
+        uint64_t nap = KEYBOARD_POLL_NS;
+
+        if (timeout_ns && waited >= timeout_ns) {
+            break;
+        }
+        if (timeout_ns && timeout_ns - waited < nap) {
+            nap = timeout_ns - waited;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += nap / 1000000000u;
+        deadline.tv_nsec += nap % 1000000000u;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec  += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&keyboard->changed, &keyboard->lock, &deadline);
+    }
+    pthread_mutex_unlock(&keyboard->lock);
+
+    vm->stats.input_wait_ns += monotonic_ns() - start;
+}
+
+
+// With nonblocking_input, or once interrupted, stop the VM instead of
+// waiting for a key that isn't there. `rewind` puts PC back on the
+// instruction doing the read.
+static bool input_starved(struct lc3_vm *vm, bool rewind) {
+    bool stopping = vm->nonblocking_input || atomic_load(&vm->keyboard.interrupted);
+
+    if (!stopping || vm->keyboard.script || keyboard_ready(vm)) {
+        return false;
+    }
+
+    if (rewind) {
+        --vm->registers[R_PC];
+        --vm->instructions;
+    }
+
+    stop_run(vm, LC3_INPUT);
+
+    return true;
+}
+
+
+// GETC and IN: wait for a key, unless the VM stops instead, rewound.
+static bool key_starved(struct lc3_vm *vm) {
+    if (!vm->nonblocking_input && !keyboard_ready(vm)) {
+        keyboard_wait(vm, 0);
+    }
+
+    return input_starved(vm, true);
+}
+
+
+static int keyboard_take(struct lc3_vm *vm) {
+    struct lc3_keyboard *keyboard = &vm->keyboard;
+
+    if (keyboard->script) {
+        return keyboard->script_next < keyboard->script_length
+               ? keyboard->script[keyboard->script_next++] : EOF;
+    }
+
+    if (!keyboard_ready(vm)) {
+        keyboard_wait(vm, 0);
+    }
+
+    unsigned tail = atomic_load_explicit(&keyboard->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&keyboard->head, memory_order_acquire)) {
+        return EOF;
+    }
+
+    int key = keyboard->buffer[tail % KEYBOARD_BUFFER];
+    atomic_store_explicit(&keyboard->tail, tail + 1, memory_order_release);
+
+    if (atomic_load(&keyboard->producer_waiting)) {
+        pthread_mutex_lock(&keyboard->lock);
+        pthread_cond_broadcast(&keyboard->changed);
+        pthread_mutex_unlock(&keyboard->lock);
+    }
+
+    return key;
+}
+
+
+// Next key, or -1 at end of input, like getchar(). Blocks while the ring is empty.
+int keyboard_getc(struct lc3_vm *vm) {
+    int key = keyboard_take(vm);
+
+    if (vm->recording) {
+        record_key(vm, key);
+    }
+
+    return key;
+}
+
+
+/*
+ * Console output
+*/
+
+void lc3_configure_output(struct lc3_vm *vm, size_t size, int mode) {
+    struct lc3_output *output = &vm->output;
+
+    lc3_flush_output(vm);
+    free(output->buffer);
+    output->buffer = NULL;
+    output->size   = 0;
+    output->mode   = mode;
+
+    if (mode != OUTPUT_RAW && size > 0) {
+        output->buffer = malloc(size);
+        output->size   = output->buffer ? size : 0;
+    }
+}
+
+
+void lc3_set_output_fd(struct lc3_vm *vm, int fd) {
+    lc3_flush_output(vm);
+    vm->output.fd     = fd;
+    vm->output.sink   = NULL;
+    vm->output.closed = false;
+}
+
+
+void lc3_set_output_sink(struct lc3_vm *vm, output_sink sink, void *context) {
+    lc3_flush_output(vm);
+    vm->output.sink         = sink;
+    vm->output.sink_context = context;
+}
+
+
+static void halt_machine(struct lc3_vm *vm);
+
+
+static void output_emit(struct lc3_vm *vm, const char *data, size_t length) {
+    struct lc3_output *output = &vm->output;
+
+    if (output->sink) {
+        output->sink(output->sink_context, data, length);
+        return;
+    }
+
+    while (length > 0 && !output->closed) {
+        ssize_t written = write(output->fd, data, length);
+
+        if (written < 0 && errno == EPIPE) {
+            output->closed = true;
+        }
+        else if (written < 0) {
+            return;
+        }
+        else {
+            data   += written;
+            length -= written;
+        }
+    }
+
+    // nobody is left to read the console
+    if (output->closed && !vm->halted) {
+        halt_machine(vm);
+    }
+}
+
+
+void lc3_flush_output(struct lc3_vm *vm) {
+    struct lc3_output *output = &vm->output;
+
+    if (output->used > 0) {
+        size_t used = output->used;
+
+        output->used = 0;
+        ++vm->stats.flushes;
+        output_emit(vm, output->buffer, used);
+    }
+}
+
+
+void output_write(struct lc3_vm *vm, const char *data, size_t length) {
+    struct lc3_output *output = &vm->output;
+
+    if (output->size == 0) {
+        output_emit(vm, data, length);
+        ++vm->stats.flushes;
+        return;
+    }
+
+    if (output->used == 0) {
+        output->pending_since = monotonic_ns();
+
+        // end the pass within RUN_CLOCK_STRIDE, so run_until() flushes in
+        // time even if the program only computes from here on
+        if (vm->budget_check > vm->instructions + RUN_CLOCK_STRIDE) {
+            vm->budget_check = vm->instructions + RUN_CLOCK_STRIDE;
+        }
+    }
+
+    while (length > 0) {
+        size_t room = output->size - output->used;
+        size_t count = length < room ? length : room;
+
+        memcpy(output->buffer + output->used, data, count);
+        output->used += count;
+        data   += count;
+        length -= count;
+
+        if (output->used == output->size) {
+            lc3_flush_output(vm);
+        }
+    }
+
+    if (output->mode == OUTPUT_LINE && output->used > 0
+        && memchr(output->buffer, '\n', output->used)) {
+        lc3_flush_output(vm);
+    }
+}
+
+
+void output_putc(struct lc3_vm *vm, char char_) {
+    output_write(vm, &char_, 1);
+}
+
+
+// Timer check, called after trap output, while a program polls KBSR and
+// between the passes of a run.
+void output_tick(struct lc3_vm *vm) {
+    if (vm->output.used > 0 && monotonic_ns() - vm->output.pending_since >= OUTPUT_FLUSH_NS) {
+        lc3_flush_output(vm);
+    }
+}
+
+
+/*
+ * Memory access procedures
+*/
+void forget_decoded(struct lc3_vm *vm, uint16_t address) {
+    struct decoded *cache = vm->decode_cache;
+
+    // tested first so that stores into data never touch a cache page
+    // shared with other VMs
+    if (cache[address].execute) {
+        cache[address].execute = NULL;
+        cache[address].label   = NULL;
+    }
+
+    for (uint16_t back = 1; back < FUSION_MAX; ++back) {
+        struct decoded *group = &cache[(uint16_t) (address - back)];
+
+        if (group->fused > back) {
+            group->execute = NULL;
+            group->label   = NULL;
+            group->fused   = 0;
+        }
+    }
+}
+
+
+static void ram_write(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    vm->memory[address] = value;
+    vm->dirty_pages |= 1u << (address >> PAGE_SHIFT);
+    forget_decoded(vm, address);
+
+    if (vm->jit_covered && vm->jit_covered[address]) {
+        jit_flush(vm);
+    }
+
+    // the block running may hold the old word, so the pass starts over
+    if (vm->blocks_covered && vm->blocks_covered[address]) {
+        blocks_flush(vm);
+        vm->running = false;
+    }
+}
+
+
+static inline bool special_page(const struct lc3_vm *vm, uint16_t address) {
+    return vm->special_pages >> (address >> PAGE_SHIFT) & 1;
+}
+
+
+// The device on `address`, newest first so one can be put over another.
+static const struct lc3_device *device_at(const struct lc3_vm *vm, uint16_t address) {
+    for (int i = vm->device_count - 1; i >= 0; --i) {
+        const struct lc3_device *device = &vm->devices[i];
+
+        if (device->first <= address && address <= device->last) {
+            return device;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Stop the run once the instruction making a watched access completes.
+static void watch_access(struct lc3_vm *vm, uint16_t address, uint16_t value, bool write) {
+    if (!(vm->watch_pages >> (address >> PAGE_SHIFT) & 1) || vm->halted) {
+        return;
+    }
+
+    for (int i = 0; i < vm->watch_count; ++i) {
+        const struct lc3_watch *watch = &vm->watches[i];
+
+        if (watch->first <= address && address <= watch->last
+            && (watch->kind & (write ? LC3_WATCH_WRITE : LC3_WATCH_READ))) {
+            vm->watch_address = address;
+            vm->watch_value   = value;
+            vm->watch_write   = write;
+            stop_run(vm, LC3_WATCH);
+            return;
+        }
+    }
+}
+
+
+// What a store onto a device or watched page does besides ram_write().
+static void special_write(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    const struct lc3_device *device = device_at(vm, address);
+
+    if (device && device->write) {
+        device->write(vm, address, value, device->context);
+    }
+
+    watch_access(vm, address, value, true);
+}
+
+
+static uint16_t device_read(struct lc3_vm *vm, uint16_t address) {
+    const struct lc3_device *device = device_at(vm, address);
+
+    return device && device->read ? device->read(vm, address, device->context) : vm->memory[address];
+}
+
+
+static uint16_t special_read(struct lc3_vm *vm, uint16_t address) {
+    uint16_t value = device_read(vm, address);
+
+    watch_access(vm, address, value, false);
+
+    return value;
+}
+
+
+void mem_write(struct lc3_vm *vm, uint16_t address, uint16_t value) {
+    ram_write(vm, address, value);
+
+    if (special_page(vm, address)) {
+        special_write(vm, address, value);
+    }
+}
+
+
+uint16_t mem_read(struct lc3_vm *vm, uint16_t address) {
+    if (special_page(vm, address)) {
+        return special_read(vm, address);
+    }
+
+    return vm->memory[address];
+}
+
+
+int lc3_map_device(struct lc3_vm *vm, uint16_t first, uint16_t last,
+                   lc3_device_read read, lc3_device_write write, void *context) {
+    if (vm->device_count == DEVICE_MAX || last < first) {
+        return 0;
+    }
+
+    vm->devices[vm->device_count++] = (struct lc3_device) { first, last, read, write, context };
+
+    for (uint32_t page = first >> PAGE_SHIFT; page <= (uint32_t) last >> PAGE_SHIFT; ++page) {
+        if (!(vm->device_pages & (1u << page))) {
+            // code is never cached from a device page, fetches read it
+            // through mem_read
+            vm->device_pages  |= 1u << page;
+            vm->special_pages |= 1u << page;
+            invalidate_range(vm, page * PAGE_WORDS, PAGE_WORDS);
+        }
+    }
+
+    return 1;
+}
+
+
+int lc3_watch(struct lc3_vm *vm, uint16_t first, uint16_t last, int kind) {
+    if (vm->watch_count == WATCH_MAX || last < first) {
+        return 0;
+    }
+
+    vm->watches[vm->watch_count++] = (struct lc3_watch) { first, last, kind };
+
+    for (uint32_t page = first >> PAGE_SHIFT; page <= (uint32_t) last >> PAGE_SHIFT; ++page) {
+        vm->watch_pages   |= 1u << page;
+        vm->special_pages |= 1u << page;
+    }
+
+    // translated loads test the pages as they were when translated
+    jit_flush(vm);
+
+    return 1;
+}
+
+
+void lc3_clear_watches(struct lc3_vm *vm) {
+    vm->watch_count   = 0;
+    vm->watch_pages   = 0;
+    vm->special_pages = vm->device_pages;
+    jit_flush(vm);
+}
+
+
+/*
+ * Built-in devices
+*/
+
+static uint16_t keyboard_status(struct lc3_vm *vm, uint16_t address, void *context) {
+    ++vm->stats.kbsr_polls;
+
+    if (keyboard_ready(vm)) {
+        ram_write(vm, MR_KBSR, 1 << 15);
+        ram_write(vm, MR_KBDR, keyboard_getc(vm));
+        vm->idle_polls = 0;
+    }
+    else {
+        ram_write(vm, MR_KBSR, 0);
+        output_tick(vm);
+
+        // a program spinning on an empty KBSR sleeps until a key comes,
+        // or under a scheduler gives up its worker
+        if (vm->nonblocking_input && ++vm->idle_polls >= IDLE_POLLS) {
+            vm->idle_polls = 0;
+            input_starved(vm, false);
+        }
+        else if (vm->idle_detection && ++vm->idle_polls >= IDLE_POLLS) {
+            lc3_flush_output(vm);
+            keyboard_wait(vm, IDLE_NAP_NS);
+        }
+    }
+
+    return vm->memory[MR_KBSR];
+}
+
+
+// output is buffered, so the display is always ready
+static uint16_t display_status(struct lc3_vm *vm, uint16_t address, void *context) {
+    return 1 << 15;
+}
+
+
+static void display_data(struct lc3_vm *vm, uint16_t address, uint16_t value, void *context) {
+    output_putc(vm, (char) value);
+    output_tick(vm);
+}
+
+
+static void halt_machine(struct lc3_vm *vm) {
+    lc3_flush_output(vm);
+    settle_flags(vm);
+
+    // lets a producer stuck in lc3_wait_input_space() go
+    pthread_mutex_lock(&vm->keyboard.lock);
+    vm->halted = true;
+    pthread_cond_broadcast(&vm->keyboard.changed);
+    pthread_mutex_unlock(&vm->keyboard.lock);
+
+    vm->exit_reason = LC3_HALTED;
+    vm->running = false;
+}
+
+
+// the clock bit reads as set for as long as code runs to read it
+static uint16_t machine_control(struct lc3_vm *vm, uint16_t address, void *context) {
+    return vm->memory[MR_MCR] | 1 << 15;
+}
+
+
+static void machine_control_write(struct lc3_vm *vm, uint16_t address, uint16_t value, void *context) {
+    if (!(value & 1 << 15)) {
+        halt_machine(vm);
+    }
+}
+
+
+void invalidate_range(struct lc3_vm *vm, uint16_t origin, size_t length) {
+    for (size_t i = 0; i < length && origin + i < MEMORY_MAX; ++i) {
+        forget_decoded(vm, origin + i);
+        vm->dirty_pages |= 1u << ((origin + i) >> PAGE_SHIFT);
+    }
+
+    if (vm->jit) {
+        jit_flush(vm);
+    }
+
+    blocks_flush(vm);
+}
+
+
+/*
+ * CPU Procedures
+*/
+
+uint16_t sign_extend(uint16_t x, int num_bits) {
+    if ((x >> (num_bits - 1)) & 1) {
+        x |= (0xFFFF << num_bits);
+    }
+    return x;
+}
+
+
+static void update_flags(struct lc3_vm *vm, uint16_t register_) {
+    vm->flags_result = vm->registers[register_];
+}
+
+
+// The N, Z or P bit for a pending flags result.
+static inline uint16_t flags_of(uint32_t result) {
+    if (result == FLAGS_NONE) {
+        return 0;
+    }
+    else if (result == 0) {
+        return FLG_ZRO;
+    }
+    else if (result >> 15) {
+        return FLG_NEG;
+    }
+    else {
+        return FLG_POS;
+    }
+}
+
+
+uint16_t condition_flags(const struct lc3_vm *vm) {
+    return flags_of(vm->flags_result);
+}
+
+
+// Make registers[R_COND] reflect the pending flags.
+void settle_flags(struct lc3_vm *vm) {
+    vm->registers[R_COND] = condition_flags(vm);
+}
+
+
+static void add(struct lc3_vm *vm, const struct decoded *op) {
+    uint16_t *registers = vm->registers;
+
+    if (op->flag) {
+        registers[op->register0] = registers[op->register1] + op->offset;
+    }
+    else {
+        registers[op->register0] = registers[op->register1] + registers[op->register2];
+    }
+
+    update_flags(vm, op->register0);
+}
+
+
+static void ldi(struct lc3_vm *vm, const struct decoded *op) {
+    vm->registers[op->register0] = mem_read(vm, mem_read(vm, vm->registers[R_PC] + op->offset));
+    update_flags(vm, op->register0);
+}
+
+
+static void and(struct lc3_vm *vm, const struct decoded *op) {
+    uint16_t *registers = vm->registers;
+
+    if (op->flag) {
+        registers[op->register0] = registers[op->register1] & op->offset;
+    }
+    else {
+        registers[op->register0] = registers[op->register1] & registers[op->register2];
+    }
+
+    update_flags(vm, op->register0);
+}
+
+
+static void not(struct lc3_vm *vm, const struct decoded *op) {
+    vm->registers[op->register0] = ~vm->registers[op->register1];
+    update_flags(vm, op->register0);
+}
+
+
+// Control transfers are where a run notices its budget is used up, so the
+// interpreter loops only test `running`.
+static inline void check_budget(struct lc3_vm *vm) {
+    if (vm->instructions >= vm->budget_check) {
+        vm->running = false;
+    }
+}
+
+
+static void br(struct lc3_vm *vm, const struct decoded *op) {
+    if (op->register0 & condition_flags(vm)) {
+        vm->registers[R_PC] += op->offset;
+    }
+
+    check_budget(vm);
+}
+
+
+static void jmp(struct lc3_vm *vm, const struct decoded *op) {
+    vm->registers[R_PC] = vm->registers[op->register1];
+    check_budget(vm);
+}
+
+
+static void jsr(struct lc3_vm *vm, const struct decoded *op) {
+    uint16_t *registers = vm->registers;
+
+    registers[R7] = registers[R_PC];
+
+    if (op->flag) {
+        registers[R_PC] += op->offset;              // JSR
+    }
+    else {
+        registers[R_PC] = registers[op->register1]; // JSRR
+    }
+
+    check_budget(vm);
+}
+
+
+static void ld(struct lc3_vm *vm, const struct decoded *op) {
+    vm->registers[op->register0] = mem_read(vm, vm->registers[R_PC] + op->offset);
+    update_flags(vm, op->register0);
+}
+
+
+static void ldr(struct lc3_vm *vm, const struct decoded *op) {
+    vm->registers[op->register0] = mem_read(vm, vm->registers[op->register1] + op->offset);
+    update_flags(vm, op->register0);
+}
+
+
+static void lea(struct lc3_vm *vm, const struct decoded *op) {
+    vm->registers[op->register0] = vm->registers[R_PC] + op->offset;
+    update_flags(vm, op->register0);
+}
+
+
+static void st(struct lc3_vm *vm, const struct decoded *op) {
+    mem_write(vm, vm->registers[R_PC] + op->offset, vm->registers[op->register0]);
+}
+
+
+static void sti(struct lc3_vm *vm, const struct decoded *op) {
+    mem_write(vm, mem_read(vm, vm->registers[R_PC] + op->offset), vm->registers[op->register0]);
+}
+
+
+static void str(struct lc3_vm *vm, const struct decoded *op) {
+    mem_write(vm, vm->registers[op->register1] + op->offset, vm->registers[op->register0]);
+}
+
+
+static void illegal(struct lc3_vm *vm, const struct decoded *op) {
+    --vm->registers[R_PC];
+    --vm->instructions;
+    stop_run(vm, LC3_ILLEGAL);
+}
+
+/*
+ * TRAP codes procedures implementation
+*/
+
+// Strings go to the output a chunk at a time, and one without a zero
+// ends with the last word of memory instead of wrapping around.
+#define STRING_CHUNK 1024
+
+static bool trap_puts(struct lc3_vm *vm, uint8_t vector, void *context) {
+    const uint16_t *string = vm->memory + vm->registers[R0];
+    size_t length = words_length(string, MEMORY_MAX - vm->registers[R0]);
+    char chunk[STRING_CHUNK];
+
+    for (size_t done = 0; done < length; done += STRING_CHUNK) {
+        size_t count = length - done < STRING_CHUNK ? length - done : STRING_CHUNK;
+
+        words_pack(chunk, string + done, count);
+        output_write(vm, chunk, count);
+    }
+
+    vm->stats.string_bytes += length;
+    output_tick(vm);
+
+    return true;
+}
+
+
+static bool trap_getc(struct lc3_vm *vm, uint8_t vector, void *context) {
+    lc3_flush_output(vm);
+
+    if (key_starved(vm)) {
+        return true;
+    }
+
+    vm->registers[R0] = (uint16_t) keyboard_getc(vm);
+
+    return true;
+}
+
+
+static bool trap_out(struct lc3_vm *vm, uint8_t vector, void *context) {
+    output_putc(vm, (char) vm->registers[R0]);
+    output_tick(vm);
+
+    return true;
+}
+
+
+static bool trap_in(struct lc3_vm *vm, uint8_t vector, void *context) {
+    static const char prompt[] = "Digite um caractere: ";
+
+    if (input_starved(vm, true)) {
+        lc3_flush_output(vm);
+        return true;
+    }
+
+    output_write(vm, prompt, sizeof(prompt) - 1);
+    lc3_flush_output(vm);
+
+    if (key_starved(vm)) {
+        return true;
+    }
+
+    char char_ = keyboard_getc(vm);
+    output_putc(vm, char_);
+    vm->registers[R0] = (uint16_t) char_;
+
+    return true;
+}
+
+
+static bool trap_putsp(struct lc3_vm *vm, uint8_t vector, void *context) {
+    const uint16_t *string = vm->memory + vm->registers[R0];
+    size_t length = words_length(string, MEMORY_MAX - vm->registers[R0]);
+    char chunk[STRING_CHUNK];
+
+    for (size_t done = 0; done < length; done += STRING_CHUNK / 2) {
+        size_t count = length - done < STRING_CHUNK / 2 ? length - done : STRING_CHUNK / 2;
+        size_t bytes = words_pairs(chunk, string + done, count);
+
+        output_write(vm, chunk, bytes);
+        vm->stats.string_bytes += bytes;
+    }
+
+    output_tick(vm);
+
+    return true;
+}
+
+
+// The pages holding [address, address + count), count at least 1.
+static uint32_t pages_of(uint16_t address, size_t count) {
+    uint32_t first = address >> PAGE_SHIFT;
+    uint32_t last  = (address + count - 1) >> PAGE_SHIFT;
+
+    return (uint32_t) ((2ull << last) - (1ull << first));
+}
+
+
+// What ram_write() does for each word, for words changed in bulk.
+static void ram_written(struct lc3_vm *vm, uint16_t address, size_t count) {
+    bool translated = false, blocked = false;
+
+    for (size_t i = 0; i < count; ++i) {
+        forget_decoded(vm, address + i);
+        translated |= vm->jit_covered && vm->jit_covered[address + i];
+        blocked    |= vm->blocks_covered && vm->blocks_covered[address + i];
+    }
+
+    vm->dirty_pages |= pages_of(address, count);
+
+    if (translated) {
+        jit_flush(vm);
+    }
+
+    if (blocked) {
+        blocks_flush(vm);
+        vm->running = false;
+    }
+}
+
+
+static bool trap_memcpy(struct lc3_vm *vm, uint8_t vector, void *context) {
+    uint16_t dst = vm->registers[R0];
+    uint16_t src = vm->registers[R1];
+    size_t count = vm->registers[R2];
+    size_t end = dst > src ? dst : src;
+
+    if (count > MEMORY_MAX - end) {
+        count = MEMORY_MAX - end;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    // devices and watches see every word, in the order memmove would take
+    if (vm->special_pages & (pages_of(dst, count) | pages_of(src, count))) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t at = dst <= src ? i : count - 1 - i;
+            mem_write(vm, dst + at, mem_read(vm, src + at));
+        }
+        return true;
+    }
+
+    memmove(vm->memory + dst, vm->memory + src, count * sizeof(uint16_t));
+    ram_written(vm, dst, count);
+
+    return true;
+}
+
+
+static bool trap_memset(struct lc3_vm *vm, uint8_t vector, void *context) {
+    uint16_t dst = vm->registers[R0];
+    uint16_t value = vm->registers[R1];
+    size_t count = vm->registers[R2];
+
+    if (count > MEMORY_MAX - dst) {
+        count = MEMORY_MAX - dst;
+    }
+
+    if (count == 0) {
+        return true;
+    }
+
+    if (vm->special_pages & pages_of(dst, count)) {
+        for (size_t i = 0; i < count; ++i) {
+            mem_write(vm, dst + i, value);
+        }
+        return true;
+    }
+
+    uint16_t *words = vm->memory + dst;
+    for (size_t i = 0; i < count; ++i) {
+        words[i] = value;
+    }
+
+    ram_written(vm, dst, count);
+
+    return true;
+}
+
+
+static bool trap_strlen(struct lc3_vm *vm, uint8_t vector, void *context) {
+    uint16_t start = vm->registers[R0];
+
+    vm->registers[R0] = (uint16_t) words_length(vm->memory + start, MEMORY_MAX - start);
+
+    return true;
+}
+
+
+static bool halt(struct lc3_vm *vm, uint8_t vector, void *context) {
+    output_write(vm, "HALT\n", 5);
+    halt_machine(vm);
+
+    return true;
+}
+
+
+static void trap(struct lc3_vm *vm, const struct decoded *op) {
+    uint8_t vector = op->offset;
+    struct lc3_trap *entry = &vm->traps[vector];
+
+    ++entry->calls;
+
+    if (entry->handler) {
+        uint64_t start = monotonic_ns();
+        bool handled = entry->handler(vm, vector, entry->context);
+        entry->ns += monotonic_ns() - start;
+
+        if (!handled) {
+            vm->trap_vector = vector;
+            stop_run(vm, LC3_TRAP);
+            return;
+        }
+    }
+    else if (vm->trap_memory_vectors) {
+        // like the real machine: the service routine's address is in the
+        // vector table and it returns with RET
+        vm->registers[R7]   = vm->registers[R_PC];
+        vm->registers[R_PC] = mem_read(vm, vector);
+    }
+    else {
+        vm->trap_vector = vector;
+        stop_run(vm, LC3_TRAP);
+        return;
+    }
+
+    check_budget(vm);
+}
+
+
+void lc3_set_trap(struct lc3_vm *vm, uint8_t vector, lc3_trap_handler handler, void *context) {
+    vm->traps[vector].handler = handler;
+    vm->traps[vector].context = context;
+}
+
+
+void lc3_add_extension_traps(struct lc3_vm *vm) {
+    lc3_set_trap(vm, TRAP_MEMCPY, trap_memcpy, NULL);
+    lc3_set_trap(vm, TRAP_MEMSET, trap_memset, NULL);
+    lc3_set_trap(vm, TRAP_STRLEN, trap_strlen, NULL);
+}
+
+
+/*
+ * Instruction decoding
+*/
+
+void decode(uint16_t instruction, struct decoded *op) {
+    op->label       = NULL;
+    op->instruction = instruction;
+    op->opcode      = instruction >> 12;
+    op->register0   = (instruction >> 9) & 0x7;
+    op->register1   = (instruction >> 6) & 0x7;
+    op->register2   = instruction & 0x7;
+    op->flag        = (instruction >> 5) & 0x1;
+    op->offset      = 0;
+    op->fused       = 0;
+
+    switch (instruction >> 12) {
+        case OP_ADD:
+            op->execute = add;
+            op->offset  = sign_extend(instruction & 0x1F, 5);
+            break;
+        case OP_AND:
+            op->execute = and;
+            op->offset  = sign_extend(instruction & 0x1F, 5);
+            break;
+        case OP_NOT:
+            op->execute = not;
+            break;
+        case OP_BR:
+            op->execute = br;
+            op->offset  = sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_JMP:
+            op->execute = jmp;
+            break;
+        case OP_JSR:
+            op->execute = jsr;
+            op->flag    = (instruction >> 11) & 1;
+            op->offset  = sign_extend(instruction & 0x7FF, 11);
+            break;
+        case OP_LD:
+            op->execute = ld;
+            op->offset  = sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_LDI:
+            op->execute = ldi;
+            op->offset  = sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_LDR:
+            op->execute = ldr;
+            op->offset  = sign_extend(instruction & 0x3F, 6);
+            break;
+        case OP_LEA:
+            op->execute = lea;
+            op->offset  = sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_ST:
+            op->execute = st;
+            op->offset  = sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_STI:
+            op->execute = sti;
+            op->offset  = sign_extend(instruction & 0x1FF, 9);
+            break;
+        case OP_STR:
+            op->execute = str;
+            op->offset  = sign_extend(instruction & 0x3F, 6);
+            break;
+        case OP_TRAP:
+            op->execute = trap;
+            op->offset  = instruction & 0xFF;
+            break;
+        case OP_RES:
+        case OP_RTI:
+        default:
+            op->execute = illegal;
+            break;
+    }
+}
+
+
+/*
+ * Superinstructions
+ *
+ * When the decode cache fills an entry, fuse() checks whether it starts one
+ * of a few fixed idioms and if so points it at a handler that runs the
+ * whole group from the following entries in place, for one dispatch. PC,
+ * flags and the instruction count move exactly as if the instructions ran
+ * one at a time, and a group that would run past the budget check runs
+ * only its first instruction. Writing any word of a group undoes it.
+*/
+const char *fusion_names[FUSION_COUNT] = {
+    [FUSION_CONST]     = "const",
+    [FUSION_ADD_BR]    = "add_br",
+    [FUSION_INCREMENT] = "increment",
+    [FUSION_PUTS]      = "puts"
+};
+
+
+// Step to the next entry of a group, like fetch() would.
+static inline const struct decoded *fused_next(struct lc3_vm *vm, const struct decoded *op) {
+    ++vm->registers[R_PC];
+    ++vm->instructions;
+    return op + 1;
+}
+
+
+static inline bool fused_fits(const struct lc3_vm *vm, const struct decoded *op) {
+    return vm->instructions + op->fused - 1 <= vm->budget_check;
+}
+
+
+static void fused_const(struct lc3_vm *vm, const struct decoded *op) {
+    and(vm, op);
+
+    if (fused_fits(vm, op)) {
+        ++vm->stats.fusions[FUSION_CONST];
+        add(vm, fused_next(vm, op));
+    }
+}
+
+
+static void fused_add_br(struct lc3_vm *vm, const struct decoded *op) {
+    add(vm, op);
+
+    if (fused_fits(vm, op)) {
+        ++vm->stats.fusions[FUSION_ADD_BR];
+        br(vm, fused_next(vm, op));
+    }
+}
+
+
+static void fused_increment(struct lc3_vm *vm, const struct decoded *op) {
+    ldr(vm, op);
+
+    // the load may have been a KBSR poll that stopped the VM
+    if (vm->running && fused_fits(vm, op)) {
+        ++vm->stats.fusions[FUSION_INCREMENT];
+        op = fused_next(vm, op);
+        add(vm, op);
+        str(vm, fused_next(vm, op));
+    }
+}
+
+
+static void fused_puts(struct lc3_vm *vm, const struct decoded *op) {
+    lea(vm, op);
+
+    if (fused_fits(vm, op)) {
+        ++vm->stats.fusions[FUSION_PUTS];
+        trap(vm, fused_next(vm, op));
+    }
+}
+
+
+static bool is_add_immediate(const struct decoded *op, uint8_t register_) {
+    return op->opcode == OP_ADD && op->flag
+           && op->register0 == register_ && op->register1 == register_;
+}
+
+
+static void fuse(const uint16_t *memory, uint32_t device_pages, uint16_t address, struct decoded *op) {
+    struct decoded group[FUSION_MAX];
+    void (*execute)(struct lc3_vm *, const struct decoded *) = NULL;
+    uint8_t length = 2;
+
+    // groups stay clear of device pages, which start off uncached, and of
+    // wrapping around
+    if (address > MEMORY_MAX - FUSION_MAX
+        || device_pages >> ((address + FUSION_MAX - 1) >> PAGE_SHIFT) & 1) {
+        return;
+    }
+
+    decode(memory[address + 1], &group[1]);
+    decode(memory[address + 2], &group[2]);
+
+    if (op->opcode == OP_AND && op->flag && op->offset == 0
+        && is_add_immediate(&group[1], op->register0)) {
+        execute = fused_const;
+    }
+    else if (op->opcode == OP_ADD && group[1].opcode == OP_BR) {
+        execute = fused_add_br;
+    }
+    else if (op->opcode == OP_LDR && op->register0 != op->register1
+             && is_add_immediate(&group[1], op->register0)
+             && group[2].opcode == OP_STR && group[2].register0 == op->register0
+             && group[2].register1 == op->register1 && group[2].offset == op->offset) {
+        execute = fused_increment;
+        length  = 3;
+    }
+    else if (op->opcode == OP_LEA && op->register0 == R0
+             && group[1].opcode == OP_TRAP && group[1].offset == TRAP_PUTS) {
+        execute = fused_puts;
+    }
+
+    if (!execute) {
+        return;
+    }
+
+    // the group runs from the cache entries, so they must hold these words
+    for (uint8_t i = 1; i < length; ++i) {
+        if (!op[i].execute) {
+            op[i] = group[i];
+        }
+    }
+
+    op->execute = execute;
+    op->fused   = length;
+}
+
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+
+// Fetch the instruction at PC and advance PC. Code on device pages is
+// always read through the device and never cached. A fetch is not a load,
+// so it never trips a watch, cached or not. The options are arguments so
+// the portable core variants can pass them as constants.
+static ALWAYS_INLINE const struct decoded *fetch_with(struct lc3_vm *vm, struct decoded *scratch,
+                                                      bool cached, bool fusion) {
+    uint16_t address = vm->registers[R_PC]++;
+
+    if (!cached || device_page(vm, address)) {
+        // straight-line code wrapping around memory passes here every lap
+        check_budget(vm);
+        decode(device_page(vm, address) ? device_read(vm, address) : vm->memory[address], scratch);
+        return scratch;
+    }
+
+    struct decoded *op = &vm->decode_cache[address];
+
+    if (!op->execute) {
+        decode(vm->memory[address], op);
+
+        if (fusion) {
+            fuse(vm->memory, vm->device_pages, address, op);
+        }
+    }
+
+    return op;
+}
+
+
+const struct decoded *fetch(struct lc3_vm *vm, struct decoded *scratch) {
+    return fetch_with(vm, scratch, vm->decode_cache_enabled, vm->fusion_enabled);
+}
+
+
+/*
+ * Interpreter cores
+*/
+
+// A control transfer from pc to next, as AFL hashes its edges.
+static void cover_edge(struct lc3_vm *vm, uint16_t pc, uint16_t next) {
+    uint32_t edge = ((pc * 0x9E37u) >> 1 ^ next * 0x45D9u) & vm->coverage_mask;
+
+    ++vm->coverage[edge];
+}
+
+
+/*
+ * Portable core
+ *
+ * call_loop() is the one loop, and everything it would otherwise test per
+ * instruction is an argument: whether the decode cache and fusion are on,
+ * whether the budget is checked at every instruction instead of only at
+ * control transfers, and whether the profiler, the coverage map or the
+ * trace counts. CALL_VARIANTS expands it once per combination with those as
+ * constants, so each copy is compiled without the branches, or the
+ * counters, it has no use for, and run_call()/run_exact() pick the copy
+ * matching the VM's options.
+*/
+static ALWAYS_INLINE void call_loop(struct lc3_vm *vm, uint64_t limit, bool cached, bool fusion,
+                                    bool exact, bool profiled, bool covered, bool traced) {
+    while (vm->running && (!exact || vm->instructions < limit)) {
+        struct decoded scratch;
+        struct trace_step step;
+        uint16_t pc = vm->registers[R_PC];
+        const struct decoded *op = fetch_with(vm, &scratch, cached, fusion);
+        uint64_t retired = ++vm->instructions;
+
+        // one instruction at a time, so each gets its own count, edge or record
+        if ((profiled || covered || traced) && op->fused) {
+            decode(vm->memory[pc], &scratch);
+            op = &scratch;
+        }
+
+        bool stepped = traced && trace_before(vm, pc, op, &step);
+
+        op->execute(vm, op);
+
+        if (stepped && vm->instructions == retired) {
+            trace_after(vm, &step);
+        }
+
+        // unless rewound to run again later: a starved read or an illegal opcode
+        if (profiled && vm->instructions == retired) {
+            profile_count(vm, pc, op);
+        }
+
+        if (covered && vm->instructions == retired) {
+            // native traps come back to pc + 1, so a trap's edge is its vector
+            if (op->opcode == OP_TRAP) {
+                cover_edge(vm, pc, op->offset);
+            }
+            else if (vm->registers[R_PC] != (uint16_t) (pc + 1)) {
+                cover_edge(vm, pc, vm->registers[R_PC]);
+            }
+        }
+    }
+}
+
+
+// name, decode cache, fusion, exact budget, profiler, coverage, trace
+#define CALL_VARIANTS(X)                                          \
+    X(call_uncached,     false, false, false, false, false, false) \
+    X(call_cached,       true,  false, false, false, false, false) \
+    X(call_fused,        true,  true,  false, false, false, false) \
+    X(exact_uncached,    false, false, true,  false, false, false) \
+    X(exact_cached,      true,  false, true,  false, false, false) \
+    X(exact_fused,       true,  true,  true,  false, false, false) \
+    X(profiled_uncached, false, false, true,  true,  false, false) \
+    X(profiled_cached,   true,  false, true,  true,  false, false) \
+    X(profiled_fused,    true,  true,  true,  true,  false, false) \
+    X(covered_uncached,  false, false, true,  false, true,  false) \
+    X(covered_cached,    true,  false, true,  false, true,  false) \
+    X(covered_fused,     true,  true,  true,  false, true,  false) \
+    X(traced_uncached,   false, false, true,  false, false, true)  \
+    X(traced_cached,     true,  false, true,  false, false, true)  \
+    X(traced_fused,      true,  true,  true,  false, false, true)
+
+#define CALL_VARIANT(name, cached, fusion, exact, profiled, covered, traced)       \
+    static void name(struct lc3_vm *vm, uint64_t limit) {                          \
+        call_loop(vm, limit, cached, fusion, exact, profiled, covered, traced);    \
+    }
+
+CALL_VARIANTS(CALL_VARIANT)
+
+// by [exact + profiled + 2 * covered + 3 * traced][decode cache + fusion]
+#define CALL_ENTRY(name, cached, fusion, exact, profiled, covered, traced) \
+    [exact + profiled + 2 * covered + 3 * traced][cached + (cached && fusion)] = name,
+
+static void (*const call_variants[5][3])(struct lc3_vm *vm, uint64_t limit) = {
+    CALL_VARIANTS(CALL_ENTRY)
+};
+
+
+static void run_variant(struct lc3_vm *vm, uint64_t limit, bool exact) {
+    bool cached = vm->decode_cache_enabled;
+    bool fusion = cached && vm->fusion_enabled;
+    int counted = vm->profile ? 2 : vm->coverage ? 3 : trace_on(vm) ? 4 : exact;
+
+    call_variants[counted][cached + fusion](vm, limit);
+}
+
+
+void run_call(struct lc3_vm *vm) {
+    run_variant(vm, UINT64_MAX, false);
+}
+
+
+// The last stretch of a budget, checked at every instruction, and every
+// run while a profile, the coverage map or a trace window is going.
+static void run_exact(struct lc3_vm *vm, uint64_t limit) {
+    run_variant(vm, limit, true);
+}
+
+
+// run_threaded's label table has one handler per opcode, then one per
+// superinstruction from LABELS_FUSED on.
+#define LABELS_FUSED 16
+#define LABELS_COUNT (LABELS_FUSED + FUSION_COUNT)
+
+
+static const void *handler_label(const void *const *labels, const struct decoded *op) {
+    if (!op->fused) {
+        return labels[op->opcode];
+    }
+
+    if (op->execute == fused_const) {
+        return labels[LABELS_FUSED + FUSION_CONST];
+    }
+    else if (op->execute == fused_add_br) {
+        return labels[LABELS_FUSED + FUSION_ADD_BR];
+    }
+    else if (op->execute == fused_increment) {
+        return labels[LABELS_FUSED + FUSION_INCREMENT];
+    }
+
+    return labels[LABELS_FUSED + FUSION_PUTS];
+}
+
+
+#if defined(__GNUC__)
+
+// GCC would otherwise merge the identical DISPATCH tails back into one
+// shared indirect jump
+#if defined(__clang__)
+#define NO_TAIL_MERGE
+#else
+#define NO_TAIL_MERGE __attribute__((optimize("no-crossjumping", "no-gcse")))
+#endif
+
+// Each handler ends in its own indirect jump to the next instruction's
+// label, giving the host branch predictor one site per opcode instead of
+// the single shared branch of run_call. Labels are only addressable inside
+// this function, so cache entries get theirs the first time they run here.
+//
+// The handlers are written out here against locals rather than calling the
+// ones above: R0-R7, PC, the pending flags and the instruction count never
+// have their address taken, so stores into guest memory cannot alias them
+// and the compiler keeps them out of the VM for the whole run. They go back
+// into the VM (SPILL) only around code that reads or changes them there:
+// traps, accesses to device and watched pages, the PUTS group, fetch()
+// and leaving the loop.
+//
+// Given `tables`, it only hands back its label table, for predecode().
+NO_TAIL_MERGE
+static void run_threaded(struct lc3_vm *vm, const void *const **tables) {
+    static const void *const labels[LABELS_COUNT] = {
+        [OP_BR]   = &&do_br,
+        [OP_ADD]  = &&do_add,
+        [OP_LD]   = &&do_ld,
+        [OP_ST]   = &&do_st,
+        [OP_JSR]  = &&do_jsr,
+        [OP_AND]  = &&do_and,
+        [OP_LDR]  = &&do_ldr,
+        [OP_STR]  = &&do_str,
+        [OP_RTI]  = &&do_illegal,
+        [OP_NOT]  = &&do_not,
+        [OP_LDI]  = &&do_ldi,
+        [OP_STI]  = &&do_sti,
+        [OP_JMP]  = &&do_jmp,
+        [OP_RES]  = &&do_illegal,
+        [OP_LEA]  = &&do_lea,
+        [OP_TRAP] = &&do_trap,
+
+        [LABELS_FUSED + FUSION_CONST]     = &&do_const,
+        [LABELS_FUSED + FUSION_ADD_BR]    = &&do_add_br,
+        [LABELS_FUSED + FUSION_INCREMENT] = &&do_increment,
+        [LABELS_FUSED + FUSION_PUTS]      = &&do_fused
+    };
+
+    if (tables) {
+        *tables = labels;
+        return;
+    }
+
+    // with the cache off, every instruction comes from fetch(): the VM's own
+    // cache may still hold labels, say a shared one mapped by lc3_clone()
+    // before the option was turned off
+    static struct decoded no_labels[MEMORY_MAX];
+
+    uint16_t *memory = vm->memory;
+    struct decoded *cache = vm->decode_cache_enabled ? vm->decode_cache : no_labels;
+    struct decoded scratch;
+    struct decoded *op;
+
+    uint16_t r[8];
+    uint16_t pc;
+    uint32_t flags;
+    uint64_t instructions, budget;
+    uint16_t address;
+
+#define LOAD()                                              \
+    do {                                                    \
+        memcpy(r, vm->registers, sizeof(r));                \
+        pc           = vm->registers[R_PC];                 \
+        flags        = vm->flags_result;                    \
+        instructions = vm->instructions;                    \
+        budget       = vm->budget_check;                    \
+    } while (0)
+
+#define SPILL()                                             \
+    do {                                                    \
+        memcpy(vm->registers, r, sizeof(r));                \
+        vm->registers[R_PC] = pc;                           \
+        vm->flags_result    = flags;                        \
+        vm->instructions    = instructions;                 \
+    } while (0)
+
+// Only accesses to device and watched pages can have side effects. One
+// that stops the VM, a watch hit or a starved KBSR poll, leaves the loop
+// at the end of the instruction: READ_LAST and WRITE end theirs, and
+// READ makes the second access of LDI or STI at stopped_first. A plain
+// store stops the VM too when it lands on code the block core holds.
+#define SPECIAL(address) (vm->special_pages >> ((address) >> PAGE_SHIFT) & 1)
+
+#define READ(into, from)                                    \
+    do {                                                    \
+        address = (from);                                   \
+        if (SPECIAL(address)) {                             \
+            SPILL();                                        \
+            uint16_t value_ = mem_read(vm, address);        \
+            LOAD();                                         \
+            into = value_;                                  \
+            if (!vm->running) {                             \
+                goto stopped_first;                         \
+            }                                               \
+        }                                                   \
+        else {                                              \
+            into = memory[address];                         \
+        }                                                   \
+    } while (0)
+
+#define READ_LAST(register_, from)                          \
+    do {                                                    \
+        address = (from);                                   \
+        if (SPECIAL(address)) {                             \
+            SPILL();                                        \
+            uint16_t value_ = mem_read(vm, address);        \
+            LOAD();                                         \
+            flags = r[register_] = value_;                  \
+            if (!vm->running) {                             \
+                SPILL();                                    \
+                return;                                     \
+            }                                               \
+        }                                                   \
+        else {                                              \
+            flags = r[register_] = memory[address];         \
+        }                                                   \
+    } while (0)
+
+#define WRITE(to, value)                                    \
+    do {                                                    \
+        address = (to);                                     \
+        if (SPECIAL(address)) {                             \
+            SPILL();                                        \
+            mem_write(vm, address, value);                  \
+            if (!vm->running) {                             \
+                return;                                     \
+            }                                               \
+        }                                                   \
+        else {                                              \
+            ram_write(vm, address, value);                  \
+            if (!vm->running) {                             \
+                SPILL();                                    \
+                return;                                     \
+            }                                               \
+        }                                                   \
+    } while (0)
+
+// Cache entries only get a label here or in predecode(), never for KBSR,
+// and with the cache off `cache` is no_labels, so a NULL label sends every
+// case that needs care to fetch(), which is also where a run wrapping
+// around memory meets its budget.
+#define DISPATCH()                                          \
+    do {                                                    \
+        op = &cache[pc];                                    \
+        if (!op->label) {                                   \
+            SPILL();                                        \
+            if (instructions >= budget) {                   \
+                return;                                     \
+            }                                               \
+            op = (struct decoded *) fetch(vm, &scratch);    \
+            op->label = handler_label(labels, op);          \
+            LOAD();                                         \
+        }                                                   \
+        else {                                              \
+            ++pc;                                           \
+        }                                                   \
+        ++instructions;                                     \
+        goto *op->label;                                    \
+    } while (0)
+
+// Step into the next instruction of a fused group, if the group fits the
+// budget, as fused_next() does.
+#define FUSED_NEXT(kind)                                    \
+    do {                                                    \
+        if (instructions + op->fused - 1 > budget) {        \
+            DISPATCH();                                     \
+        }                                                   \
+        ++vm->stats.fusions[kind];                          \
+        ++op;                                               \
+        ++pc;                                               \
+        ++instructions;                                     \
+    } while (0)
+
+// what check_budget() and the `running` test do in the other cores
+#define TRANSFER()                                          \
+    do {                                                    \
+        if (instructions >= budget || !vm->running) {       \
+            SPILL();                                        \
+            vm->running = false;                            \
+            return;                                         \
+        }                                                   \
+        DISPATCH();                                         \
+    } while (0)
+
+    LOAD();
+    DISPATCH();
+
+do_add:
+    r[op->register0] = r[op->register1] + (op->flag ? op->offset : r[op->register2]);
+    flags = r[op->register0];
+    DISPATCH();
+do_and:
+    r[op->register0] = r[op->register1] & (op->flag ? op->offset : r[op->register2]);
+    flags = r[op->register0];
+    DISPATCH();
+do_not:
+    r[op->register0] = ~r[op->register1];
+    flags = r[op->register0];
+    DISPATCH();
+do_br:
+    if (op->register0 & flags_of(flags)) {
+        pc += op->offset;
+    }
+    TRANSFER();
+do_jmp:
+    pc = r[op->register1];
+    TRANSFER();
+do_jsr:
+    r[R7] = pc;
+    pc = op->flag ? pc + op->offset : r[op->register1];
+    TRANSFER();
+do_ld:
+    READ_LAST(op->register0, pc + op->offset);
+    DISPATCH();
+do_ldi:
+    READ(address, pc + op->offset);
+    READ_LAST(op->register0, address);
+    DISPATCH();
+do_ldr:
+    READ_LAST(op->register0, r[op->register1] + op->offset);
+    DISPATCH();
+do_lea:
+    r[op->register0] = pc + op->offset;
+    flags = r[op->register0];
+    DISPATCH();
+do_st:
+    WRITE(pc + op->offset, r[op->register0]);
+    DISPATCH();
+do_sti:
+    READ(address, pc + op->offset);
+    WRITE(address, r[op->register0]);
+    DISPATCH();
+do_str:
+    WRITE(r[op->register1] + op->offset, r[op->register0]);
+    DISPATCH();
+do_trap:
+    SPILL();
+    trap(vm, op);
+    if (!vm->running) {
+        return;
+    }
+    LOAD();
+    DISPATCH();
+do_const:
+    r[op->register0] = r[op->register1] & op->offset;
+    flags = r[op->register0];
+    FUSED_NEXT(FUSION_CONST);
+    goto do_add;
+do_add_br:
+    r[op->register0] = r[op->register1] + (op->flag ? op->offset : r[op->register2]);
+    flags = r[op->register0];
+    FUSED_NEXT(FUSION_ADD_BR);
+    goto do_br;
+do_increment:
+    READ_LAST(op->register0, r[op->register1] + op->offset);
+    FUSED_NEXT(FUSION_INCREMENT);
+    r[op->register0] = r[op->register1] + op->offset;
+    flags = r[op->register0];
+    ++op;
+    ++pc;
+    ++instructions;
+    goto do_str;
+do_fused:
+    SPILL();
+    op->execute(vm, op);
+    if (!vm->running) {
+        return;
+    }
+    LOAD();
+    DISPATCH();
+do_illegal:
+    SPILL();
+    illegal(vm, op);
+    return;
+stopped_first:
+    if (op->opcode == OP_LDI) {
+        flags = r[op->register0] = mem_read(vm, address);
+    }
+    else {
+        mem_write(vm, address, r[op->register0]);
+    }
+    SPILL();
+    return;
+
+#undef FUSED_NEXT
+#undef TRANSFER
+#undef DISPATCH
+#undef WRITE
+#undef READ_LAST
+#undef READ
+#undef SPECIAL
+#undef SPILL
+#undef LOAD
+}
+
+#else
+
+// labels-as-values is a GNU extension, other compilers get the portable loop
+static void run_threaded(struct lc3_vm *vm, const void *const **tables) {
+    if (tables) {
+        *tables = NULL;
+        return;
+    }
+
+    run_call(vm);
+}
+
+#endif
+
+
+// Decode every word of `pages` outside the built-in device page into
+// cache, as fetch() would on first use, and give each entry its threaded
+// core label up front. Done once for a shared cache, so VMs running from
+// it never write to it.
+void predecode(struct decoded *cache, const uint16_t *memory, uint32_t pages, bool fusion) {
+    const void *const *labels;
+
+    run_threaded(NULL, &labels);
+
+    for (uint32_t address = 0; address < MEMORY_MAX; ++address) {
+        struct decoded *op = &cache[address];
+
+        if (!(pages & ~DEVICE_PAGES_BUILTIN & (1u << (address >> PAGE_SHIFT))) || op->execute) {
+            continue;
+        }
+
+        decode(memory[address], op);
+
+        if (fusion) {
+            fuse(memory, DEVICE_PAGES_BUILTIN, address, op);
+        }
+
+        // with the rest of its group, which fuse() may have filled; the
+        // pages around are left untouched so they stay holes in a memfd
+        for (uint8_t i = 0; labels && i < (op->fused ? op->fused : 1); ++i) {
+            if (!op[i].label) {
+                op[i].label = handler_label(labels, &op[i]);
+            }
+        }
+    }
+}
+
+
+/*
+ * Library API
+*/
+
+struct lc3_vm *lc3_create() {
+    struct lc3_vm *vm = calloc(1, sizeof(*vm));
+
+    if (!vm) {
+        return NULL;
+    }
+
+    // anonymous mappings are page aligned and only take memory once touched
+    void *memory = mmap(NULL, MEMORY_MAX * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *cache  = mmap(NULL, MEMORY_MAX * sizeof(struct decoded), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED || cache == MAP_FAILED) {
+        if (memory != MAP_FAILED) {
+            munmap(memory, MEMORY_MAX * sizeof(uint16_t));
+        }
+        if (cache != MAP_FAILED) {
+            munmap(cache, MEMORY_MAX * sizeof(struct decoded));
+        }
+        free(vm);
+        return NULL;
+    }
+
+    vm->memory       = memory;
+    vm->decode_cache = cache;
+
+    vm->registers[R_PC]      = PC_START;
+    vm->flags_result         = FLAGS_NONE;
+    vm->decode_cache_enabled = true;
+    vm->fusion_enabled       = true;
+    vm->core                 = CORE_CALL;
+
+    pthread_mutex_init(&vm->keyboard.lock, NULL);
+    pthread_cond_init(&vm->keyboard.changed, NULL);
+
+    vm->output.fd = STDOUT_FILENO;
+    lc3_configure_output(vm, OUTPUT_BUFFER, OUTPUT_LINE);
+
+    lc3_set_trap(vm, TRAP_GETC, trap_getc, NULL);
+    lc3_set_trap(vm, TRAP_OUT, trap_out, NULL);
+    lc3_set_trap(vm, TRAP_PUTS, trap_puts, NULL);
+    lc3_set_trap(vm, TRAP_IN, trap_in, NULL);
+    lc3_set_trap(vm, TRAP_PUTSP, trap_putsp, NULL);
+    lc3_set_trap(vm, TRAP_HALT, halt, NULL);
+
+    lc3_map_device(vm, MR_KBSR, MR_KBSR, keyboard_status, NULL, NULL);
+    lc3_map_device(vm, MR_DSR, MR_DSR, display_status, NULL, NULL);
+    lc3_map_device(vm, MR_DDR, MR_DDR, NULL, display_data, NULL);
+    lc3_map_device(vm, MR_MCR, MR_MCR, machine_control, machine_control_write, NULL);
+
+    return vm;
+}
+
+
+void lc3_destroy(struct lc3_vm *vm) {
+    if (!vm) {
+        return;
+    }
+
+    lc3_flush_output(vm);
+    free(vm->output.buffer);
+
+    jit_destroy(vm);
+    blocks_destroy(vm);
+    profile_destroy(vm);
+    replay_destroy(vm);
+    lc3_trace_stop(vm);
+    perf_close(vm);
+
+    if (vm->snapshot) {
+        lc3_snapshot_release(vm->snapshot);
+    }
+
+    pthread_mutex_destroy(&vm->keyboard.lock);
+    pthread_cond_destroy(&vm->keyboard.changed);
+
+    munmap(vm->memory, MEMORY_MAX * sizeof(uint16_t));
+    munmap(vm->decode_cache, MEMORY_MAX * sizeof(struct decoded));
+    free(vm);
+}
+
+
+int lc3_load(struct lc3_vm *vm, const char *image_path) {
+    struct lc3_snapshot *snapshot = lc3_snapshot_open(image_path);
+
+    if (snapshot) {
+        int ok = lc3_restore(vm, snapshot);
+        lc3_snapshot_release(snapshot);
+        return ok;
+    }
+
+    if (!read_image(vm, image_path)) {
+        return 0;
+    }
+
+    invalidate_range(vm, vm->image_origin, vm->image_length);
+
+    return 1;
+}
+
+
+void stop_run(struct lc3_vm *vm, int reason) {
+    vm->exit_reason  = reason;
+    vm->budget_check = 0;
+    vm->running      = false;
+}
+
+
+static void run_core(struct lc3_vm *vm) {
+    if (vm->core == CORE_THREADED) {
+        run_threaded(vm, NULL);
+    }
+    else if (vm->core == CORE_JIT) {
+        run_jit(vm);
+    }
+    else if (vm->core == CORE_BLOCK) {
+        run_blocks(vm);
+    }
+    else {
+        run_call(vm);
+    }
+}
+
+
+static int run_until(struct lc3_vm *vm, uint64_t max_instructions, uint64_t deadline_ns) {
+    uint64_t limit = max_instructions < UINT64_MAX - vm->instructions
+                     ? vm->instructions + max_instructions : UINT64_MAX;
+
+    if (vm->halted) {
+        return LC3_HALTED;
+    }
+
+    vm->exit_reason = LC3_BUDGET;
+
+    // each pass ends at a budget check: for the deadline, or while output
+    // is pending, every RUN_CLOCK_STRIDE instructions, else only near the
+    // end of the budget
+    while (vm->instructions < limit) {
+        if (deadline_ns && monotonic_ns() >= deadline_ns) {
+            break;
+        }
+
+        // the edges of a trace window are budgets of their own, so it
+        // opens and closes on the exact instruction
+        uint64_t end   = vm->trace ? trace_boundary(vm, limit) : limit;
+        uint64_t left  = end - vm->instructions;
+        uint64_t check = left > RUN_EXACT_MARGIN ? end - RUN_EXACT_MARGIN : end;
+
+        if ((deadline_ns || vm->output.used > 0) && check - vm->instructions > RUN_CLOCK_STRIDE) {
+            check = vm->instructions + RUN_CLOCK_STRIDE;
+        }
+
+        vm->running      = true;
+        vm->budget_check = check;
+
+        if (left > RUN_EXACT_MARGIN && !vm->profile && !vm->coverage && !trace_on(vm)) {
+            run_core(vm);
+        }
+        else {
+            run_exact(vm, check);
+        }
+
+        if (vm->exit_reason != LC3_BUDGET) {
+            return vm->exit_reason;
+        }
+
+        output_tick(vm);
+    }
+
+    vm->running = false;
+
+    return LC3_BUDGET;
+}
+
+
+// While recording, runs stop at every checkpoint on the way.
+static int run_recorded(struct lc3_vm *vm, uint64_t max_instructions, uint64_t deadline_ns) {
+    uint64_t end = max_instructions < UINT64_MAX - vm->instructions
+                   ? vm->instructions + max_instructions : UINT64_MAX;
+
+    for (;;) {
+        uint64_t due  = record_due(vm);
+        uint64_t stop = due < end ? due : end;
+        int reason = run_until(vm, stop - vm->instructions, deadline_ns);
+
+        if (vm->instructions == due) {
+            record_checkpoint(vm);
+        }
+
+        if (reason != LC3_BUDGET || vm->instructions >= end
+            || (deadline_ns && monotonic_ns() >= deadline_ns)) {
+            return reason;
+        }
+    }
+}
+
+
+int lc3_run_until(struct lc3_vm *vm, uint64_t max_instructions, uint64_t deadline_ns) {
+    uint64_t start = monotonic_ns();
+
+    perf_start(vm);
+    int reason = vm->recording ? run_recorded(vm, max_instructions, deadline_ns)
+                               : run_until(vm, max_instructions, deadline_ns);
+    perf_stop(vm);
+
+    vm->stats.run_ns += monotonic_ns() - start;
+
+    return reason;
+}
+
+
+int lc3_run(struct lc3_vm *vm, uint64_t max_instructions) {
+    return lc3_run_until(vm, max_instructions, 0);
+}
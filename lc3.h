@@ -0,0 +1,844 @@
+#ifndef LC3_H
+#define LC3_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+
+// default Program Counter start position
+#define PC_START 0x3000
+
+// one word per 16-bit address, 0xFFFF included
+#define MEMORY_MAX (1 << 16)
+
+// dirty tracking granule: 2048 words, one 4 KiB host page
+#define PAGE_SHIFT 11
+#define PAGE_WORDS (1 << PAGE_SHIFT)
+#define PAGE_COUNT (MEMORY_MAX / PAGE_WORDS)
+
+
+// CPU Registers
+enum {
+    R0 = 0,
+    R1,
+    R2,
+    R3,
+    R4,
+    R5,
+    R6,
+    R7,
+    R_PC,
+    R_COND,
+    R_COUNT
+};
+
+
+// Condition (R_COND) Flags
+enum {
+    FLG_POS = 1 << 0,
+    FLG_ZRO = 1 << 1,
+    FLG_NEG = 1 << 2,
+};
+
+
+// Flag-setting instructions only record their result in flags_result; N/Z/P
+// are derived from it when something reads the condition codes.
+// FLAGS_NONE stands for the power-on state, when R_COND is 0.
+#define FLAGS_NONE 0x10000
+
+
+// Opcodes
+enum {
+    OP_BR = 0, // branch
+    OP_ADD,    // add
+    OP_LD,     // load
+    OP_ST,     // store
+    OP_JSR,    // jump register
+    OP_AND,    // bitwise and
+    OP_LDR,    // load register
+    OP_STR,    // store register
+    OP_RTI,    // unused
+    OP_NOT,    // bitwise not
+    OP_LDI,    // load indirect
+    OP_STI,    // store indirect
+    OP_JMP,    // jump
+    OP_RES,    // reserved (unused)
+    OP_LEA,    // load effective address
+    OP_TRAP    // execute trap
+};
+
+
+// Trap Routines
+enum {
+    TRAP_GETC  = 0x20,  // get character from keyboard, not echoed onto the terminal
+    TRAP_OUT   = 0x21,  // output a character
+    TRAP_PUTS  = 0x22,  // output a word string
+    TRAP_IN    = 0x23,  // get character from keyboard, echoed onto the terminal
+    TRAP_PUTSP = 0x24,  // output a byte string
+    TRAP_HALT  = 0x25,  // halt the program
+
+    // extensions, installed by lc3_add_extension_traps(); R0 is the
+    // destination, R1 the source or the value, R2 the count in words
+    TRAP_MEMCPY = 0x26, // copy R2 words from R1 to R0, as memmove
+    TRAP_MEMSET = 0x27, // set R2 words at R0 to R1
+    TRAP_STRLEN = 0x28  // R0 set to the words before the zero at R0
+};
+
+
+enum {
+    MR_KBSR = 0xFE00, // keyboard status
+    MR_KBDR = 0xFE02, // keyboard data
+    MR_DSR  = 0xFE04, // display status
+    MR_DDR  = 0xFE06, // display data
+    MR_MCR  = 0xFFFE  // machine control: clearing bit 15 halts
+};
+
+
+struct lc3_vm;
+
+
+/*
+ * Pre-decoded instruction cache
+ *
+ * One entry per memory word holding the handler and the already extracted
+ * fields of the instruction stored there, so a word is only decoded again
+ * after mem_write changes it.
+*/
+struct decoded {
+    void (*execute)(struct lc3_vm *vm, const struct decoded *op); // NULL while the entry is invalid
+    const void *label;  // threaded core handler, NULL until that core first runs the entry
+    uint16_t instruction;
+    uint16_t offset;    // sign-extended imm5 / offset6 / PCoffset9 / PCoffset11, or trapvect8
+    uint8_t  register0; // DR / SR, or the nzp mask of BR (bits 11..9)
+    uint8_t  register1; // SR1 / BaseR (bits 8..6)
+    uint8_t  register2; // SR2 (bits 2..0)
+    uint8_t  flag;      // immediate flag of ADD/AND, long flag of JSR
+    uint8_t  opcode;
+    uint8_t  fused;     // instructions `execute` runs from here on, 0 for a single one
+};
+
+
+// Superinstructions: idioms decoded into one entry that runs them all.
+enum {
+    FUSION_CONST = 0,   // AND Rx,Ry,#0; ADD Rx,Rx,#imm
+    FUSION_ADD_BR,      // ADD; BR (loop counters)
+    FUSION_INCREMENT,   // LDR Rx,Ry,#n; ADD Rx,Rx,#imm; STR Rx,Ry,#n
+    FUSION_PUTS,        // LEA R0,label; TRAP x22
+    FUSION_COUNT
+};
+
+#define FUSION_MAX 3    // longest group
+
+extern const char *fusion_names[FUSION_COUNT];
+
+
+// Interpreter cores
+enum {
+    CORE_CALL = 0, // calls the cached handler from a single loop
+    CORE_THREADED, // direct-threaded dispatch through labels-as-values
+    CORE_JIT,      // hot basic blocks translated to x86-64
+    CORE_BLOCK,    // decoded basic blocks chained to their successors
+    CORE_COUNT
+};
+
+extern const char *core_names[CORE_COUNT];
+
+
+/*
+ * Keyboard device
+ *
+ * The host fills a ring buffer with lc3_push_input(), so the VM never makes
+ * a syscall to poll KBSR: it only compares the ring indices. The lock and
+ * condition variable are used only to sleep, by the VM waiting for a key
+ * and by a producer waiting for room in the ring.
+ *
+ * A script replaces the ring for headless runs: the keys are read straight
+ * from the caller's buffer, each one showing up in KBSR once the VM has
+ * retired the instruction count scheduled for it. A read that would wait
+ * gets the next key at once, so a scripted VM never sleeps and runs the
+ * same way every time.
+*/
+#define KEYBOARD_BUFFER 256          // ring size, a power of two
+#define IDLE_POLLS      1024         // empty KBSR polls in a row before the VM naps
+#define IDLE_NAP_NS     10000000     // longest nap, woken early by input
+#define KEYBOARD_POLL_NS 100000000   // longest a VM waiting for a key goes without checking for an interrupt
+
+struct lc3_keyboard {
+    uint8_t buffer[KEYBOARD_BUFFER];
+    atomic_uint head;           // next slot the producer fills
+    atomic_uint tail;           // next slot the VM takes
+    atomic_bool eof;
+    atomic_bool producer_waiting;
+    atomic_bool interrupted;    // lc3_interrupt(): reads stop the VM instead of waiting
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+
+    const uint8_t  *script;     // NULL unless scripted
+    const uint64_t *script_at;  // instruction count each key comes at, NULL for all at once
+    size_t          script_length;
+    size_t          script_next;
+    uint64_t        script_end; // with script_at, the instruction count input ends at
+};
+
+
+/*
+ * Console output
+ *
+ * Trap output is collected in a buffer and written to an fd, stdout by
+ * default, or handed to a caller-supplied sink, in as few calls as
+ * possible. The buffer is flushed when it fills up, before the VM waits for
+ * input, at HALT, when output has been pending for OUTPUT_FLUSH_NS, and in
+ * line mode at every newline. While output is pending a run checks the
+ * timer every RUN_CLOCK_STRIDE instructions, so it goes out on time even
+ * if the program goes on computing. Raw mode skips the buffer. With
+ * SIGPIPE ignored, an fd whose reader has gone away halts the VM, which
+ * ends just that console.
+*/
+#define OUTPUT_BUFFER   4096
+#define OUTPUT_FLUSH_NS 50000000 // longest time output stays buffered
+
+enum {
+    OUTPUT_LINE = 0, // flush at newlines, the default on a TTY
+    OUTPUT_BLOCK,    // flush only when full, the default otherwise
+    OUTPUT_RAW       // no buffer, every write goes straight out
+};
+
+typedef void (*output_sink)(void *context, const char *data, size_t length);
+
+struct lc3_output {
+    char    *buffer;
+    size_t   size;
+    size_t   used;
+    int      mode;
+    int      fd;
+    output_sink sink;       // when set, receives the data instead of fd
+    void    *sink_context;
+    bool     closed;        // the fd's reader went away; output is dropped
+    uint64_t pending_since; // when the oldest buffered byte was written
+};
+
+
+struct jit;
+struct blocks;
+struct lc3_snapshot;
+struct lc3_profile;
+struct lc3_recording;
+struct lc3_replay;
+struct lc3_trace;
+
+
+/*
+ * Trap vector table
+ *
+ * Every TRAP goes through the VM's 256-entry table. lc3_create() fills in
+ * the standard routines; host code can replace them or add native ones.
+ * A handler runs with PC already past the TRAP and returns false to leave
+ * the trap to the caller of lc3_run(), which then returns LC3_TRAP. Vectors
+ * without a handler do the same, or with trap_memory_vectors jump through
+ * memory[vector] like the real machine.
+*/
+typedef bool (*lc3_trap_handler)(struct lc3_vm *vm, uint8_t vector, void *context);
+
+struct lc3_trap {
+    lc3_trap_handler handler;
+    void    *context;
+    uint64_t calls;
+    uint64_t ns;        // spent in the handler
+};
+
+
+/*
+ * Devices and watchpoints
+ *
+ * Each page has a bit in device_pages when a device register lies in it,
+ * and in watch_pages when a watched word does. Loads and stores anywhere
+ * else reach memory with no more than that bit test; on flagged pages they
+ * go through the tables below. lc3_create() maps the keyboard, the display
+ * and MCR, all in the last page, which code is never cached from.
+ *
+ * A device's read handler gives the value a load sees, and its write
+ * handler runs after a store has put the value in memory; either may be
+ * NULL for plain memory. A watched access stops the run with LC3_WATCH
+ * once the instruction making it completes. Only loads and stores count:
+ * fetching an instruction from a watched word doesn't, on any core.
+*/
+#define DEVICE_MAX 8
+#define WATCH_MAX  16
+
+typedef uint16_t (*lc3_device_read)(struct lc3_vm *vm, uint16_t address, void *context);
+typedef void     (*lc3_device_write)(struct lc3_vm *vm, uint16_t address, uint16_t value, void *context);
+
+struct lc3_device {
+    uint16_t         first;
+    uint16_t         last;  // inclusive
+    lc3_device_read  read;
+    lc3_device_write write;
+    void            *context;
+};
+
+enum {
+    LC3_WATCH_READ  = 1,
+    LC3_WATCH_WRITE = 2
+};
+
+struct lc3_watch {
+    uint16_t first;
+    uint16_t last;          // inclusive
+    int      kind;          // LC3_WATCH_* bits
+};
+
+
+/*
+ * Statistics
+ *
+ * What running a VM costs the host, counted on the slow paths only (KBSR
+ * reads, waits, traps, output flushes), so the cores pay nothing for it.
+ * With perf_counters set, lc3_run() also has the kernel count host cycles,
+ * instructions and branch misses while it runs (Linux only).
+*/
+struct lc3_stats {
+    uint64_t instructions;      // LC-3 instructions retired
+    uint64_t run_ns;            // inside lc3_run()
+    uint64_t kbsr_polls;        // reads of KBSR
+    uint64_t input_wait_ns;     // asleep waiting for a key, idle naps included
+    uint64_t trap_ns;           // in trap handlers, GETC and IN waits included
+    uint64_t string_bytes;      // written by PUTS and PUTSP
+    uint64_t flushes;           // writes to the fd or calls to the sink
+    uint64_t fusions[FUSION_COUNT]; // superinstructions run whole
+
+    bool     perf_valid;        // the host counters below were read
+    uint64_t cycles;
+    uint64_t host_instructions;
+    uint64_t branch_misses;
+};
+
+
+/*
+ * VM context
+ *
+ * Everything one LC-3 machine needs, so any number of them can live in one
+ * process. A VM must only be run by one thread at a time; lc3_push_input()
+ * and lc3_close_input() may be called from any thread.
+*/
+struct lc3_vm {
+    // kept first: translated code addresses these with 8-bit displacements
+    uint16_t registers[R_COUNT];
+    uint32_t flags_result;
+
+    bool     running;
+    bool     halted;
+    uint64_t instructions;          // instructions retired since creation
+    uint64_t budget_check;          // control transfers stop the run once instructions reaches it
+    int      exit_reason;           // why the last lc3_run() returned
+    uint8_t  trap_vector;           // of the trap left to the host
+
+    uint16_t       *memory;         // MEMORY_MAX words, page aligned
+    struct decoded *decode_cache;   // MEMORY_MAX entries
+
+    uint32_t             dirty_pages; // bit per page written since the VM last matched `snapshot`
+    struct lc3_snapshot *snapshot;    // backing snapshot of memory, NULL when anonymous
+
+    // options, set before lc3_run()
+    bool decode_cache_enabled;
+    bool fusion_enabled;            // superinstructions, with the decode cache
+    int  core;
+    bool idle_detection;
+    bool nonblocking_input;         // a read that would wait for a key stops the VM instead
+    bool trap_memory_vectors;       // traps without a handler jump through memory[vector]
+    bool perf_counters;             // count host events around lc3_run()
+
+    uint32_t idle_polls;
+
+    struct lc3_keyboard keyboard;
+    struct lc3_output   output;
+
+    struct lc3_trap traps[256];
+
+    uint32_t          device_pages; // bit per page with a device register
+    uint32_t          watch_pages;  // bit per page with a watched word
+    uint32_t          special_pages; // both together
+    struct lc3_device devices[DEVICE_MAX];
+    int               device_count;
+    struct lc3_watch  watches[WATCH_MAX];
+    int               watch_count;
+    uint16_t          watch_address; // of the access that stopped the run with LC3_WATCH
+    uint16_t          watch_value;   // read or written there
+    bool              watch_write;
+
+    struct lc3_stats stats;
+    bool             perf_opened;
+    int              perf_fds[3];   // cycles (the group leader), instructions, branch misses
+    pid_t            perf_thread;   // the counters only see this thread
+
+    struct jit *jit;                // NULL until the JIT core first runs
+    uint8_t    *jit_covered;        // words in translated blocks, NULL without a JIT
+
+    struct blocks *blocks;          // NULL until the block core first runs
+    uint8_t       *blocks_covered;  // words in decoded blocks, NULL without any
+
+    struct lc3_profile *profile;    // NULL unless lc3_profile_start() was called
+
+    uint8_t  *coverage;             // edge counters, NULL unless lc3_set_coverage() was called
+    uint32_t  coverage_mask;        // their count, less one
+
+    struct lc3_trace *trace;        // NULL unless lc3_trace_start() was called
+
+    struct lc3_recording *recording; // NULL unless lc3_record_start() was called
+    struct lc3_replay    *replay;    // input of the last lc3_replay()
+
+    // where the last image landed
+    uint16_t image_origin;
+    size_t   image_length;
+
+    struct lc3_sched *sched;        // set by lc3_sched_add()
+    atomic_int        sched_state;
+    int               sched_worker; // deque the VM goes back to when woken
+};
+
+
+/*
+ * Library API
+*/
+
+// A VM with zeroed memory, PC at PC_START, the decode cache on, the call
+// core, and line-buffered output to stdout. NULL when out of memory.
+struct lc3_vm *lc3_create(void);
+
+void lc3_destroy(struct lc3_vm *vm);
+
+// Load an .obj or cached image into memory, or resume a saved snapshot.
+// Returns 0 on failure.
+int lc3_load(struct lc3_vm *vm, const char *image_path);
+
+// Why lc3_run() returned. PC is left on the instruction to run next: after
+// HALT and host traps, on the read for input, on the illegal instruction.
+enum {
+    LC3_HALTED = 0,
+    LC3_TRAP,       // a trap vector without a handler; see vm->trap_vector
+    LC3_INPUT,      // a nonblocking or interrupted VM would have waited for a key
+    LC3_ILLEGAL,    // RTI or the reserved opcode
+    LC3_BUDGET,     // max_instructions retired, or the deadline passed
+    LC3_WATCH       // a watched word was accessed; see vm->watch_address
+};
+
+#define LC3_FOREVER UINT64_MAX
+
+// Run at most max_instructions, or LC3_FOREVER. Returns an LC3_* reason.
+int lc3_run(struct lc3_vm *vm, uint64_t max_instructions);
+
+// Like lc3_run(), also returning LC3_BUDGET once monotonic_ns() passes
+// deadline_ns (0 for none). The clock is read every RUN_CLOCK_STRIDE
+// instructions, so the deadline can be overrun by about that much.
+int lc3_run_until(struct lc3_vm *vm, uint64_t max_instructions, uint64_t deadline_ns);
+
+// Queue keyboard input. Returns how many bytes fit in the ring.
+size_t lc3_push_input(struct lc3_vm *vm, const void *data, size_t length);
+
+// Block until the ring has room for at least one byte. Returns 0 when the
+// VM has halted instead, as it will never take more input.
+int lc3_wait_input_space(struct lc3_vm *vm);
+
+// No more input will come: once the ring drains, keyboard reads give EOF.
+void lc3_close_input(struct lc3_vm *vm);
+
+// Make reads that would wait for a key stop the run with LC3_INPUT instead,
+// including one waiting now, within KEYBOARD_POLL_NS; a scheduler then
+// drops the VM. Only an atomic store, so a signal handler may call it.
+// Runs that don't read stop at their budget or deadline as usual.
+void lc3_interrupt(struct lc3_vm *vm);
+
+// Drop the keys not taken yet and reopen closed input, between runs.
+void lc3_reset_input(struct lc3_vm *vm);
+
+// Take input from `keys` instead of the ring, key i once vm->instructions
+// reaches at[i] (non-decreasing; NULL for no schedule), then end of input.
+// Both arrays must outlive the runs.
+void lc3_set_input_script(struct lc3_vm *vm, const void *keys, size_t length, const uint64_t *at);
+
+void lc3_configure_output(struct lc3_vm *vm, size_t size, int mode);
+void lc3_set_output_fd(struct lc3_vm *vm, int fd);
+void lc3_set_output_sink(struct lc3_vm *vm, output_sink sink, void *context);
+void lc3_flush_output(struct lc3_vm *vm);
+
+// Install a handler for a trap vector, or NULL to remove it.
+void lc3_set_trap(struct lc3_vm *vm, uint8_t vector, lc3_trap_handler handler, void *context);
+
+// Install TRAP_MEMCPY, TRAP_MEMSET and TRAP_STRLEN. They stop at the end of
+// memory instead of wrapping around to x0000.
+void lc3_add_extension_traps(struct lc3_vm *vm);
+
+// Put a device on [first, last], over any mapped before. Returns 0 when
+// the table is full.
+int lc3_map_device(struct lc3_vm *vm, uint16_t first, uint16_t last,
+                   lc3_device_read read, lc3_device_write write, void *context);
+
+// Stop on accesses of `kind` to [first, last]. Returns 0 when the table is full.
+int  lc3_watch(struct lc3_vm *vm, uint16_t first, uint16_t last, int kind);
+void lc3_clear_watches(struct lc3_vm *vm);
+
+
+/*
+ * Snapshots
+ *
+ * A snapshot holds a VM's memory in a memfd plus its registers. Taking one
+ * or restoring it maps that memory copy-on-write into the VM, so cloning
+ * costs only the pages the clone later writes, and restoring the snapshot
+ * a VM came from only puts back its dirty pages. The code in it is decoded
+ * once and that cache is shared the same way. Only guest state is kept:
+ * options, input and output stay with the VM.
+*/
+
+// Snapshot the VM, which from then on shares the snapshot's pages. NULL on failure.
+struct lc3_snapshot *lc3_snapshot(struct lc3_vm *vm);
+
+// Drop a reference; VMs backed by the snapshot keep their own.
+void lc3_snapshot_release(struct lc3_snapshot *snapshot);
+
+// Put the VM back in the snapshot's state. Returns 0 on failure.
+int lc3_restore(struct lc3_vm *vm, struct lc3_snapshot *snapshot);
+
+// A new VM, with default options, in the snapshot's state. NULL on failure.
+struct lc3_vm *lc3_clone(struct lc3_snapshot *snapshot);
+
+// Compact file form: the registers and the non-zero pages, big-endian.
+int lc3_snapshot_save(const struct lc3_snapshot *snapshot, const char *path);
+struct lc3_snapshot *lc3_snapshot_open(const char *path);
+
+
+/*
+ * Record and replay
+ *
+ * A recording logs only what a run can't work out for itself: each key
+ * the guest took, through KBDR or GETC/IN, with the instruction count it
+ * came at, and when input ended. Every `interval` instructions it also
+ * keeps a checkpoint of memory and registers, the first one as recording
+ * starts, so a recording replays without the image and a replay can start
+ * from the last checkpoint before any instruction.
+*/
+
+// Log the VM's input to `path` from now on. Returns 0 if the file can't be written.
+int lc3_record_start(struct lc3_vm *vm, const char *path, uint64_t interval);
+
+// Mark the end of input and close the file. Returns 0 if writing it failed.
+int lc3_record_stop(struct lc3_vm *vm);
+
+// Put the VM where the recording was after `at` instructions, or at its
+// end, and script the recorded input from there on. Output from the
+// checkpoint up to `at` is dropped. Returns 0 if the file can't be read.
+int lc3_replay(struct lc3_vm *vm, const char *path, uint64_t at);
+
+
+// Copy out the VM's statistics; perf_valid says if the host counters are there.
+void lc3_get_stats(const struct lc3_vm *vm, struct lc3_stats *stats);
+
+
+/*
+ * Profiler
+ *
+ * While a profile is running, lc3_run() uses a counting copy of the call
+ * core, whatever `core` says; the other loops have no counters at all.
+ * It counts executions per PC and opcode, taken backward branches, and
+ * instructions per call path, pairing each JSR with the JMP R7 that
+ * returns to it.
+*/
+
+// Start, or restart, counting from the current PC. Returns 0 when out of memory.
+int lc3_profile_start(struct lc3_vm *vm);
+
+// Hot opcodes, addresses, loops and functions, as text.
+int lc3_profile_report(const struct lc3_vm *vm, FILE *out);
+
+// Collapsed stacks, one "caller;callee count" line per call path, for flamegraph.pl.
+int lc3_profile_save(const struct lc3_vm *vm, const char *path);
+
+
+/*
+ * Coverage
+ *
+ * For fuzzers: every control transfer the guest takes, from the address
+ * of the instruction to where it goes, or to its vector for a TRAP, bumps
+ * an 8-bit counter picked by hashing the pair, as AFL and libFuzzer's
+ * extra counters expect. Like the profiler it runs on a counting copy of
+ * the call core, so it costs nothing while off; a running profile takes
+ * precedence.
+*/
+
+// Count edges into `map`, `size` bytes and a power of two, or NULL to stop.
+void lc3_set_coverage(struct lc3_vm *vm, uint8_t *map, size_t size);
+
+
+/*
+ * Execution trace
+ *
+ * While a trace is running, lc3_run() uses a tracing copy of the call core
+ * inside the trace's window of instruction counts, and the VM's own core
+ * outside it. Every instruction retired there at a PC in the trace's range
+ * fills one fixed-size record in a ring, which a writer thread compresses
+ * into the file; a full ring makes the VM wait, so no record is lost.
+ * tracedump.c turns the file back into text.
+*/
+#define TRACE_MAGIC   "LC3T"
+#define TRACE_VERSION 1
+
+enum {
+    TRACE_REGISTER = 1, // `reg` was set to `result`
+    TRACE_STORE    = 2, // memory[address] was set to `stored`
+    TRACE_EPOCH    = 4  // no instruction: `instruction` is the high half of the counts that follow
+};
+
+struct lc3_trace_record {
+    uint32_t instruction;   // low half of vm->instructions once it retired
+    uint16_t pc;
+    uint16_t word;          // the instruction
+    uint16_t result;
+    uint16_t address;
+    uint16_t stored;
+    uint8_t  reg;
+    uint8_t  flags;         // TRACE_* bits
+};
+
+// Write a trace of the instructions at PCs in [first_pc, last_pc] run while
+// vm->instructions is in [from, to) to `path`. Returns 0 if it can't be written.
+int lc3_trace_start(struct lc3_vm *vm, const char *path, uint16_t first_pc, uint16_t last_pc,
+                    uint64_t from, uint64_t to);
+
+// Write out what is left and close the file. Returns 0 if writing it failed.
+int lc3_trace_stop(struct lc3_vm *vm);
+
+
+/*
+ * Scheduler
+ *
+ * Runs a fleet of VMs on a pool of worker threads, `slice` instructions at
+ * a time. Each worker round-robins the VMs in its own deque and steals from
+ * the others when it runs dry. VMs added to a scheduler never block on
+ * input: one that waits for a key is parked until lc3_push_input() or
+ * lc3_close_input() is called on it.
+*/
+struct lc3_sched;
+
+struct lc3_sched *lc3_sched_create(int workers, uint64_t slice);
+void lc3_sched_destroy(struct lc3_sched *sched);
+
+// Add a loaded VM; only before lc3_sched_run(). Returns 0 when out of memory.
+int lc3_sched_add(struct lc3_sched *sched, struct lc3_vm *vm);
+
+// Run every VM until it halts.
+void lc3_sched_run(struct lc3_sched *sched);
+
+// Instructions per second and slice latency percentiles, as JSON on stderr.
+void lc3_sched_report(const struct lc3_sched *sched);
+
+
+/*
+ * Batch runs
+ *
+ * Runs one image over many inputs on a pool of threads, each input in a
+ * fresh copy of the VM as it was loaded, with the input file as its
+ * keyboard. Every input gets one JSON line in the results, in input order:
+ * the exit reason, the instructions retired and the output.
+*/
+struct lc3_batch_stats {
+    size_t   inputs;
+    size_t   failed;            // inputs that couldn't be read
+    uint64_t instructions;
+    uint64_t elapsed_ns;
+};
+
+// Run `vm`, loaded, over each input file, at most `limit` instructions
+// each (0 for no limit). The core, cache, fusion and trap-vector options
+// and the trap handlers carry over; `vm` is left backed by a snapshot of
+// itself. Returns 0 when out of memory.
+int lc3_batch(struct lc3_vm *vm, const char *const *inputs, size_t count, int workers,
+              uint64_t limit, FILE *results, struct lc3_batch_stats *stats);
+
+
+/*
+ * VM server
+ *
+ * Serves sessions of a set of images on a Unix socket from a pool of VMs
+ * per image, loaded and decoded before any client comes. A client sends a
+ * line naming the image, by its path or file name (an empty line for the
+ * first one), and the socket is then the VM's console until it halts; the
+ * line "stats" gets lc3_server_report() instead. After each session the VM
+ * is restored from the image's snapshot and waits for the next one.
+*/
+struct lc3_server;
+
+// Load the images and `pool` VMs of each, with the options and trap
+// handlers of `model`, which must outlive the server, and listen on
+// `path`. NULL on failure.
+struct lc3_server *lc3_server_create(const char *path, const struct lc3_vm *model,
+                                     const char *const *images, size_t count, size_t pool);
+
+// Accept sessions until lc3_server_stop(), which is async-signal-safe.
+void lc3_server_run(struct lc3_server *server);
+void lc3_server_stop(struct lc3_server *server);
+
+// Wait for running sessions to see the stop, then free everything.
+void lc3_server_destroy(struct lc3_server *server);
+
+// Sessions, cold spawns and spawn latency percentiles (from the request
+// line to a VM ready to run), as JSON.
+void lc3_server_report(struct lc3_server *server, FILE *out);
+
+
+/*
+ * Console event loop
+ *
+ * One thread, sleeping in io_uring or epoll, feeds the bytes arriving on
+ * many fds (sockets, pipes, terminals) to their VMs' keyboards. With the
+ * scheduler a VM waiting for a key stays parked until its fd has data.
+ * Output goes straight from each VM to its fd: see lc3_set_output_fd().
+*/
+struct lc3_io;
+
+enum {
+    LC3_IO_AUTO = 0,    // io_uring if the kernel has it, else epoll
+    LC3_IO_EPOLL,
+    LC3_IO_URING
+};
+
+// Start the loop on its own thread. NULL if the backend isn't available.
+struct lc3_io *lc3_io_create(int backend);
+
+// Stop the loop. The fds stay open.
+void lc3_io_destroy(struct lc3_io *io);
+
+// Read `fd` into the VM's input from now on; at its end the VM's input is
+// closed. Any thread may attach. Returns 0 when out of memory.
+int lc3_io_attach(struct lc3_io *io, struct lc3_vm *vm, int fd);
+
+// "io_uring" or "epoll".
+const char *lc3_io_backend(const struct lc3_io *io);
+
+
+/*
+ * Internals shared by lc3.c and the other modules
+*/
+
+uint64_t monotonic_ns(void);
+
+bool keyboard_ready(struct lc3_vm *vm);
+
+uint16_t mem_read(struct lc3_vm *vm, uint16_t address);
+void     mem_write(struct lc3_vm *vm, uint16_t address, uint16_t value);
+
+// the pages lc3_create() maps devices in
+#define DEVICE_PAGES_BUILTIN (1u << (MR_KBSR >> PAGE_SHIFT))
+
+// Loads and fetches here have to go through mem_read.
+static inline bool device_page(const struct lc3_vm *vm, uint16_t address) {
+    return vm->device_pages >> (address >> PAGE_SHIFT) & 1;
+}
+
+void decode(uint16_t instruction, struct decoded *op);
+const struct decoded *fetch(struct lc3_vm *vm, struct decoded *scratch);
+
+// Fill the decode cache entries of `pages` (a bit per page) up front.
+void predecode(struct decoded *cache, const uint16_t *memory, uint32_t pages, bool fusion);
+
+uint16_t sign_extend(uint16_t x, int num_bits);
+uint16_t condition_flags(const struct lc3_vm *vm);
+void     settle_flags(struct lc3_vm *vm);
+
+// Drop the decode cache entry of a word, and any superinstruction over it.
+void forget_decoded(struct lc3_vm *vm, uint16_t address);
+
+// Forget the decoded and translated forms of words changed behind mem_write.
+void invalidate_range(struct lc3_vm *vm, uint16_t origin, size_t length);
+
+// Budget checks happen at control transfers and at fetches from MR_KBSR,
+// and straight-line code reaches one of those within MEMORY_MAX
+// instructions, so the cores run free until the last RUN_EXACT_MARGIN of
+// a budget and the rest is counted one instruction at a time.
+#define RUN_EXACT_MARGIN MEMORY_MAX
+#define RUN_CLOCK_STRIDE (1 << 20)
+
+// End the run at the next check, for a reason other than the budget.
+void stop_run(struct lc3_vm *vm, int reason);
+
+void sched_wake(struct lc3_vm *vm);
+
+// Log-linear latency histogram, 16 buckets per power of two, and its
+// p50, p90, p99 and p999 as named in histogram_names.
+#define HISTOGRAM_SUB         16
+#define HISTOGRAM_BUCKETS     (64 * HISTOGRAM_SUB)
+#define HISTOGRAM_PERCENTILES 4
+
+extern const char *histogram_names[HISTOGRAM_PERCENTILES];
+
+unsigned histogram_bucket(uint64_t value);
+uint64_t histogram_value(unsigned bucket);
+void     histogram_percentiles(const uint64_t *histogram, uint64_t count, uint64_t *percentiles);
+
+void run_call(struct lc3_vm *vm);
+void run_jit(struct lc3_vm *vm);
+void jit_flush(struct lc3_vm *vm);
+void jit_destroy(struct lc3_vm *vm);
+
+void run_blocks(struct lc3_vm *vm);
+void blocks_flush(struct lc3_vm *vm);
+void blocks_destroy(struct lc3_vm *vm);
+
+void perf_start(struct lc3_vm *vm);
+void perf_stop(struct lc3_vm *vm);
+void perf_close(struct lc3_vm *vm);
+
+void profile_count(struct lc3_vm *vm, uint16_t pc, const struct decoded *op);
+void profile_destroy(struct lc3_vm *vm);
+
+// What trace_before() saw of an instruction, for trace_after().
+struct trace_step {
+    uint16_t pc;
+    uint16_t word;
+    uint16_t address;       // a store's
+    uint8_t  opcode;
+    uint8_t  dest;          // DR
+    uint16_t registers[R7 + 1];
+};
+
+// Inside the trace window. trace_boundary() is the count to stop at to
+// enter or leave it, or `limit`.
+bool     trace_on(const struct lc3_vm *vm);
+uint64_t trace_boundary(const struct lc3_vm *vm, uint64_t limit);
+
+// Around an instruction's execution. trace_before() returns false for a PC
+// outside the range; trace_after() is skipped when it is rewound.
+bool trace_before(struct lc3_vm *vm, uint16_t pc, const struct decoded *op, struct trace_step *step);
+void trace_after(struct lc3_vm *vm, const struct trace_step *step);
+
+// The state in the body of a snapshot file.
+bool snapshot_write_vm(const struct lc3_vm *vm, FILE *file);
+struct lc3_snapshot *snapshot_read(FILE *file);
+
+// Log a key taken, or EOF. The run stops at record_due() for record_checkpoint().
+void     record_key(struct lc3_vm *vm, int key);
+uint64_t record_due(const struct lc3_vm *vm);
+void     record_checkpoint(struct lc3_vm *vm);
+void     replay_destroy(struct lc3_vm *vm);
+
+// Bounded by `max` or `count` words, for PUTS, PUTSP and the extension
+// traps: the words before a zero, their low bytes, and their byte pairs
+// low first without zero high bytes (returning the bytes written, at most
+// twice `count`).
+size_t words_length(const uint16_t *words, size_t max);
+void   words_pack(char *dst, const uint16_t *src, size_t count);
+size_t words_pairs(char *dst, const uint16_t *src, size_t count);
+
+uint16_t swap16(uint16_t x);
+void     swap16_block(uint16_t *dst, const uint16_t *src, size_t count);
+void     benchmark_swap(int rounds);
+
+int  read_image(struct lc3_vm *vm, const char *image_path);
+void read_image_file(struct lc3_vm *vm, FILE *file);
+void benchmark_loading(struct lc3_vm *vm, const char *image_path, int rounds);
+int  write_cached_image(const struct lc3_vm *vm, const char *path);
+bool is_cached_image(const void *data, size_t size);
+
+#endif
@@ -4,501 +4,1048 @@
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
-#include <unistd.h>
+#include <pthread.h>
 #include <fcntl.h>
-#include <sys/time.h>
-#include <sys/types.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
-#include <sys/mman.h>
-
-
-// default Program Counter start position
-#define PC_START 0x3000
-
-
-uint16_t memory[UINT16_MAX];
-
-
-// CPU Registers
-enum {
-    R0 = 0,
-    R1,
-    R2,
-    R3,
-    R4,
-    R5,
-    R6,
-    R7,
-    R_PC,
-    R_COND,
-    R_COUNT
-};
-
-uint16_t registers[R_COUNT];
-
-
-// Condition (R_COND) Flags
-enum {
-    FLG_POS = 1 << 0,
-    FLG_ZRO = 1 << 1,
-    FLG_NEG = 1 << 2,
-};
-
-
-// Opcodes
-enum {
-    OP_BR = 0, // branch
-    OP_ADD,    // add
-    OP_LD,     // load
-    OP_ST,     // store
-    OP_JSR,    // jump register
-    OP_AND,    // bitwise and
-    OP_LDR,    // load register
-    OP_STR,    // store register
-    OP_RTI,    // unused
-    OP_NOT,    // bitwise not
-    OP_LDI,    // load indirect
-    OP_STI,    // store indirect
-    OP_JMP,    // jump
-    OP_RES,    // reserved (unused)
-    OP_LEA,    // load effective address
-    OP_TRAP    // execute trap
-};
-
-
-// Trap Routines
-enum {
-    TRAP_GETC  = 0x20,  // get character from keyboard, not echoed onto the terminal
-    TRAP_OUT   = 0x21,  // output a character
-    TRAP_PUTS  = 0x22,  // output a word string
-    TRAP_IN    = 0x23,  // get character from keyboard, echoed onto the terminal
-    TRAP_PUTSP = 0x24,  // output a byte string
-    TRAP_HALT  = 0x25   // halt the program
-};
-
-
-enum {
-    MR_KBSR = 0xFE00, // keyboard status
-    MR_KBDR = 0xFE02  // keyboard data
-};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "lc3.h"
+
+
+struct lc3_vm *vm; // the first VM; the only one outside --fleet
+
+struct lc3_vm **fleet;
+int fleet_size = 1;
+
+bool benchmark = false;
+bool statistics = false;
+
+bool profiling = false;
+const char *profile_path = NULL; // collapsed stacks, written with the report
+
+// --record checkpoints every this many instructions unless told otherwise
+#define RECORD_INTERVAL 10000000
+
+// and --batch stops each input after this many
+#define BATCH_LIMIT 100000000
+
+// ready VMs per image under --serve
+#define SERVE_POOL 8
 
 
 struct termios original_tio;
+bool terminal_changed = false;
 
 
 void disable_input_buffering() {
-    tcgetattr(STDIN_FILENO, &original_tio);
+    if (tcgetattr(STDIN_FILENO, &original_tio) != 0) {
+        return;
+    }
+
     struct termios new_tio = original_tio;
 
     new_tio.c_lflag &= ~ICANON & ~ECHO;
     tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    terminal_changed = true;
 }
 
 
 void restore_input_buffering() {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    if (terminal_changed) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
 }
 
 
+void report_profile() {
+    if (!profiling) {
+        return;
+    }
+
+    lc3_profile_report(vm, stderr);
+
+    if (profile_path && !lc3_profile_save(vm, profile_path)) {
+        fprintf(stderr, "falha ao gravar o perfil: %s\n", profile_path);
+    }
+}
+
+
+void stop_recording() {
+    if (!lc3_record_stop(vm)) {
+        fprintf(stderr, "falha ao terminar a gravação\n");
+    }
+
+    if (!lc3_trace_stop(vm)) {
+        fprintf(stderr, "falha ao gravar o trace\n");
+    }
+}
+
+
+// Ctrl-C only flags the VMs: the runs return within INTERRUPT_POLL_NS, and
+// the main thread finishes up in finish_interrupted(), outside the handler.
+volatile sig_atomic_t interrupted = 0;
+
+#define INTERRUPT_POLL_NS 50000000
+
+
 void handle_interrupt(int signal) {
+    interrupted = 1;
+
+    for (int i = 0; i < fleet_size; ++i) {
+        lc3_interrupt(fleet[i]);
+    }
+}
+
+
+void finish_interrupted() {
+    for (int i = 0; i < fleet_size; ++i) {
+        lc3_flush_output(fleet[i]);
+    }
     restore_input_buffering();
     printf("\n");
+    stop_recording();
+    report_profile();
     exit(-2);
 }
 
 
-uint16_t check_key() {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+// Copies stdin into the keyboard ring of every VM, waiting whenever one is
+// full; VMs that halted are skipped.
+void *stdin_reader(void *unused) {
+    char buffer[KEYBOARD_BUFFER];
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
+    for (;;) {
+        ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
 
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+        if (count <= 0) {
+            for (int i = 0; i < fleet_size; ++i) {
+                lc3_close_input(fleet[i]);
+            }
+            return NULL;
+        }
+
+        for (int i = 0; i < fleet_size; ++i) {
+            size_t pushed = 0;
+            while ((pushed += lc3_push_input(fleet[i], buffer + pushed, count - pushed)) < (size_t) count
+                   && lc3_wait_input_space(fleet[i])) {
+            }
+        }
+    }
 }
 
 
-uint16_t swap16(uint16_t x) {
-    return (x << 8) | (x >> 8);
-}
+// Run `max` instructions or up to HALT. Traps without a handler do nothing,
+// as they always have, watch hits are reported on stderr, and an illegal
+// instruction ends the process, as does Ctrl-C, checked between runs of at
+// most INTERRUPT_POLL_NS.
+void run(struct lc3_vm *vm, uint64_t max) {
+    uint64_t end = max < UINT64_MAX - vm->instructions ? vm->instructions + max : UINT64_MAX;
+
+    for (;;) {
+        int reason = lc3_run_until(vm, end == UINT64_MAX ? LC3_FOREVER : end - vm->instructions,
+                                   monotonic_ns() + INTERRUPT_POLL_NS);
+
+        if (interrupted) {
+            finish_interrupted();
+        }
 
+        if (reason == LC3_ILLEGAL) {
+            lc3_flush_output(vm);
+            restore_input_buffering();
+            fprintf(stderr, "instrução ilegal em x%04X\n", vm->registers[R_PC]);
+            stop_recording();
+            abort();
+        }
 
-void read_image_file(FILE* file) {
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+        if (reason == LC3_WATCH) {
+            lc3_flush_output(vm);
+            fprintf(stderr, "%s x%04X em x%04X, PC x%04X, instrução %llu\n",
+                    vm->watch_write ? "escrita de" : "leitura de", vm->watch_value,
+                    vm->watch_address, vm->registers[R_PC], (unsigned long long) vm->instructions);
+            continue;
+        }
 
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t *p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+        if (reason == LC3_BUDGET && vm->instructions < end) {
+            continue;
+        }
 
-    while (read-- > 0) {
-        *p = swap16(*p);
-        ++p;
+        if (reason != LC3_TRAP) {
+            return;
+        }
     }
 }
 
 
-int read_image(const char* image_path) {
-    FILE* file = fopen(image_path, "rb");
+// The whole file in a malloc'd buffer, with a NUL after it, or NULL.
+uint8_t *read_file(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    uint8_t *data = NULL;
+    size_t size = 0, used = 0;
 
     if (!file) {
-        return 0;
+        return NULL;
+    }
+
+    for (;;) {
+        if (used == size) {
+            uint8_t *bigger = realloc(data, size = size ? 2 * size : 4096);
+            if (!bigger) {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = bigger;
+        }
+
+        size_t count = fread(data + used, 1, size - used, file);
+        used += count;
+
+        if (count == 0) {
+            break;
+        }
     }
 
-    read_image_file(file);
     fclose(file);
+    data[used] = '\0';
+    *length = used;
 
-    return 1;
+    return data;
 }
 
-/*
- * Memory access procedures
-*/
-void mem_write(uint16_t address, uint16_t value) {
-    memory[address] = value;
+
+// "path[,N]": the path, and N in *count when it's there.
+const char *split_count(const char *argument, uint64_t *count) {
+    const char *comma = strrchr(argument, ',');
+    char *end;
+
+    if (!comma || comma[1] == '\0') {
+        return argument;
+    }
+
+    uint64_t value = strtoull(comma + 1, &end, 10);
+    if (*end != '\0') {
+        return argument;
+    }
+
+    *count = value;
+
+    return strndup(argument, comma - argument);
 }
 
 
-uint16_t mem_read(uint16_t address) {
-    if (address == MR_KBSR) {
-        if (check_key()) {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+// "path[,xA-xB][,N-M]": the path, the PC range and the window of
+// instruction counts, either of them left as it was when missing; M may be
+// left out for no end. NULL if malformed.
+const char *split_trace(const char *argument, uint16_t *first_pc, uint16_t *last_pc,
+                        uint64_t *from, uint64_t *to) {
+    const char *comma = strchr(argument, ',');
+    const char *path = comma ? strndup(argument, comma - argument) : argument;
+
+    while (comma) {
+        const char *text = comma + 1;
+        char *end;
+
+        if (*text == 'x') {
+            unsigned long first = strtoul(text + 1, &end, 16);
+            unsigned long last = first;
+
+            if (*end == '-') {
+                text = end + 1;
+                last = strtoul(text + (*text == 'x'), &end, 16);
+            }
+            if (last < first || last > 0xFFFF) {
+                return NULL;
+            }
+
+            *first_pc = first;
+            *last_pc  = last;
         }
         else {
-            memory[MR_KBSR] = 0;
+            *from = strtoull(text, &end, 10);
+
+            if (*end != '-') {
+                return NULL;
+            }
+
+            text = end + 1;
+            *to  = strtoull(text, &end, 10);
+
+            if (end == text) {
+                *to = UINT64_MAX;
+            }
+            if (*to <= *from) {
+                return NULL;
+            }
+        }
+
+        if (*end != ',' && *end != '\0') {
+            return NULL;
         }
+
+        comma = *end == ',' ? end : NULL;
     }
 
-    return memory[address];
+    return path;
 }
 
 
-/*
- * CPU Procedures
-*/
+// `keys` instruction counts, in decimal and separated by whitespace, or
+// NULL if the file is missing or short.
+uint64_t *read_schedule(const char *path, size_t keys) {
+    size_t length;
+    char *text = (char *) read_file(path, &length);
+    uint64_t *at = calloc(keys ? keys : 1, sizeof(uint64_t));
+    char *next = text;
+    size_t i = 0;
 
-uint16_t sign_extend(uint16_t x, int num_bits) {
-    if ((x >> (num_bits - 1)) & 1) {
-        x |= (0xFFFF << num_bits);
+    for (; text && at && i < keys; ++i) {
+        char *end;
+        at[i] = strtoull(next, &end, 10);
+        if (end == next) {
+            break;
+        }
+        next = end;
     }
-    return x;
+
+    if (!text || i < keys) {
+        free(text);
+        free(at);
+        return NULL;
+    }
+
+    free(text);
+
+    return at;
 }
 
 
-void update_flags(uint16_t register_) {
-    if (registers[register_] == 0) {
-        registers[R_COND] = FLG_ZRO;
-    }
-    else if (registers[register_] >> 15) {
-        registers[R_COND] = FLG_NEG;
-    }
-    else {
-        registers[R_COND] = FLG_POS;
-    }
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
 }
 
 
-void add(uint16_t instruction) {
-    uint16_t register0      = (instruction >> 9) & 0x7; // DR
-    uint16_t register1      = (instruction >> 6) & 0x7; // SR1
-    uint16_t immediate_flag = (instruction >> 5) & 0x1;
+// The inputs of --batch: the regular files in a directory, sorted by name,
+// or for "-" one path per line of stdin. NULL if the directory can't be read.
+const char **list_inputs(const char *source, size_t *count) {
+    const char **paths = NULL;
+    size_t used = 0, size = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    DIR *directory = NULL;
 
-    if (immediate_flag) {
-        uint16_t imm5        = sign_extend(instruction & 0x1F, 5);
-        registers[register0] = registers[register1] + imm5;
-    } else {
-        uint16_t register2   = instruction & 0x7;
-        registers[register0] = registers[register1] + registers[register2];
+    if (strcmp(source, "-") != 0 && !(directory = opendir(source))) {
+        return NULL;
     }
 
-    update_flags(register0);
-}
+    for (;;) {
+        char *path;
 
+        if (directory) {
+            struct dirent *entry = readdir(directory);
+            struct stat status;
 
-void ldi(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;            // DR
-    uint16_t pc_offset = sign_extend(instruction & 0x1FF, 9); // PC offset 9
+            if (!entry) {
+                break;
+            }
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+
+            size_t length = strlen(source) + strlen(entry->d_name) + 2;
+            if (!(path = malloc(length))) {
+                continue;
+            }
+            snprintf(path, length, "%s/%s", source, entry->d_name);
+
+            if (stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+                free(path);
+                continue;
+            }
+        }
+        else {
+            ssize_t length = getline(&line, &line_size, stdin);
 
-    registers[register0] = mem_read(mem_read(registers[R_PC] + pc_offset));
-    update_flags(register0);
+            if (length < 0) {
+                break;
+            }
+            if (length > 0 && line[length - 1] == '\n') {
+                line[--length] = '\0';
+            }
+            if (length == 0 || !(path = strdup(line))) {
+                continue;
+            }
+        }
+
+        if (used == size) {
+            const char **bigger = realloc(paths, (size = size ? 2 * size : 256) * sizeof(*paths));
+            if (!bigger) {
+                printf("memória insuficiente\n");
+                exit(1);
+            }
+            paths = bigger;
+        }
+
+        paths[used++] = path;
+    }
+
+    if (directory) {
+        closedir(directory);
+        qsort(paths, used, sizeof(*paths), compare_paths);
+    }
+
+    free(line);
+    *count = used;
+
+    return paths ? paths : calloc(1, sizeof(*paths));
 }
 
 
-void and(uint16_t instruction) {
-    uint16_t register0      = (instruction >> 9) & 0x7;
-    uint16_t register1      = (instruction >> 6) & 0x7;
-    uint16_t immediate_flag = (instruction >> 5) & 0x1;
+// --batch: a JSON line per input into the output file, and with --bench
+// the throughput on stderr.
+int run_batch(const char *source, uint64_t limit, int workers, int output_fd) {
+    size_t count;
+    const char **inputs = list_inputs(source, &count);
+    FILE *results = output_fd == STDOUT_FILENO ? stdout : fdopen(output_fd, "w");
+    struct lc3_batch_stats stats;
 
-    if (immediate_flag) {
-        uint16_t imm5        = sign_extend(instruction & 0x1F, 5);
-        registers[register0] = registers[register1] & imm5;
+    if (!inputs) {
+        printf("falha ao ler as entradas: %s\n", source);
+        return 1;
     }
-    else {
-        uint16_t register2   = instruction & 0x7;
-        registers[register0] = registers[register1] & registers[register2];
+
+    if (!results || !lc3_batch(vm, inputs, count, workers, limit, results, &stats)) {
+        printf("memória insuficiente\n");
+        return 1;
     }
 
-    update_flags(register0);
+    if (benchmark) {
+        fprintf(stderr,
+                "{\"batch\":%zu,\"failed\":%zu,\"workers\":%d,\"instructions\":%llu,\"seconds\":%.6f,"
+                "\"inputs_per_second\":%.0f,\"instructions_per_second\":%.0f}\n",
+                stats.inputs, stats.failed, workers, (unsigned long long) stats.instructions,
+                stats.elapsed_ns / 1e9,
+                stats.elapsed_ns ? stats.inputs * 1e9 / stats.elapsed_ns : 0,
+                stats.elapsed_ns ? stats.instructions * 1e9 / stats.elapsed_ns : 0);
+    }
+
+    fclose(results);
+
+    return stats.failed ? 1 : 0;
 }
 
 
-void not(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t register1 = (instruction >> 6) & 0x7;
+struct lc3_server *server;
 
-    registers[register0] = ~registers[register1];
-    update_flags(register0);
+
+void stop_server(int signal) {
+    lc3_server_stop(server);
 }
 
 
-void br(uint16_t instruction) {
-    uint16_t pc_offset = sign_extend(instruction & 0x1FF, 9);
-    uint16_t cond_flag = (instruction >> 9) & 0x7;
+// --serve: the images on the command line, each with a pool of ready VMs,
+// until Ctrl-C, then the session report on stderr.
+int run_server(const char *path, uint64_t pool, int argc, const char *argv[]) {
+    const char **images = calloc(argc, sizeof(*images));
+    size_t count = 0;
+
+    for (int i = 1; images && i < argc; ++i) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            images[count++] = argv[i];
+        }
+    }
 
-    if (cond_flag & registers[R_COND]) {
-        registers[R_PC] += pc_offset;
+    // a client that leaves early must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!images || !(server = lc3_server_create(path, vm, images, count, pool))) {
+        printf("falha ao iniciar o servidor em %s\n", path);
+        return 1;
     }
+
+    fprintf(stderr, "servindo %zu imagens em %s, %llu VMs prontas de cada\n",
+            count, path, (unsigned long long) pool);
+
+    signal(SIGINT, stop_server);
+    lc3_server_run(server);
+    lc3_server_report(server, stderr);
+    lc3_server_destroy(server);
+    free(images);
+
+    return 0;
 }
 
 
-void jmp(uint16_t instruction) {
-    uint16_t register1 = (instruction >> 6) & 0x7;
-    registers[R_PC]    = registers[register1];
+uint64_t cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
 }
 
 
-void jsr(uint16_t instruction) {
-    uint16_t long_flag = (instruction >> 11) & 1;
-    registers[R7] = registers[R_PC];
+// One JSON object per run on stderr, so results can be collected by scripts.
+void report_benchmark(uint64_t elapsed_ns, uint64_t cycles) {
+    double per_instruction = vm->instructions ? 1.0 / vm->instructions : 0;
+
+    fprintf(stderr,
+            "{\"core\":\"%s\",\"cache\":%s,\"instructions\":%llu,"
+            "\"seconds\":%.6f,\"instructions_per_second\":%.0f,\"ns_per_instruction\":%.3f,",
+            core_names[vm->core],
+            vm->decode_cache_enabled ? "true" : "false",
+            (unsigned long long) vm->instructions,
+            elapsed_ns / 1e9,
+            elapsed_ns ? vm->instructions * 1e9 / elapsed_ns : 0,
+            elapsed_ns * per_instruction);
 
-    if (long_flag) {
-        uint16_t long_pc_offset = sign_extend(instruction & 0x7FF, 11);
-        registers[R_PC] += long_pc_offset; // JSR
+    if (cycles) {
+        fprintf(stderr, "\"cycles_per_instruction\":%.3f}\n", cycles * per_instruction);
     }
     else {
-        uint16_t register1 = (instruction >> 6) & 0x7;
-        registers[R_PC] = registers[register1]; // JSRR
+        fprintf(stderr, "\"cycles_per_instruction\":null}\n");
+    }
+
+    for (int vector = 0; vector < 256; ++vector) {
+        const struct lc3_trap *trap = &vm->traps[vector];
+
+        if (trap->calls > 0) {
+            fprintf(stderr, "{\"trap\":\"x%02X\",\"calls\":%llu,\"seconds\":%.6f}\n",
+                    vector, (unsigned long long) trap->calls, trap->ns / 1e9);
+        }
     }
 }
 
 
-void ld(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instruction & 0x1FF, 9);
+// One JSON object per VM on stderr; the host counters are null when the
+// kernel doesn't allow perf_event_open.
+void report_stats() {
+    for (int n = 0; n < fleet_size; ++n) {
+        struct lc3_stats stats;
+        lc3_get_stats(fleet[n], &stats);
+
+        fprintf(stderr,
+                "{\"vm\":%d,\"instructions\":%llu,\"mips\":%.3f,\"run_seconds\":%.6f,"
+                "\"kbsr_polls\":%llu,\"input_wait_seconds\":%.6f,\"trap_seconds\":%.6f,"
+                "\"string_bytes\":%llu,\"flushes\":%llu,\"fusions\":{",
+                n, (unsigned long long) stats.instructions,
+                stats.run_ns ? stats.instructions * 1e3 / stats.run_ns : 0,
+                stats.run_ns / 1e9,
+                (unsigned long long) stats.kbsr_polls,
+                stats.input_wait_ns / 1e9,
+                stats.trap_ns / 1e9,
+                (unsigned long long) stats.string_bytes,
+                (unsigned long long) stats.flushes);
+
+        for (int kind = 0; kind < FUSION_COUNT; ++kind) {
+            fprintf(stderr, "%s\"%s\":%llu", kind ? "," : "", fusion_names[kind],
+                    (unsigned long long) stats.fusions[kind]);
+        }
+
+        fprintf(stderr, "},");
 
-    registers[register0] = mem_read(registers[R_PC] + pc_offset);
-    update_flags(register0);
+        if (stats.perf_valid) {
+            fprintf(stderr, "\"cycles\":%llu,\"host_instructions\":%llu,\"ipc\":%.3f,\"branch_misses\":%llu}\n",
+                    (unsigned long long) stats.cycles,
+                    (unsigned long long) stats.host_instructions,
+                    stats.cycles ? (double) stats.host_instructions / stats.cycles : 0,
+                    (unsigned long long) stats.branch_misses);
+        }
+        else {
+            fprintf(stderr, "\"cycles\":null,\"host_instructions\":null,\"ipc\":null,\"branch_misses\":null}\n");
+        }
+    }
 }
 
 
-void ldr(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t register1 = (instruction >> 6) & 0x7;
-    uint16_t offset = sign_extend(instruction & 0x3F, 6);
+// Wait for one TCP connection per fleet VM and make each the console of
+// its VM: keys come in through the event loop, output goes straight back.
+struct lc3_io *serve_consoles(int port, int backend, size_t output_size, int **sockets) {
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port),
+                                   .sin_addr.s_addr = htonl(INADDR_ANY) };
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
 
-    registers[register0] = mem_read(registers[register1] + offset);
-    update_flags(register0);
-}
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0
+        || listen(listener, fleet_size) != 0) {
+        printf("falha ao escutar na porta %d\n", port);
+        exit(1);
+    }
 
-void lea(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instruction & 0x1FF, 9);
+    struct lc3_io *io = lc3_io_create(backend);
+    *sockets = calloc(fleet_size, sizeof(int));
 
-    registers[register0] = registers[R_PC] + pc_offset;
-    update_flags(register0);
-}
+    if (!io || !*sockets) {
+        printf("laço de eventos indisponível\n");
+        exit(1);
+    }
 
+    fprintf(stderr, "aguardando %d conexões na porta %d (%s)\n", fleet_size, port, lc3_io_backend(io));
 
-void st(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instruction & 0x1FF, 9);
+    for (int n = 0; n < fleet_size; ++n) {
+        int fd = accept(listener, NULL, NULL);
 
-    mem_write(registers[R_PC] + pc_offset, registers[register0]);
-}
+        if (fd < 0 || !lc3_io_attach(io, fleet[n], fd)) {
+            printf("falha ao aceitar a conexão %d\n", n);
+            exit(1);
+        }
 
+        (*sockets)[n] = fd;
+        lc3_configure_output(fleet[n], output_size, OUTPUT_LINE);
+        lc3_set_output_fd(fleet[n], fd);
+    }
 
-void sti(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instruction & 0x1FF, 9);
+    close(listener);
 
-    mem_write(mem_read(registers[R_PC] + pc_offset), registers[register0]);
+    return io;
 }
 
 
-void str(uint16_t instruction) {
-    uint16_t register0 = (instruction >> 9) & 0x7;
-    uint16_t register1 = (instruction >> 6) & 0x7;
-    uint16_t offset = sign_extend(instruction & 0x3F, 6);
-
-    mem_write(registers[register1] + offset, registers[register0]);
+void usage() {
+    printf("Forma de usar:\n ./lc3 [--no-cache] [--no-fusion] [--core=call|threaded|jit|block] [--bench] [--stats]\n        [--idle] [--profile[=stacks.txt]] [--trap-vectors] [--ext-traps]\n        [--output-buffer=N] [--input=keys [--schedule=counts]] [--output=file] [--raw-output]\n        [--bench-load=N] [--bench-swap=N] [--fleet=N]\n        [--workers=N] [--slice=N] [--snapshot=N,state.lc3s]\n        [--listen=port [--io=epoll|uring]] [--record=file[,N]] [--watch=xA[-xB]]\n        [--trace=file[,xA-xB][,N-M]] [--batch=dir|-[,N]] /path/to/image \n"
+           " ./lc3 --serve=socket[,N] [options] image...\n"
+           " ./lc3 --replay=file[,N] [options]\n"
+           " ./lc3 --convert image.obj image.lc3i\n");
+    exit(2);
 }
 
-/*
- * TRAP codes procedures implementation
-*/
 
-void trap_puts() {
-    uint16_t *char_ = memory + registers[R0];
+int main(int argc, const char *argv[]) {
+    vm = lc3_create();
 
-    while (*char_) {
-        putc((char) *char_, stdout);
-        ++char_;
+    if (!vm) {
+        printf("memória insuficiente\n");
+        exit(1);
     }
 
-    fflush(stdout);
-}
+    if (argc == 4 && strcmp(argv[1], "--convert") == 0) {
+        if (!read_image(vm, argv[2])) {
+            printf("falha ao carregar a imagem: %s\n", argv[2]);
+            exit(1);
+        }
+        if (!write_cached_image(vm, argv[3])) {
+            printf("falha ao gravar a imagem: %s\n", argv[3]);
+            exit(1);
+        }
+        return 0;
+    }
 
+    int images = 0;
+    int workers = 0;
+    uint64_t slice = 0;
+    uint64_t snapshot_at = 0;
+    const char *snapshot_path = NULL;
+    int load_rounds = 0;
+    int swap_rounds = 0;
+    const char *input_path = NULL;
+    const char *schedule_path = NULL;
+    const char *output_path = NULL;
+    int listen_port = 0;
+    int io_backend = LC3_IO_AUTO;
+    const char *record_path = NULL;
+    uint64_t record_interval = RECORD_INTERVAL;
+    const char *replay_path = NULL;
+    uint64_t replay_at = 0;
+    const char *batch_source = NULL;
+    const char *trace_path = NULL;
+    bool extension_traps = false;
+    const char *serve_path = NULL;
+    uint64_t serve_pool = SERVE_POOL;
+    uint16_t trace_first = 0, trace_last = 0xFFFF;
+    uint64_t trace_from = 0, trace_to = UINT64_MAX;
+    uint64_t batch_limit = BATCH_LIMIT;
+    size_t output_size = OUTPUT_BUFFER;
+    int output_mode = isatty(STDOUT_FILENO) ? OUTPUT_LINE : OUTPUT_BLOCK;
 
-void trap_getc() {
-    registers[R0] = (uint16_t) getchar();
-}
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--no-cache") == 0) {
+            vm->decode_cache_enabled = false;
+        }
+        else if (strcmp(argv[i], "--no-fusion") == 0) {
+            vm->fusion_enabled = false;
+        }
+        else if (strcmp(argv[i], "--core=call") == 0) {
+            vm->core = CORE_CALL;
+        }
+        else if (strcmp(argv[i], "--core=threaded") == 0) {
+            vm->core = CORE_THREADED;
+        }
+        else if (strcmp(argv[i], "--core=jit") == 0) {
+            vm->core = CORE_JIT;
+        }
+        else if (strcmp(argv[i], "--core=block") == 0) {
+            vm->core = CORE_BLOCK;
+        }
+        else if (strcmp(argv[i], "--bench") == 0) {
+            benchmark = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            statistics = true;
+            vm->perf_counters = true;
+        }
+        else if (strcmp(argv[i], "--idle") == 0) {
+            vm->idle_detection = true;
+        }
+        else if (strcmp(argv[i], "--profile") == 0) {
+            profiling = true;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profiling    = true;
+            profile_path = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--trap-vectors") == 0) {
+            vm->trap_memory_vectors = true;
+        }
+        else if (strcmp(argv[i], "--ext-traps") == 0) {
+            extension_traps = true;
+        }
+        else if (strncmp(argv[i], "--output-buffer=", 16) == 0) {
+            output_size = strtoul(argv[i] + 16, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--input=", 8) == 0) {
+            input_path = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--schedule=", 11) == 0) {
+            schedule_path = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--output=", 9) == 0) {
+            output_path = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--listen=", 9) == 0) {
+            listen_port = atoi(argv[i] + 9);
+        }
+        else if (strcmp(argv[i], "--io=epoll") == 0) {
+            io_backend = LC3_IO_EPOLL;
+        }
+        else if (strcmp(argv[i], "--io=uring") == 0) {
+            io_backend = LC3_IO_URING;
+        }
+        else if (strcmp(argv[i], "--raw-output") == 0) {
+            output_mode = OUTPUT_RAW;
+        }
+        else if (strncmp(argv[i], "--bench-load=", 13) == 0) {
+            load_rounds = atoi(argv[i] + 13);
+        }
+        else if (strncmp(argv[i], "--bench-swap=", 13) == 0) {
+            swap_rounds = atoi(argv[i] + 13);
+        }
+        else if (strncmp(argv[i], "--fleet=", 8) == 0) {
+            fleet_size = atoi(argv[i] + 8);
+        }
+        else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = atoi(argv[i] + 10);
+        }
+        else if (strncmp(argv[i], "--slice=", 8) == 0) {
+            slice = strtoull(argv[i] + 8, NULL, 10);
+        }
+        else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            char *end;
+            snapshot_at = strtoull(argv[i] + 11, &end, 10);
+            if (*end != ',' || end[1] == '\0') {
+                usage();
+            }
+            snapshot_path = end + 1;
+        }
+        else if (strncmp(argv[i], "--watch=", 8) == 0) {
+            char *end;
+            const char *text = argv[i] + 8;
+            unsigned long first = strtoul(text + (*text == 'x'), &end, 16);
+            unsigned long last = first;
+
+            if (*end == '-') {
+                text = end + 1;
+                last = strtoul(text + (*text == 'x'), &end, 16);
+            }
+            if (*end != '\0' || last < first || last > 0xFFFF
+                || !lc3_watch(vm, first, last, LC3_WATCH_READ | LC3_WATCH_WRITE)) {
+                usage();
+            }
+        }
+        else if (strncmp(argv[i], "--record=", 9) == 0) {
+            record_path = split_count(argv[i] + 9, &record_interval);
+        }
+        else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replay_path = split_count(argv[i] + 9, &replay_at);
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_path = split_trace(argv[i] + 8, &trace_first, &trace_last, &trace_from, &trace_to);
+            if (!trace_path) {
+                usage();
+            }
+        }
+        else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serve_path = split_count(argv[i] + 8, &serve_pool);
+        }
+        else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch_source = split_count(argv[i] + 8, &batch_limit);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            usage();
+        }
+        else {
+            ++images;
+        }
+    }
 
+    if (swap_rounds > 0) {
+        benchmark_swap(swap_rounds);
+        return 0;
+    }
 
-void trap_out() {
-    putc((char) registers[R0], stdout);
-    fflush(stdout);
-}
+    if ((images == 0) == !replay_path || fleet_size < 1 || (schedule_path && !input_path)
+        || listen_port < 0 || (listen_port && (input_path || output_path))
+        || ((record_path || replay_path || trace_path) && fleet_size > 1)
+        || (replay_path && (record_path || input_path || listen_port))
+        || (replay_path && snapshot_path && replay_at)
+        || (batch_source && (fleet_size > 1 || input_path || listen_port || record_path
+                             || replay_path || snapshot_path || profiling || trace_path))
+        || (serve_path && (fleet_size > 1 || input_path || listen_port || record_path || replay_path
+                           || snapshot_path || profiling || trace_path || batch_source
+                           || serve_pool == 0))) {
+        usage();
+    }
 
+    // a batch spreads over every core unless told otherwise
+    if (workers <= 0) {
+        workers = batch_source ? (int) sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+    if (workers <= 0) {
+        workers = 1;
+    }
 
-void trap_in() {
-    printf("Digite um caractere: ");
-    char char_ = getchar();
-    putc(char_, stdout);
-    registers[R0] = (uint16_t) char_;
-}
+    if (load_rounds > 0) {
+        for (int i = 1; i < argc; ++i) {
+            if (strncmp(argv[i], "--", 2) != 0) {
+                benchmark_loading(vm, argv[i], load_rounds);
+            }
+        }
+        return 0;
+    }
 
+    if (serve_path) {
+        if (extension_traps) {
+            lc3_add_extension_traps(vm);
+        }
+        return run_server(serve_path, serve_pool, argc, argv);
+    }
 
-void trap_putsp() {
-    uint16_t *char_ = memory + registers[R0];
+    // headless: input from a file, optionally on a schedule, and no terminal
+    uint8_t *keys = NULL;
+    size_t key_count = 0;
+    uint64_t *key_at = NULL;
 
-    while (*char_) {
-        char char1 = (*char_) & 0xFF;
-        putc(char1, stdout);
+    if (input_path && !(keys = read_file(input_path, &key_count))) {
+        printf("falha ao ler a entrada: %s\n", input_path);
+        exit(1);
+    }
 
-        char char2 = (*char_) >> 8;
-        if (char2) putc(char2, stdout);
+    if (schedule_path && !(key_at = read_schedule(schedule_path, key_count))) {
+        printf("agenda inválida ou com menos instantes que teclas: %s\n", schedule_path);
+        exit(1);
+    }
+
+    int output_fd = STDOUT_FILENO;
 
-        ++char_;
+    if (output_path) {
+        output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (output_mode == OUTPUT_LINE) {
+            output_mode = OUTPUT_BLOCK;
+        }
+
+        if (output_fd < 0) {
+            printf("falha ao abrir a saída: %s\n", output_path);
+            exit(1);
+        }
     }
 
-    fflush(stdout);
-}
+    fleet = calloc(fleet_size, sizeof(*fleet));
+    fleet[0] = vm;
 
+    struct lc3_snapshot *shared = NULL;
 
-void halt(bool **running) {
-    puts("HALT");
-    fflush(stdout);
-    *running = false;
-}
+    for (int n = 0; n < fleet_size; ++n) {
+        if (!fleet[n]) {
+            fleet[n] = lc3_create();
+        }
 
+        if (!fleet[n]) {
+            printf("memória insuficiente\n");
+            exit(1);
+        }
 
-void trap(uint16_t instruction, bool *running) {
-    switch (instruction & 0xFF) {
-        case TRAP_GETC:
-            trap_getc();
-            break;
-        case TRAP_OUT:
-            trap_out();
-            break;
-        case TRAP_PUTS:
-            trap_puts();
-            break;
-        case TRAP_IN:
-            trap_in();
-            break;
-        case TRAP_PUTSP:
-            trap_putsp();
-            break;
-        case TRAP_HALT:
-            halt(&running);
-            break;
+        fleet[n]->decode_cache_enabled = vm->decode_cache_enabled;
+        fleet[n]->fusion_enabled       = vm->fusion_enabled;
+        fleet[n]->core                 = vm->core;
+        fleet[n]->idle_detection       = vm->idle_detection;
+        fleet[n]->trap_memory_vectors  = vm->trap_memory_vectors;
+        fleet[n]->perf_counters        = vm->perf_counters;
+
+        if (extension_traps) {
+            lc3_add_extension_traps(fleet[n]);
+        }
+
+        // the rest of the fleet starts from the first VM's pages and decoded
+        // code, and only copies what it writes
+        if (n > 0 && shared) {
+            if (!lc3_restore(fleet[n], shared)) {
+                printf("memória insuficiente\n");
+                exit(1);
+            }
+        }
+
+        for (int i = 1; n == 0 && i < argc; ++i) {
+            if (strncmp(argv[i], "--", 2) == 0) {
+                continue;
+            }
+
+            if (!lc3_load(fleet[n], argv[i])) {
+                printf("falha ao carregar a imagem: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+
+        if (n == 0 && fleet_size > 1) {
+            shared = lc3_snapshot(vm);
+
+            if (!shared) {
+                printf("memória insuficiente\n");
+                exit(1);
+            }
+        }
+
+        lc3_configure_output(fleet[n], output_size, output_mode);
+        lc3_set_output_fd(fleet[n], output_fd);
+
+        if (keys) {
+            lc3_set_input_script(fleet[n], keys, key_count, key_at);
+        }
     }
-}
 
+    lc3_snapshot_release(shared);
 
-int main(int argc, const char *argv[]) {
-    if (argc < 2) {
-        printf("Forma de usar:\n ./lc3 /path/to/image.obj \n");
-        exit(2);
+    if (batch_source) {
+        return run_batch(batch_source, batch_limit, workers, output_fd);
     }
 
-    for (int i = 1; i < argc; ++i) {
-        if (!read_image(argv[i])) {
-            printf("falha ao carregar a imagem: %s\n", argv[i]);
+    // a replay seeks to the instruction asked for, the snapshot's if any,
+    // and takes its input from the recording
+    if (replay_path && !lc3_replay(vm, replay_path, snapshot_path ? snapshot_at : replay_at)) {
+        printf("falha ao ler a gravação: %s\n", replay_path);
+        exit(1);
+    }
+
+    if (record_path && !lc3_record_start(vm, record_path, record_interval)) {
+        printf("falha ao gravar: %s\n", record_path);
+        exit(1);
+    }
+
+    if (trace_path && !lc3_trace_start(vm, trace_path, trace_first, trace_last, trace_from, trace_to)) {
+        printf("falha ao gravar o trace: %s\n", trace_path);
+        exit(1);
+    }
+
+    struct lc3_io *io = NULL;
+    int *sockets = NULL;
+
+    if (listen_port) {
+        // a client that leaves ends its own console, not the process
+        signal(SIGPIPE, SIG_IGN);
+        io = serve_consoles(listen_port, io_backend, output_size, &sockets);
+    }
+
+    if (profiling && !lc3_profile_start(vm)) {
+        printf("memória insuficiente\n");
+        exit(1);
+    }
+
+    signal(SIGINT, handle_interrupt);
+
+    if (!keys && !io && !replay_path) {
+        disable_input_buffering();
+
+        pthread_t reader;
+        pthread_create(&reader, NULL, stdin_reader, NULL);
+    }
+
+    uint64_t start_ns     = monotonic_ns();
+    uint64_t start_cycles = cycle_counter();
+
+    if (snapshot_path) {
+        run(vm, snapshot_at > vm->instructions ? snapshot_at - vm->instructions : 0);
+
+        struct lc3_snapshot *snapshot = lc3_snapshot(vm);
+        if (!snapshot || !lc3_snapshot_save(snapshot, snapshot_path)) {
+            printf("falha ao gravar o snapshot: %s\n", snapshot_path);
             exit(1);
         }
+        lc3_snapshot_release(snapshot);
+        stop_recording();
+        lc3_flush_output(vm);
+        restore_input_buffering();
+
+        return 0;
     }
 
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    if (fleet_size == 1 && workers == 1 && slice == 0 && !io) {
+        run(vm, LC3_FOREVER);
+        stop_recording();
+        report_profile();
 
-    registers[R_PC] = PC_START;
+        if (statistics) {
+            report_stats();
+        }
 
-    bool running = true;
+        if (benchmark) {
+            report_benchmark(monotonic_ns() - start_ns, cycle_counter() - start_cycles);
+        }
 
-    while (running) {
-        uint16_t instruction = mem_read(registers[R_PC]++);
-        uint16_t opcode = instruction >> 12;
+        return 0;
+    }
 
-        switch (opcode) {
-            case OP_ADD:
-                add(instruction);
-                break;
-            case OP_AND:
-                and(instruction);
-                break;
-            case OP_NOT:
-                not(instruction);
-                break;
-            case OP_BR:
-                br(instruction);
-                break;
-            case OP_JMP:
-                jmp(instruction);
-                break;
-            case OP_JSR:
-                jsr(instruction);
-                break;
-            case OP_LD:
-                ld(instruction);
-                break;
-            case OP_LDI:
-                ldi(instruction);
-                break;
-            case OP_LDR:
-                ldr(instruction);
-                break;
-            case OP_LEA:
-                lea(instruction);
-                break;
-            case OP_ST:
-                st(instruction);
-                break;
-            case OP_STI:
-                sti(instruction);
-                break;
-            case OP_STR:
-                str(instruction);
-                break;
-            case OP_TRAP:
-                trap(instruction, &running);
-                break;
-            case OP_RES:
-                abort();
-                break;
-            case OP_RTI:
-                abort();
-                break;
-            default:
-                abort();
-                break;
-      }
+    struct lc3_sched *sched = lc3_sched_create(workers, slice);
+
+    for (int n = 0; sched && n < fleet_size; ++n) {
+        if (!lc3_sched_add(sched, fleet[n])) {
+            sched = NULL;
+        }
+    }
+
+    if (!sched) {
+        printf("memória insuficiente\n");
+        exit(1);
+    }
+
+    lc3_sched_run(sched);
 
+    if (interrupted) {
+        finish_interrupted();
     }
+
+    stop_recording();
+    report_profile();
+
+    lc3_io_destroy(io);
+    for (int n = 0; io && n < fleet_size; ++n) {
+        close(sockets[n]);
+    }
+
+    if (statistics) {
+        report_stats();
+    }
+
+    if (benchmark) {
+        lc3_sched_report(sched);
+    }
+
     return 0;
 }
@@ -0,0 +1,360 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3.h"
+
+
+/*
+ * Guest profiler
+ *
+ * A variant of the portable loop, generated with the others in lc3.c,
+ * counts executions per PC and per opcode, taken backward branches, and
+ * instructions per call path. Only it has the counters, so the other loops
+ * are compiled without them and cost nothing when no profile is running.
+ *
+ * Calls are JSR/JSRR and, with trap_memory_vectors, TRAPs that jump
+ * through memory; a JMP R7 returns from the innermost frame expecting that
+ * address. Each distinct call path is a node in a tree, so the report can
+ * give functions inclusive counts and the collapsed stacks flamegraph.pl
+ * reads come straight from the nodes.
+*/
+#define PROFILE_NODES 4096  // distinct call paths; deeper new paths fold into their parent
+#define PROFILE_DEPTH 1024
+#define PROFILE_TOP   20    // rows per table in the report
+
+struct profile_node {
+    uint32_t parent;
+    uint16_t function;      // entry address
+    uint64_t calls;
+    uint64_t self;          // instructions retired with this path on top
+};
+
+struct profile_frame {
+    uint32_t node;
+    uint16_t return_address;
+};
+
+struct lc3_profile {
+    uint64_t instructions;
+    uint64_t pc[MEMORY_MAX];
+    uint64_t back_edges[MEMORY_MAX]; // taken backward BRs, by branch address
+    uint64_t opcodes[16];
+
+    struct profile_node nodes[PROFILE_NODES];
+    uint32_t            node_count;
+    uint32_t            children[2 * PROFILE_NODES]; // open addressing on (parent, function), 0 is empty
+
+    struct profile_frame stack[PROFILE_DEPTH];
+    uint32_t             depth;
+    uint32_t             current;
+};
+
+static const char *const opcode_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+
+int lc3_profile_start(struct lc3_vm *vm) {
+    if (!vm->profile) {
+        vm->profile = malloc(sizeof(*vm->profile));
+
+        if (!vm->profile) {
+            return 0;
+        }
+    }
+
+    struct lc3_profile *profile = vm->profile;
+
+    memset(profile, 0, sizeof(*profile));
+
+    // node 0 is the code running when the profile started
+    profile->nodes[0].function = vm->registers[R_PC];
+    profile->nodes[0].calls    = 1;
+    profile->node_count        = 1;
+
+    return 1;
+}
+
+
+void profile_destroy(struct lc3_vm *vm) {
+    free(vm->profile);
+    vm->profile = NULL;
+}
+
+
+static uint32_t profile_child(struct lc3_profile *profile, uint32_t parent, uint16_t function) {
+    uint32_t mask = 2 * PROFILE_NODES - 1;
+    uint32_t slot = (parent * 0x9E3779B1u ^ function) & mask;
+
+    for (;;) {
+        uint32_t index = profile->children[slot];
+
+        if (index == 0) {
+            break;
+        }
+
+        const struct profile_node *node = &profile->nodes[index];
+
+        if (node->parent == parent && node->function == function) {
+            return index;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    if (profile->node_count == PROFILE_NODES) {
+        return parent;
+    }
+
+    uint32_t index = profile->node_count++;
+
+    profile->nodes[index].parent   = parent;
+    profile->nodes[index].function = function;
+    profile->children[slot]        = index;
+
+    return index;
+}
+
+
+static void profile_call(struct lc3_profile *profile, uint16_t function, uint16_t return_address) {
+    if (profile->depth == PROFILE_DEPTH) {
+        return;
+    }
+
+    profile->stack[profile->depth].node           = profile->current;
+    profile->stack[profile->depth].return_address = return_address;
+    ++profile->depth;
+
+    profile->current = profile_child(profile, profile->current, function);
+    ++profile->nodes[profile->current].calls;
+}
+
+
+// Unwind to the frame that expects `address`; a JMP R7 matching none is
+// a computed jump, not a return.
+static void profile_return(struct lc3_profile *profile, uint16_t address) {
+    for (uint32_t depth = profile->depth; depth > 0; --depth) {
+        if (profile->stack[depth - 1].return_address == address) {
+            profile->depth   = depth - 1;
+            profile->current = profile->stack[depth - 1].node;
+            return;
+        }
+    }
+}
+
+
+// Count an instruction the profiled call core variant just ran: `op`, at
+// `pc`, with PC now on the next one.
+void profile_count(struct lc3_vm *vm, uint16_t pc, const struct decoded *op) {
+    struct lc3_profile *profile = vm->profile;
+    uint16_t next = vm->registers[R_PC];
+
+    ++profile->instructions;
+    ++profile->pc[pc];
+    ++profile->opcodes[op->opcode];
+    ++profile->nodes[profile->current].self;
+
+    if (next == (uint16_t) (pc + 1)) {
+        return;
+    }
+
+    if (op->opcode == OP_BR && next <= pc) {
+        ++profile->back_edges[pc];
+    }
+    else if (op->opcode == OP_JSR) {
+        profile_call(profile, next, pc + 1);
+    }
+    else if (op->opcode == OP_JMP && op->register1 == R7) {
+        profile_return(profile, next);
+    }
+    else if (op->opcode == OP_TRAP && !vm->halted && vm->registers[R7] == (uint16_t) (pc + 1)) {
+        profile_call(profile, next, pc + 1);
+    }
+}
+
+
+/*
+ * Reports
+*/
+
+struct profile_row {
+    uint16_t address;
+    uint64_t count;
+    uint64_t extra;
+};
+
+
+static int by_count(const void *a, const void *b) {
+    const struct profile_row *x = a;
+    const struct profile_row *y = b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : (int) x->address - (int) y->address;
+}
+
+
+// Rows for every address with a non-zero count, largest first.
+static size_t profile_rows(struct profile_row *rows, const uint64_t *counts, const uint64_t *extra) {
+    size_t used = 0;
+
+    for (uint32_t address = 0; address < MEMORY_MAX; ++address) {
+        if (counts[address]) {
+            rows[used].address = address;
+            rows[used].count   = counts[address];
+            rows[used].extra   = extra ? extra[address] : 0;
+            ++used;
+        }
+    }
+
+    qsort(rows, used, sizeof(*rows), by_count);
+
+    return used;
+}
+
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0;
+}
+
+
+int lc3_profile_report(const struct lc3_vm *vm, FILE *out) {
+    const struct lc3_profile *profile = vm->profile;
+
+    if (!profile) {
+        return 0;
+    }
+
+    uint64_t total = profile->instructions;
+    struct profile_row *rows = malloc(MEMORY_MAX * sizeof(*rows));
+    uint64_t *calls     = calloc(MEMORY_MAX, sizeof(uint64_t));
+    uint64_t *inclusive = calloc(MEMORY_MAX, sizeof(uint64_t));
+    uint32_t *seen      = calloc(MEMORY_MAX, sizeof(uint32_t));
+
+    if (!rows || !calls || !inclusive || !seen) {
+        free(rows);
+        free(calls);
+        free(inclusive);
+        free(seen);
+        return 0;
+    }
+
+    fprintf(out, "perfil: %llu instruções\n", (unsigned long long) total);
+
+    fprintf(out, "\nopcodes:\n");
+    for (int opcode = 0; opcode < 16; ++opcode) {
+        if (profile->opcodes[opcode]) {
+            fprintf(out, "  %-5s %12llu %6.2f%%\n", opcode_names[opcode],
+                    (unsigned long long) profile->opcodes[opcode], percent(profile->opcodes[opcode], total));
+        }
+    }
+
+    size_t used = profile_rows(rows, profile->pc, NULL);
+
+    fprintf(out, "\nendereços mais executados:\n");
+    for (size_t i = 0; i < used && i < PROFILE_TOP; ++i) {
+        uint16_t instruction = vm->memory[rows[i].address];
+        fprintf(out, "  x%04X %-5s x%04X %12llu %6.2f%%\n", rows[i].address,
+                opcode_names[instruction >> 12], instruction,
+                (unsigned long long) rows[i].count, percent(rows[i].count, total));
+    }
+
+    used = profile_rows(rows, profile->back_edges, NULL);
+
+    fprintf(out, "\nlaços quentes (desvios para trás):\n");
+    for (size_t i = 0; i < used && i < PROFILE_TOP; ++i) {
+        uint16_t target = rows[i].address + 1 + sign_extend(vm->memory[rows[i].address] & 0x1FF, 9);
+        fprintf(out, "  x%04X -> x%04X %12llu voltas\n", rows[i].address, target,
+                (unsigned long long) rows[i].count);
+    }
+
+    // a node's instructions count once towards every function on its
+    // path, however often recursion repeats it there
+    for (uint32_t index = 0; index < profile->node_count; ++index) {
+        const struct profile_node *node = &profile->nodes[index];
+
+        calls[node->function] += node->calls;
+
+        for (uint32_t up = index;; up = profile->nodes[up].parent) {
+            uint16_t function = profile->nodes[up].function;
+
+            if (seen[function] != index + 1) {
+                seen[function] = index + 1;
+                inclusive[function] += node->self;
+            }
+
+            if (up == 0) {
+                break;
+            }
+        }
+    }
+
+    used = profile_rows(rows, inclusive, calls);
+
+    fprintf(out, "\nfunções (inclusivo):\n");
+    for (size_t i = 0; i < used && i < PROFILE_TOP; ++i) {
+        fprintf(out, "  x%04X %10llu chamadas %12llu %6.2f%%\n", rows[i].address,
+                (unsigned long long) rows[i].extra,
+                (unsigned long long) rows[i].count, percent(rows[i].count, total));
+    }
+
+    free(rows);
+    free(calls);
+    free(inclusive);
+    free(seen);
+
+    return 1;
+}
+
+
+int lc3_profile_save(const struct lc3_vm *vm, const char *path) {
+    const struct lc3_profile *profile = vm->profile;
+    uint16_t path_functions[PROFILE_NODES];
+
+    if (!profile) {
+        return 0;
+    }
+
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        return 0;
+    }
+
+    // one "root;caller;callee count" line per call path
+    for (uint32_t index = 0; index < profile->node_count; ++index) {
+        if (!profile->nodes[index].self) {
+            continue;
+        }
+
+        size_t length = 0;
+
+        for (uint32_t up = index;; up = profile->nodes[up].parent) {
+            path_functions[length++] = profile->nodes[up].function;
+
+            if (up == 0) {
+                break;
+            }
+        }
+
+        while (length-- > 0) {
+            fprintf(file, length ? "x%04X;" : "x%04X", path_functions[length]);
+        }
+
+        fprintf(file, " %llu\n", (unsigned long long) profile->nodes[index].self);
+    }
+
+    return fclose(file) == 0;
+}
+
+
+/*
+ * Coverage
+*/
+
+void lc3_set_coverage(struct lc3_vm *vm, uint8_t *map, size_t size) {
+    vm->coverage      = size ? map : NULL;
+    vm->coverage_mask = vm->coverage ? size - 1 : 0;
+}
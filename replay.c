@@ -0,0 +1,342 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3.h"
+
+
+/*
+ * Recordings
+ *
+ * "LC3R" and a big-endian version word, then records of a tag byte and
+ * the big-endian instruction count they happened at:
+ *
+ *   'K' key     the key's byte follows
+ *   'E' EOF     input ended; written once, by lc3_record_stop() at the latest
+ *   'C' state   a 32-bit length and a snapshot file body of that length
+ *
+ * Counts never go down. A key taken during instruction n is logged at n,
+ * which is after n - 1 instructions retired, and a checkpoint at n is
+ * taken once n instructions retired, so it comes after the keys at n.
+*/
+#define RECORDING_MAGIC   "LC3R"
+#define RECORDING_VERSION 1
+
+enum {
+    RECORD_KEY        = 'K',
+    RECORD_EOF        = 'E',
+    RECORD_CHECKPOINT = 'C'
+};
+
+struct lc3_recording {
+    FILE    *file;
+    uint64_t interval;      // 0: only the checkpoint at the start
+    uint64_t due;           // instruction count of the next checkpoint
+    bool     eof;           // the EOF record is written
+    bool     failed;        // a write failed
+};
+
+// the recorded input lc3_set_input_script() points at
+struct lc3_replay {
+    uint8_t  *keys;
+    uint64_t *at;
+    size_t    count;
+};
+
+
+static void put_be(uint8_t *bytes, uint64_t value, int size) {
+    for (int i = size - 1; i >= 0; --i) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+
+static uint64_t get_be(const uint8_t *bytes, int size) {
+    uint64_t value = 0;
+
+    for (int i = 0; i < size; ++i) {
+        value = value << 8 | bytes[i];
+    }
+
+    return value;
+}
+
+
+static void write_record(struct lc3_recording *recording, uint8_t tag, uint64_t at) {
+    uint8_t record[9];
+
+    record[0] = tag;
+    put_be(record + 1, at, 8);
+
+    if (fwrite(record, sizeof(record), 1, recording->file) != 1) {
+        recording->failed = true;
+    }
+}
+
+
+void record_key(struct lc3_vm *vm, int key) {
+    struct lc3_recording *recording = vm->recording;
+
+    // input stays ended, so one EOF record does for every read after it
+    if (recording->eof) {
+        return;
+    }
+
+    if (key == EOF) {
+        write_record(recording, RECORD_EOF, vm->instructions);
+        recording->eof = true;
+        return;
+    }
+
+    write_record(recording, RECORD_KEY, vm->instructions);
+
+    if (fputc(key, recording->file) == EOF) {
+        recording->failed = true;
+    }
+}
+
+
+uint64_t record_due(const struct lc3_vm *vm) {
+    return vm->recording->due;
+}
+
+
+void record_checkpoint(struct lc3_vm *vm) {
+    struct lc3_recording *recording = vm->recording;
+    uint8_t length[4];
+
+    write_record(recording, RECORD_CHECKPOINT, vm->instructions);
+
+    // the length is known once the body is written
+    long start = ftell(recording->file);
+    bool ok = start >= 0
+              && fwrite(length, sizeof(length), 1, recording->file) == 1
+              && snapshot_write_vm(vm, recording->file);
+    long end = ftell(recording->file);
+
+    put_be(length, end - start - sizeof(length), 4);
+
+    ok = ok && end >= 0
+         && fseek(recording->file, start, SEEK_SET) == 0
+         && fwrite(length, sizeof(length), 1, recording->file) == 1
+         && fseek(recording->file, end, SEEK_SET) == 0;
+
+    if (!ok) {
+        recording->failed = true;
+    }
+
+    recording->due = recording->interval && vm->instructions < UINT64_MAX - recording->interval
+                     ? vm->instructions + recording->interval : UINT64_MAX;
+}
+
+
+int lc3_record_start(struct lc3_vm *vm, const char *path, uint64_t interval) {
+    lc3_record_stop(vm);
+
+    struct lc3_recording *recording = calloc(1, sizeof(*recording));
+    uint8_t header[6];
+
+    if (!recording || !(recording->file = fopen(path, "wb"))) {
+        free(recording);
+        return 0;
+    }
+
+    memcpy(header, RECORDING_MAGIC, 4);
+    put_be(header + 4, RECORDING_VERSION, 2);
+
+    recording->interval = interval;
+    recording->failed   = fwrite(header, sizeof(header), 1, recording->file) != 1;
+    vm->recording       = recording;
+
+    record_checkpoint(vm);
+
+    if (recording->failed) {
+        fclose(recording->file);
+        free(recording);
+        vm->recording = NULL;
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int lc3_record_stop(struct lc3_vm *vm) {
+    struct lc3_recording *recording = vm->recording;
+
+    if (!recording) {
+        return 1;
+    }
+
+    // whatever comes after the recording isn't in it
+    record_key(vm, EOF);
+    vm->recording = NULL;
+
+    bool ok = fclose(recording->file) == 0 && !recording->failed;
+    free(recording);
+
+    return ok;
+}
+
+
+void replay_destroy(struct lc3_vm *vm) {
+    lc3_record_stop(vm);
+
+    if (vm->replay) {
+        free(vm->replay->keys);
+        free(vm->replay->at);
+        free(vm->replay);
+        vm->replay = NULL;
+    }
+}
+
+
+static void discard_output(void *context, const char *data, size_t length) {
+}
+
+
+// Read the events of the recording, and find the last checkpoint at or
+// before `at`: its count and where its body starts.
+static bool read_recording(FILE *file, struct lc3_replay *replay, uint64_t *eof_at,
+                           uint64_t at, uint64_t *checkpoint_at, long *checkpoint) {
+    uint8_t header[6];
+    size_t size = 0;
+
+    if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, RECORDING_MAGIC, 4) != 0
+        || get_be(header + 4, 2) != RECORDING_VERSION) {
+        return false;
+    }
+
+    *checkpoint = -1;
+    *eof_at     = UINT64_MAX;
+
+    for (;;) {
+        uint8_t record[9];
+
+        if (fread(record, sizeof(record), 1, file) != 1) {
+            return feof(file) && *checkpoint >= 0;
+        }
+
+        uint64_t count = get_be(record + 1, 8);
+
+        switch (record[0]) {
+            case RECORD_KEY: {
+                int key = fgetc(file);
+
+                if (key == EOF) {
+                    return false;
+                }
+
+                if (replay->count == size) {
+                    size = size ? 2 * size : 4096;
+                    uint8_t  *keys   = realloc(replay->keys, size);
+                    uint64_t *counts = realloc(replay->at, size * sizeof(uint64_t));
+
+                    if (keys) {
+                        replay->keys = keys;
+                    }
+                    if (counts) {
+                        replay->at = counts;
+                    }
+                    if (!keys || !counts) {
+                        return false;
+                    }
+                }
+
+                replay->keys[replay->count] = key;
+                replay->at[replay->count++] = count;
+                break;
+            }
+
+            case RECORD_EOF:
+                *eof_at = count;
+                break;
+
+            case RECORD_CHECKPOINT: {
+                uint8_t length[4];
+
+                if (fread(length, sizeof(length), 1, file) != 1) {
+                    return false;
+                }
+
+                if (count <= at || *checkpoint < 0) {
+                    *checkpoint_at = count;
+                    *checkpoint    = ftell(file);
+                }
+
+                if (fseek(file, get_be(length, 4), SEEK_CUR) != 0) {
+                    return false;
+                }
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+}
+
+
+int lc3_replay(struct lc3_vm *vm, const char *path, uint64_t at) {
+    FILE *file = fopen(path, "rb");
+    struct lc3_replay *replay = calloc(1, sizeof(*replay));
+    struct lc3_snapshot *snapshot = NULL;
+    uint64_t eof_at, checkpoint_at = 0;
+    long checkpoint;
+
+    bool ok = file && replay
+              && read_recording(file, replay, &eof_at, at, &checkpoint_at, &checkpoint)
+              && fseek(file, checkpoint, SEEK_SET) == 0
+              && (snapshot = snapshot_read(file))
+              && lc3_restore(vm, snapshot);
+
+    if (file) {
+        fclose(file);
+    }
+    lc3_snapshot_release(snapshot);
+
+    if (!ok) {
+        if (replay) {
+            free(replay->keys);
+            free(replay->at);
+            free(replay);
+        }
+        return 0;
+    }
+
+    replay_destroy(vm);
+    vm->replay       = replay;
+    vm->instructions = checkpoint_at;
+
+    // the keys already taken when the checkpoint was made are left behind
+    size_t next = 0;
+    while (next < replay->count && replay->at[next] <= checkpoint_at) {
+        ++next;
+    }
+
+    lc3_set_input_script(vm, replay->keys, replay->count, replay->at);
+    vm->keyboard.script_next = next;
+    vm->keyboard.script_end  = eof_at;
+
+    if (at > vm->instructions) {
+        output_sink sink = vm->output.sink;
+        void *context    = vm->output.sink_context;
+
+        lc3_set_output_sink(vm, discard_output, NULL);
+
+        while (!vm->halted && vm->instructions < at) {
+            int reason = lc3_run(vm, at - vm->instructions);
+
+            if (reason == LC3_ILLEGAL || reason == LC3_INPUT) {
+                break;
+            }
+        }
+
+        lc3_set_output_sink(vm, sink, context);
+    }
+
+    return 1;
+}
@@ -0,0 +1,470 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "lc3.h"
+
+
+/*
+ * Scheduler
+ *
+ * Each worker owns a deque of runnable VMs. It takes the VM at the front,
+ * runs one slice and puts it back at the end, so the VMs of a worker share
+ * it round-robin; a worker with an empty deque steals from the end of
+ * another one. A VM whose slice stopped on input is parked: it is in no
+ * deque until sched_wake() hands it back to its last worker.
+ *
+ * The deques are small and only touched once per slice, so a mutex each is
+ * enough; the lock-free part is the parking handshake on sched_state.
+ *
+ * An interrupted VM is done after its slice. lc3_interrupt() can't wake a
+ * worker, so idle workers nap for KEYBOARD_POLL_NS at most and requeue the
+ * parked VMs that were interrupted meanwhile.
+*/
+#define SCHED_DEFAULT_SLICE 100000
+
+enum {
+    VM_IDLE = 0, // not added yet
+    VM_QUEUED,   // in some deque
+    VM_RUNNING,  // taken by a worker
+    VM_PARKED,   // waiting for input
+    VM_DONE      // halted
+};
+
+struct worker {
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    struct lc3_vm  **deque;     // ring of capacity vm_count
+    size_t           head;
+    size_t           count;
+    struct lc3_sched *sched;
+    int              index;
+    unsigned         seed;
+
+    uint64_t slices;
+    uint64_t steals;
+    uint64_t parks;
+    uint64_t max_slice_ns;
+    uint64_t histogram[HISTOGRAM_BUCKETS];
+};
+
+struct lc3_sched {
+    struct worker  *workers;
+    int             worker_count;
+    uint64_t        slice;
+
+    struct lc3_vm **vms;
+    size_t          vm_count;
+    size_t          vm_capacity;
+
+    atomic_size_t   queued;     // VMs in all deques
+    atomic_size_t   finished;
+    atomic_int      sleepers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle;
+    bool            done;
+
+    uint64_t instructions;
+    uint64_t elapsed_ns;
+};
+
+
+const char *histogram_names[HISTOGRAM_PERCENTILES] = { "p50", "p90", "p99", "p999" };
+
+
+unsigned histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB) {
+        return (unsigned) value;
+    }
+
+    unsigned exponent = 63 - __builtin_clzll(value);
+    return (exponent - 3) * HISTOGRAM_SUB + ((value >> (exponent - 4)) & (HISTOGRAM_SUB - 1));
+}
+
+
+// Lower bound of a bucket, within 1/16 of every value counted in it.
+uint64_t histogram_value(unsigned bucket) {
+    if (bucket < HISTOGRAM_SUB) {
+        return bucket;
+    }
+
+    unsigned exponent = bucket / HISTOGRAM_SUB + 3;
+    return (uint64_t) (HISTOGRAM_SUB + bucket % HISTOGRAM_SUB) << (exponent - 4);
+}
+
+
+void histogram_percentiles(const uint64_t *histogram, uint64_t count, uint64_t *percentiles) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t seen = 0;
+    unsigned q = 0;
+
+    memset(percentiles, 0, HISTOGRAM_PERCENTILES * sizeof(uint64_t));
+
+    for (unsigned b = 0; b < HISTOGRAM_BUCKETS && q < HISTOGRAM_PERCENTILES; ++b) {
+        seen += histogram[b];
+        while (q < HISTOGRAM_PERCENTILES && count > 0 && seen >= quantiles[q] * count) {
+            percentiles[q++] = histogram_value(b);
+        }
+    }
+}
+
+
+struct lc3_sched *lc3_sched_create(int workers, uint64_t slice) {
+    struct lc3_sched *sched = calloc(1, sizeof(*sched));
+
+    if (!sched) {
+        return NULL;
+    }
+
+    sched->worker_count = workers > 0 ? workers : 1;
+    sched->slice        = slice > 0 ? slice : SCHED_DEFAULT_SLICE;
+    sched->workers      = calloc(sched->worker_count, sizeof(struct worker));
+
+    if (!sched->workers) {
+        free(sched);
+        return NULL;
+    }
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        pthread_mutex_init(&sched->workers[i].lock, NULL);
+        sched->workers[i].sched = sched;
+        sched->workers[i].index = i;
+        sched->workers[i].seed  = 2654435761u * (i + 1);
+    }
+
+    pthread_mutex_init(&sched->idle_lock, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+
+    return sched;
+}
+
+
+void lc3_sched_destroy(struct lc3_sched *sched) {
+    if (!sched) {
+        return;
+    }
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        pthread_mutex_destroy(&sched->workers[i].lock);
+        free(sched->workers[i].deque);
+    }
+
+    for (size_t i = 0; i < sched->vm_count; ++i) {
+        sched->vms[i]->sched = NULL;
+    }
+
+    pthread_mutex_destroy(&sched->idle_lock);
+    pthread_cond_destroy(&sched->idle);
+    free(sched->workers);
+    free(sched->vms);
+    free(sched);
+}
+
+
+int lc3_sched_add(struct lc3_sched *sched, struct lc3_vm *vm) {
+    if (sched->vm_count == sched->vm_capacity) {
+        size_t capacity = sched->vm_capacity ? 2 * sched->vm_capacity : 64;
+        struct lc3_vm **vms = realloc(sched->vms, capacity * sizeof(*vms));
+
+        if (!vms) {
+            return 0;
+        }
+
+        sched->vms         = vms;
+        sched->vm_capacity = capacity;
+    }
+
+    vm->nonblocking_input = true;
+    vm->sched_worker      = sched->vm_count % sched->worker_count;
+    atomic_store(&vm->sched_state, VM_IDLE);
+    sched->vms[sched->vm_count++] = vm;
+
+    return 1;
+}
+
+
+static void sched_push(struct lc3_sched *sched, struct worker *worker, struct lc3_vm *vm) {
+    pthread_mutex_lock(&worker->lock);
+    worker->deque[(worker->head + worker->count) % sched->vm_count] = vm;
+    ++worker->count;
+    atomic_fetch_add(&sched->queued, 1);
+    pthread_mutex_unlock(&worker->lock);
+
+    if (atomic_load(&sched->sleepers) > 0) {
+        pthread_mutex_lock(&sched->idle_lock);
+        pthread_cond_signal(&sched->idle);
+        pthread_mutex_unlock(&sched->idle_lock);
+    }
+}
+
+
+static struct lc3_vm *sched_pop(struct lc3_sched *sched, struct worker *worker) {
+    struct lc3_vm *vm = NULL;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        vm = worker->deque[worker->head];
+        worker->head = (worker->head + 1) % sched->vm_count;
+        --worker->count;
+        atomic_fetch_sub(&sched->queued, 1);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return vm;
+}
+
+
+static struct lc3_vm *sched_steal(struct lc3_sched *sched, struct worker *thief) {
+    thief->seed = thief->seed * 1103515245u + 12345u;
+    int start = (thief->seed >> 16) % sched->worker_count;
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        struct worker *victim = &sched->workers[(start + i) % sched->worker_count];
+        struct lc3_vm *vm = NULL;
+
+        if (victim == thief) {
+            continue;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count > 0) {
+            --victim->count;
+            vm = victim->deque[(victim->head + victim->count) % sched->vm_count];
+            atomic_fetch_sub(&sched->queued, 1);
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (vm) {
+            ++thief->steals;
+            return vm;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Called after input reaches a VM: requeue it if it was parked. The state
+// change makes sure only one of the producer and the parking worker does.
+void sched_wake(struct lc3_vm *vm) {
+    int parked = VM_PARKED;
+
+    if (atomic_compare_exchange_strong(&vm->sched_state, &parked, VM_QUEUED)) {
+        sched_push(vm->sched, &vm->sched->workers[vm->sched_worker], vm);
+    }
+}
+
+
+// Requeue the parked VMs that lc3_interrupt() asked to stop, so a worker
+// finishes them.
+static void sched_wake_interrupted(struct lc3_sched *sched) {
+    for (size_t i = 0; i < sched->vm_count; ++i) {
+        if (atomic_load(&sched->vms[i]->keyboard.interrupted)) {
+            sched_wake(sched->vms[i]);
+        }
+    }
+}
+
+
+// Sleep until some deque has a VM, every VM has halted, or a nap is over.
+static bool sched_idle(struct lc3_sched *sched) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += KEYBOARD_POLL_NS / 1000000000u;
+    deadline.tv_nsec += KEYBOARD_POLL_NS % 1000000000u;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec  += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&sched->idle_lock);
+    atomic_fetch_add(&sched->sleepers, 1);
+    while (atomic_load(&sched->queued) == 0 && !sched->done) {
+        if (pthread_cond_timedwait(&sched->idle, &sched->idle_lock, &deadline) != 0) {
+            break;
+        }
+    }
+    atomic_fetch_sub(&sched->sleepers, 1);
+    bool done = sched->done;
+    pthread_mutex_unlock(&sched->idle_lock);
+
+    return !done;
+}
+
+
+static void *sched_worker(void *context) {
+    struct worker *worker = context;
+    struct lc3_sched *sched = worker->sched;
+
+    for (;;) {
+        struct lc3_vm *vm = sched_pop(sched, worker);
+
+        if (!vm) {
+            vm = sched_steal(sched, worker);
+        }
+
+        if (!vm) {
+            sched_wake_interrupted(sched);
+
+            if (!sched_idle(sched)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        atomic_store(&vm->sched_state, VM_RUNNING);
+        vm->sched_worker = worker->index;
+
+        uint64_t start = monotonic_ns();
+        int reason = lc3_run(vm, sched->slice);
+        uint64_t elapsed = monotonic_ns() - start;
+
+        ++worker->slices;
+        ++worker->histogram[histogram_bucket(elapsed)];
+        if (elapsed > worker->max_slice_ns) {
+            worker->max_slice_ns = elapsed;
+        }
+
+        // an illegal instruction would stop the VM at every slice
+        if (reason == LC3_HALTED || reason == LC3_ILLEGAL
+            || atomic_load(&vm->keyboard.interrupted)) {
+            atomic_store(&vm->sched_state, VM_DONE);
+
+            if (atomic_fetch_add(&sched->finished, 1) + 1 == sched->vm_count) {
+                pthread_mutex_lock(&sched->idle_lock);
+                sched->done = true;
+                pthread_cond_broadcast(&sched->idle);
+                pthread_mutex_unlock(&sched->idle_lock);
+            }
+        }
+        else if (reason == LC3_INPUT) {
+            ++worker->parks;
+            atomic_store(&vm->sched_state, VM_PARKED);
+
+            // input that came in before the store has nobody to wake it
+            int parked = VM_PARKED;
+            if (keyboard_ready(vm)
+                && atomic_compare_exchange_strong(&vm->sched_state, &parked, VM_QUEUED)) {
+                sched_push(sched, worker, vm);
+            }
+        }
+        else {
+            // budget used up, or a trap without a handler, which does nothing
+            atomic_store(&vm->sched_state, VM_QUEUED);
+            sched_push(sched, worker, vm);
+        }
+    }
+}
+
+
+void lc3_sched_run(struct lc3_sched *sched) {
+    if (sched->vm_count == 0) {
+        return;
+    }
+
+    uint64_t retired = 0;
+
+    for (size_t i = 0; i < sched->vm_count; ++i) {
+        retired -= sched->vms[i]->instructions;
+    }
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        struct worker *worker = &sched->workers[i];
+
+        free(worker->deque);
+        worker->deque = malloc(sched->vm_count * sizeof(struct lc3_vm *));
+        worker->head  = 0;
+        worker->count = 0;
+
+        if (!worker->deque) {
+            fprintf(stderr, "memória insuficiente para o escalonador\n");
+            exit(1);
+        }
+    }
+
+    sched->done = false;
+    atomic_store(&sched->finished, 0);
+
+    for (size_t i = 0; i < sched->vm_count; ++i) {
+        struct lc3_vm *vm = sched->vms[i];
+
+        vm->sched = sched;
+
+        if (vm->halted) {
+            atomic_store(&vm->sched_state, VM_DONE);
+            atomic_fetch_add(&sched->finished, 1);
+        }
+        else {
+            atomic_store(&vm->sched_state, VM_QUEUED);
+            sched_push(sched, &sched->workers[vm->sched_worker], vm);
+        }
+    }
+
+    if (atomic_load(&sched->finished) == sched->vm_count) {
+        return;
+    }
+
+    uint64_t start = monotonic_ns();
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        pthread_create(&sched->workers[i].thread, NULL, sched_worker, &sched->workers[i]);
+    }
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+
+    sched->elapsed_ns += monotonic_ns() - start;
+
+    for (size_t i = 0; i < sched->vm_count; ++i) {
+        retired += sched->vms[i]->instructions;
+    }
+
+    sched->instructions += retired;
+}
+
+
+void lc3_sched_report(const struct lc3_sched *sched) {
+    uint64_t histogram[HISTOGRAM_BUCKETS] = {0};
+    uint64_t slices = 0, steals = 0, parks = 0, max = 0;
+
+    for (int i = 0; i < sched->worker_count; ++i) {
+        const struct worker *worker = &sched->workers[i];
+
+        for (unsigned b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            histogram[b] += worker->histogram[b];
+        }
+        slices += worker->slices;
+        steals += worker->steals;
+        parks  += worker->parks;
+        if (worker->max_slice_ns > max) {
+            max = worker->max_slice_ns;
+        }
+    }
+
+    uint64_t percentiles[HISTOGRAM_PERCENTILES];
+
+    histogram_percentiles(histogram, slices, percentiles);
+
+    fprintf(stderr,
+            "{\"vms\":%zu,\"workers\":%d,\"slice\":%llu,\"instructions\":%llu,"
+            "\"seconds\":%.6f,\"instructions_per_second\":%.0f,"
+            "\"slices\":%llu,\"steals\":%llu,\"parks\":%llu,\"slice_ns\":{",
+            sched->vm_count, sched->worker_count,
+            (unsigned long long) sched->slice,
+            (unsigned long long) sched->instructions,
+            sched->elapsed_ns / 1e9,
+            sched->elapsed_ns ? sched->instructions * 1e9 / sched->elapsed_ns : 0,
+            (unsigned long long) slices,
+            (unsigned long long) steals,
+            (unsigned long long) parks);
+
+    for (unsigned i = 0; i < HISTOGRAM_PERCENTILES; ++i) {
+        fprintf(stderr, "\"%s\":%llu,", histogram_names[i], (unsigned long long) percentiles[i]);
+    }
+
+    fprintf(stderr, "\"max\":%llu}}\n", (unsigned long long) max);
+}
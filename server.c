@@ -0,0 +1,496 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lc3.h"
+
+
+/*
+ * VM server
+ *
+ * Every image is loaded once, into a snapshot whose pages and decoded code
+ * all of its VMs share, and `pool` VMs per image are restored from it up
+ * front. A session takes a ready VM, so spawning one costs a list pop and
+ * pointing its output at the socket; the VM is put back in the snapshot's
+ * state, which puts back only the pages it wrote, after the session, off the
+ * next client's path. With the pool empty a VM is cloned from the snapshot
+ * instead, and counted as a cold spawn.
+ *
+ * Each session has a thread that runs its VM SERVER_SLICE instructions at a
+ * time with nonblocking input, reading the socket only when the VM would
+ * wait for a key, so one thread does both and nothing sleeps in the core.
+*/
+#define SERVER_SLICE   1000000
+#define SERVER_POLL_MS 100      // how long a waiting session goes without checking for shutdown
+#define SERVER_REQUEST 256      // longest request line
+
+struct server_image {
+    const char          *path;
+    const char          *name;      // the path without its directories
+    struct lc3_snapshot *snapshot;  // as loaded; every VM of the image starts here
+    struct lc3_vm      **ready;
+    size_t               ready_count;
+};
+
+struct lc3_server {
+    int                   listener;
+    char                  path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    const struct lc3_vm  *model;
+    struct server_image  *images;
+    size_t                image_count;
+    size_t                pool;
+    atomic_bool           stopping;
+
+    pthread_mutex_t lock;           // everything below, and the ready lists
+    pthread_cond_t  idle;           // the last session ended
+    size_t          sessions_running;
+    uint64_t        sessions;
+    uint64_t        cold_spawns;
+    uint64_t        max_spawn_ns;
+    uint64_t        histogram[HISTOGRAM_BUCKETS];   // spawn latency
+};
+
+struct session {
+    struct lc3_server *server;
+    int                fd;
+};
+
+
+// The options and trap handlers of the model, which lc3_clone() leaves at
+// their defaults, and line-buffered output, set up once so a session only
+// points it at its socket.
+static void configure(struct lc3_vm *vm, const struct lc3_vm *model) {
+    vm->decode_cache_enabled = model->decode_cache_enabled;
+    vm->fusion_enabled       = model->fusion_enabled;
+    vm->core                 = model->core;
+    vm->trap_memory_vectors  = model->trap_memory_vectors;
+    vm->nonblocking_input    = true;
+
+    lc3_configure_output(vm, OUTPUT_BUFFER, OUTPUT_LINE);
+
+    for (int vector = 0; vector < 256; ++vector) {
+        lc3_set_trap(vm, vector, model->traps[vector].handler, model->traps[vector].context);
+    }
+}
+
+
+static struct lc3_vm *spawn(struct server_image *image, const struct lc3_vm *model) {
+    struct lc3_vm *vm = lc3_clone(image->snapshot);
+
+    if (vm) {
+        configure(vm, model);
+    }
+
+    return vm;
+}
+
+
+static bool load_image(struct server_image *image, const struct lc3_vm *model, size_t pool) {
+    struct lc3_vm *vm = lc3_create();
+    const char *slash = strrchr(image->path, '/');
+
+    image->name  = slash ? slash + 1 : image->path;
+    image->ready = calloc(pool, sizeof(*image->ready));
+
+    if (!vm || !image->ready) {
+        lc3_destroy(vm);
+        return false;
+    }
+
+    // the snapshot decodes with the model's fusion setting
+    configure(vm, model);
+
+    if (!lc3_load(vm, image->path) || !(image->snapshot = lc3_snapshot(vm))) {
+        lc3_destroy(vm);
+        return false;
+    }
+
+    image->ready[image->ready_count++] = vm;
+
+    while (image->ready_count < pool) {
+        if (!(vm = spawn(image, model))) {
+            return false;
+        }
+        image->ready[image->ready_count++] = vm;
+    }
+
+    return true;
+}
+
+
+static struct server_image *find_image(struct lc3_server *server, const char *name) {
+    for (size_t i = 0; i < server->image_count; ++i) {
+        struct server_image *image = &server->images[i];
+
+        if (strcmp(name, image->path) == 0 || strcmp(name, image->name) == 0) {
+            return image;
+        }
+    }
+
+    // an empty request asks for the first image
+    return *name ? NULL : &server->images[0];
+}
+
+
+static struct lc3_vm *take_vm(struct lc3_server *server, struct server_image *image) {
+    struct lc3_vm *vm = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    if (image->ready_count > 0) {
+        vm = image->ready[--image->ready_count];
+    }
+    else {
+        ++server->cold_spawns;
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return vm ? vm : spawn(image, server->model);
+}
+
+
+static void give_back(struct lc3_server *server, struct server_image *image, struct lc3_vm *vm) {
+    bool kept = false;
+
+    lc3_reset_input(vm);
+    vm->instructions = 0;
+
+    if (lc3_restore(vm, image->snapshot)) {
+        pthread_mutex_lock(&server->lock);
+        if (image->ready_count < server->pool) {
+            image->ready[image->ready_count++] = vm;
+            kept = true;
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    if (!kept) {
+        lc3_destroy(vm);
+    }
+}
+
+
+static void count_spawn(struct lc3_server *server, uint64_t ns) {
+    pthread_mutex_lock(&server->lock);
+    ++server->sessions;
+    ++server->histogram[histogram_bucket(ns)];
+    if (ns > server->max_spawn_ns) {
+        server->max_spawn_ns = ns;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+
+// Wait for the socket to have data, or for the server to stop. Returns
+// what read() did, 0 at the end of input and on shutdown.
+static ssize_t session_read(struct lc3_server *server, int fd, uint8_t *buffer, size_t size) {
+    struct pollfd poller = { .fd = fd, .events = POLLIN };
+
+    while (!atomic_load(&server->stopping)) {
+        int ready = poll(&poller, 1, SERVER_POLL_MS);
+
+        if (ready > 0) {
+            ssize_t count = read(fd, buffer, size);
+            return count < 0 ? 0 : count;
+        }
+
+        if (ready < 0 && errno != EINTR) {
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+
+static bool hung_up(int fd) {
+    struct pollfd poller = { .fd = fd, .events = 0 };
+
+    return poll(&poller, 1, 0) > 0 && (poller.revents & (POLLHUP | POLLERR));
+}
+
+
+// The console loop: keys come from the socket only when the VM would wait
+// for one, and whatever the ring can't take yet stays in `pending`.
+static void session_run(struct lc3_server *server, struct lc3_vm *vm, int fd,
+                        uint8_t *pending, size_t start, size_t end) {
+    bool closed = false;
+
+    while (!atomic_load(&server->stopping)) {
+        start += lc3_push_input(vm, pending + start, end - start);
+
+        int reason = lc3_run(vm, SERVER_SLICE);
+
+        if (reason == LC3_HALTED || reason == LC3_ILLEGAL) {
+            return;
+        }
+
+        // past the end of its input a program may never halt; the session
+        // lasts as long as the client is there to read the output
+        if (closed && hung_up(fd)) {
+            return;
+        }
+
+        if (reason != LC3_INPUT || start < end) {
+            continue;
+        }
+
+        lc3_flush_output(vm);
+
+        if (closed) {
+            continue;
+        }
+
+        start = 0;
+        end   = session_read(server, fd, pending, SERVER_REQUEST);
+
+        if (end == 0) {
+            lc3_close_input(vm);
+            closed = true;
+        }
+    }
+}
+
+
+// Hand a VM of the image named by the string at `input` to the client on
+// `fd` and run it; input[start, end) came in after the request line.
+static void serve_session(struct lc3_server *server, int fd, uint8_t *input, size_t start, size_t end) {
+    uint64_t spawn_start = monotonic_ns();
+    struct server_image *image = find_image(server, (char *) input);
+    struct lc3_vm *vm = image ? take_vm(server, image) : NULL;
+
+    if (!vm) {
+        dprintf(fd, image ? "memória insuficiente\n" : "imagem desconhecida: %s\n", (char *) input);
+        close(fd);
+        return;
+    }
+
+    lc3_set_output_fd(vm, fd);
+    count_spawn(server, monotonic_ns() - spawn_start);
+
+    session_run(server, vm, fd, input, start, end);
+
+    lc3_flush_output(vm);
+    close(fd);
+    give_back(server, image, vm);
+}
+
+
+// The request is a line naming the image, or "stats"; what follows it is
+// the first of the session's input.
+static void *session_thread(void *context) {
+    struct session *session = context;
+    struct lc3_server *server = session->server;
+    uint8_t buffer[SERVER_REQUEST];
+    size_t used = 0;
+    uint8_t *newline = NULL;
+
+    while (!newline && used < sizeof(buffer)) {
+        ssize_t count = session_read(server, session->fd, buffer + used, sizeof(buffer) - used);
+
+        if (count == 0) {
+            break;
+        }
+
+        newline = memchr(buffer + used, '\n', count);
+        used += count;
+    }
+
+    if (newline) {
+        *newline = '\0';
+
+        if (newline > buffer && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+    }
+
+    if (!newline) {
+        close(session->fd);
+    }
+    else if (strcmp((char *) buffer, "stats") == 0) {
+        FILE *out = fdopen(session->fd, "w");
+
+        if (out) {
+            lc3_server_report(server, out);
+            fclose(out);
+        }
+        else {
+            close(session->fd);
+        }
+    }
+    else {
+        serve_session(server, session->fd, buffer, newline + 1 - buffer, used);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    if (--server->sessions_running == 0) {
+        pthread_cond_broadcast(&server->idle);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    free(session);
+
+    return NULL;
+}
+
+
+struct lc3_server *lc3_server_create(const char *path, const struct lc3_vm *model,
+                                     const char *const *images, size_t count, size_t pool) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct lc3_server *server = calloc(1, sizeof(*server));
+
+    if (!server || count == 0 || strlen(path) >= sizeof(address.sun_path)) {
+        free(server);
+        return NULL;
+    }
+
+    server->listener    = -1;
+    server->model       = model;
+    server->pool        = pool > 0 ? pool : 1;
+    server->images      = calloc(count, sizeof(*server->images));
+    server->image_count = count;
+    strcpy(server->path, path);
+    strcpy(address.sun_path, path);
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->idle, NULL);
+
+    bool ok = server->images != NULL;
+
+    for (size_t i = 0; ok && i < count; ++i) {
+        server->images[i].path = images[i];
+        ok = load_image(&server->images[i], model, server->pool);
+    }
+
+    // a socket left by an earlier server is replaced
+    if (ok) {
+        unlink(path);
+        server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        ok = server->listener >= 0
+             && bind(server->listener, (struct sockaddr *) &address, sizeof(address)) == 0
+             && listen(server->listener, SOMAXCONN) == 0;
+    }
+
+    if (!ok) {
+        lc3_server_destroy(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+
+void lc3_server_run(struct lc3_server *server) {
+    while (!atomic_load(&server->stopping)) {
+        int fd = accept(server->listener, NULL, NULL);
+
+        if (fd < 0) {
+            continue;
+        }
+
+        struct session *session = malloc(sizeof(*session));
+        pthread_attr_t attributes;
+        pthread_t thread;
+
+        if (!session) {
+            close(fd);
+            continue;
+        }
+
+        session->server = server;
+        session->fd     = fd;
+
+        pthread_mutex_lock(&server->lock);
+        ++server->sessions_running;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+        if (pthread_create(&thread, &attributes, session_thread, session) != 0) {
+            pthread_mutex_lock(&server->lock);
+            --server->sessions_running;
+            pthread_mutex_unlock(&server->lock);
+            close(fd);
+            free(session);
+        }
+
+        pthread_attr_destroy(&attributes);
+    }
+}
+
+
+void lc3_server_stop(struct lc3_server *server) {
+    atomic_store(&server->stopping, true);
+    shutdown(server->listener, SHUT_RDWR);
+}
+
+
+void lc3_server_destroy(struct lc3_server *server) {
+    if (!server) {
+        return;
+    }
+
+    atomic_store(&server->stopping, true);
+
+    // running sessions see the flag within a slice or a poll
+    pthread_mutex_lock(&server->lock);
+    while (server->sessions_running > 0) {
+        pthread_cond_wait(&server->idle, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (server->listener >= 0) {
+        close(server->listener);
+        unlink(server->path);
+    }
+
+    for (size_t i = 0; server->images && i < server->image_count; ++i) {
+        struct server_image *image = &server->images[i];
+
+        for (size_t n = 0; n < image->ready_count; ++n) {
+            lc3_destroy(image->ready[n]);
+        }
+        free(image->ready);
+        lc3_snapshot_release(image->snapshot);
+    }
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->idle);
+    free(server->images);
+    free(server);
+}
+
+
+void lc3_server_report(struct lc3_server *server, FILE *out) {
+    uint64_t percentiles[HISTOGRAM_PERCENTILES];
+
+    pthread_mutex_lock(&server->lock);
+
+    histogram_percentiles(server->histogram, server->sessions, percentiles);
+
+    fprintf(out, "{\"images\":%zu,\"pool\":%zu,\"sessions\":%llu,\"running\":%zu,"
+            "\"cold_spawns\":%llu,\"ready\":[",
+            server->image_count, server->pool, (unsigned long long) server->sessions,
+            server->sessions_running, (unsigned long long) server->cold_spawns);
+
+    for (size_t i = 0; i < server->image_count; ++i) {
+        fprintf(out, "%s%zu", i ? "," : "", server->images[i].ready_count);
+    }
+
+    fprintf(out, "],\"spawn_ns\":{");
+
+    for (unsigned i = 0; i < HISTOGRAM_PERCENTILES; ++i) {
+        fprintf(out, "\"%s\":%llu,", histogram_names[i], (unsigned long long) percentiles[i]);
+    }
+
+    fprintf(out, "\"max\":%llu}}\n", (unsigned long long) server->max_spawn_ns);
+
+    pthread_mutex_unlock(&server->lock);
+}
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "lc3.h"
+
+
+/*
+ * Snapshots
+ *
+ * The memfd holds MEMORY_MAX words in host order and is never written after
+ * the snapshot is taken. VMs map it MAP_PRIVATE, so the kernel copies a
+ * page only when the VM first writes to it, and mem_write marks that page
+ * in dirty_pages. Restoring a VM's own snapshot maps just those pages
+ * again, dropping the private copies, or, with no more than
+ * RESTORE_COPY_PAGES of them, copies the words back: a remap costs a call
+ * and a fault per page, many times a 4 KiB copy.
+ *
+ * Alongside it sits a second memfd with the decode cache of the snapshot's
+ * non-zero pages, mapped over a VM's cache the same way, so VMs started
+ * from one image share its decoded code too and own only the cache pages
+ * they write. There is one with and one without superinstructions, each
+ * filled the first time a VM with that setting restores or takes the
+ * snapshot, so a snapshot read from a file serves either. Its entries hold
+ * handler addresses, so it never leaves the process; a VM without the
+ * decode cache decodes nothing from it.
+ *
+ * Files are "LC3S", then a header of big-endian words and the pages listed
+ * in its bitmap, big-endian like .obj images. All-zero pages are left out.
+*/
+#define SNAPSHOT_MAGIC   "LC3S"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTES   (MEMORY_MAX * sizeof(uint16_t))
+#define PAGE_BYTES       (PAGE_WORDS * sizeof(uint16_t))
+#define DECODED_BYTES    (MEMORY_MAX * sizeof(struct decoded))
+#define DECODED_PAGE     (PAGE_WORDS * sizeof(struct decoded))
+#define RESTORE_COPY_PAGES 4    // dirty pages a restore copies back instead of remapping
+
+struct lc3_snapshot {
+    atomic_int refs;
+    int        fd;
+    uint16_t  *data;        // read-only view of the memfd
+    uint32_t   pages;       // bit per non-zero page
+
+    pthread_mutex_t decode_lock;
+    int             decoded_fd[2];      // shared decode cache by fusion setting, -1 without one
+    bool            decode_tried[2];    // whether decoded_fd has been filled, or failed to be
+
+    uint16_t registers[R_COUNT];
+    uint32_t flags_result;
+    bool     halted;
+};
+
+// header words after the magic
+enum {
+    HEADER_VERSION = 0,
+    HEADER_REGISTERS,
+    HEADER_FLAGS_HIGH = HEADER_REGISTERS + R_COUNT,
+    HEADER_FLAGS_LOW,
+    HEADER_PAGES_HIGH,
+    HEADER_PAGES_LOW,
+    HEADER_HALTED,
+    HEADER_WORDS
+};
+
+
+// Decode the snapshot's code once for every VM that maps it. Returns the
+// memfd, or -1 if this fails and VMs do without a shared cache.
+static int snapshot_predecode(const struct lc3_snapshot *snapshot, bool fusion) {
+    int fd = memfd_create("lc3-decoded", MFD_CLOEXEC);
+    void *cache = MAP_FAILED;
+
+    if (fd >= 0 && ftruncate(fd, DECODED_BYTES) == 0) {
+        cache = mmap(NULL, DECODED_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (cache == MAP_FAILED) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    predecode(cache, snapshot->data, snapshot->pages, fusion);
+    munmap(cache, DECODED_BYTES);
+
+    return fd;
+}
+
+
+// The shared decode cache for `fusion`, decoded by the first VM that asks.
+static int snapshot_decoded(struct lc3_snapshot *snapshot, bool fusion) {
+    pthread_mutex_lock(&snapshot->decode_lock);
+
+    if (!snapshot->decode_tried[fusion]) {
+        snapshot->decoded_fd[fusion]   = snapshot_predecode(snapshot, fusion);
+        snapshot->decode_tried[fusion] = true;
+    }
+
+    int fd = snapshot->decoded_fd[fusion];
+
+    pthread_mutex_unlock(&snapshot->decode_lock);
+
+    return fd;
+}
+
+
+static struct lc3_snapshot *snapshot_create(const uint16_t *memory) {
+    struct lc3_snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    uint32_t pages = 0;
+
+    if (!snapshot) {
+        return NULL;
+    }
+
+    snapshot->fd            = memfd_create("lc3-snapshot", MFD_CLOEXEC);
+    snapshot->data          = MAP_FAILED;
+    snapshot->decoded_fd[0] = -1;
+    snapshot->decoded_fd[1] = -1;
+
+    if (snapshot->fd < 0 || ftruncate(snapshot->fd, SNAPSHOT_BYTES) != 0) {
+        goto fail;
+    }
+
+    // a fresh memfd reads as zeros, so only non-zero pages are written
+    for (size_t page = 0; memory && page < PAGE_COUNT; ++page) {
+        const uint16_t *words = memory + page * PAGE_WORDS;
+        size_t i = 0;
+
+        while (i < PAGE_WORDS && words[i] == 0) {
+            ++i;
+        }
+
+        if (i == PAGE_WORDS) {
+            continue;
+        }
+
+        if (pwrite(snapshot->fd, words, PAGE_BYTES, page * PAGE_BYTES) != (ssize_t) PAGE_BYTES) {
+            goto fail;
+        }
+
+        pages |= 1u << page;
+    }
+
+    snapshot->data = mmap(NULL, SNAPSHOT_BYTES, PROT_READ, MAP_SHARED, snapshot->fd, 0);
+
+    if (snapshot->data == MAP_FAILED) {
+        goto fail;
+    }
+
+    snapshot->pages = pages;
+    pthread_mutex_init(&snapshot->decode_lock, NULL);
+    atomic_init(&snapshot->refs, 1);
+
+    return snapshot;
+
+fail:
+    if (snapshot->fd >= 0) {
+        close(snapshot->fd);
+    }
+    free(snapshot);
+    return NULL;
+}
+
+
+void lc3_snapshot_release(struct lc3_snapshot *snapshot) {
+    if (!snapshot || atomic_fetch_sub(&snapshot->refs, 1) != 1) {
+        return;
+    }
+
+    munmap(snapshot->data, SNAPSHOT_BYTES);
+    close(snapshot->fd);
+
+    for (int fusion = 0; fusion < 2; ++fusion) {
+        if (snapshot->decoded_fd[fusion] >= 0) {
+            close(snapshot->decoded_fd[fusion]);
+        }
+    }
+
+    pthread_mutex_destroy(&snapshot->decode_lock);
+    free(snapshot);
+}
+
+
+// Map `pages` of the snapshot over the VM's memory, copying when the host
+// page size doesn't allow mapping 4 KiB at a time.
+static bool snapshot_map(struct lc3_vm *vm, const struct lc3_snapshot *snapshot, uint32_t pages) {
+    long host_page = sysconf(_SC_PAGESIZE);
+
+    if (pages == UINT32_MAX && host_page <= (long) SNAPSHOT_BYTES) {
+        return mmap(vm->memory, SNAPSHOT_BYTES, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, snapshot->fd, 0) != MAP_FAILED;
+    }
+
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        if (!(pages & (1u << page))) {
+            continue;
+        }
+
+        size_t offset = page * PAGE_BYTES;
+
+        if (host_page != PAGE_BYTES
+            || mmap((uint8_t *) vm->memory + offset, PAGE_BYTES, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, snapshot->fd, offset) == MAP_FAILED) {
+            memcpy((uint8_t *) vm->memory + offset, (const uint8_t *) snapshot->data + offset, PAGE_BYTES);
+        }
+    }
+
+    return true;
+}
+
+
+// Copy `pages` of the snapshot back over the VM's own private copies.
+static void snapshot_copy(struct lc3_vm *vm, const struct lc3_snapshot *snapshot, uint32_t pages) {
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        if (pages & (1u << page)) {
+            size_t offset = page * PAGE_BYTES;
+            memcpy((uint8_t *) vm->memory + offset, (const uint8_t *) snapshot->data + offset, PAGE_BYTES);
+        }
+    }
+}
+
+
+// The shared decode cache matching the VM's options, or -1 if it has none.
+static int shared_decoded(const struct lc3_vm *vm, struct lc3_snapshot *snapshot) {
+    if (!vm->decode_cache_enabled || DECODED_PAGE % sysconf(_SC_PAGESIZE) != 0) {
+        return -1;
+    }
+
+    return snapshot_decoded(snapshot, vm->fusion_enabled);
+}
+
+
+// Map `count` pages of the shared decode cache `fd` over the VM's, from `page` on.
+static bool decoded_map(struct lc3_vm *vm, int fd, uint32_t page, uint32_t count) {
+    return mmap((uint8_t *) vm->decode_cache + page * DECODED_PAGE, count * DECODED_PAGE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, page * DECODED_PAGE) != MAP_FAILED;
+}
+
+
+int lc3_restore(struct lc3_vm *vm, struct lc3_snapshot *snapshot) {
+    uint32_t pages = vm->snapshot == snapshot ? vm->dirty_pages : UINT32_MAX;
+    bool copy = vm->snapshot == snapshot && __builtin_popcount(pages) <= RESTORE_COPY_PAGES;
+
+    // copied pages keep their private decode cache too, which is cleared
+    int shared = copy ? -1 : shared_decoded(vm, snapshot);
+
+    if (copy) {
+        snapshot_copy(vm, snapshot, pages);
+    }
+    else if (!snapshot_map(vm, snapshot, pages)) {
+        return 0;
+    }
+
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        // code on device pages is never cached, so there is nothing to drop
+        if (pages & ~vm->device_pages & (1u << page)) {
+            forget_decoded(vm, page * PAGE_WORDS);  // a group ending the page before
+
+            if (shared < 0 || !decoded_map(vm, shared, page, 1)) {
+                memset(vm->decode_cache + page * PAGE_WORDS, 0, DECODED_PAGE);
+            }
+        }
+    }
+
+    if (pages && vm->jit) {
+        jit_flush(vm);
+    }
+
+    if (pages) {
+        blocks_flush(vm);
+    }
+
+    if (vm->snapshot != snapshot) {
+        atomic_fetch_add(&snapshot->refs, 1);
+        lc3_snapshot_release(vm->snapshot);
+        vm->snapshot = snapshot;
+    }
+
+    memcpy(vm->registers, snapshot->registers, sizeof(vm->registers));
+    vm->flags_result = snapshot->flags_result;
+    vm->halted       = snapshot->halted;
+    vm->running      = false;
+    vm->dirty_pages  = 0;
+    vm->idle_polls   = 0;
+
+    return 1;
+}
+
+
+struct lc3_snapshot *lc3_snapshot(struct lc3_vm *vm) {
+    struct lc3_snapshot *snapshot = snapshot_create(vm->memory);
+
+    if (!snapshot) {
+        return NULL;
+    }
+
+    memcpy(snapshot->registers, vm->registers, sizeof(snapshot->registers));
+    snapshot->flags_result = vm->flags_result;
+    snapshot->halted       = vm->halted;
+
+    // the VM gives up its anonymous pages for the shared ones; the words
+    // are the same, so nothing decoded goes stale
+    if (mmap(vm->memory, SNAPSHOT_BYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, snapshot->fd, 0) != MAP_FAILED) {
+        atomic_fetch_add(&snapshot->refs, 1);
+        lc3_snapshot_release(vm->snapshot);
+        vm->snapshot    = snapshot;
+        vm->dirty_pages = 0;
+
+        // likewise for the decoded code; if that fails the private cache
+        // is just as good
+        int shared = shared_decoded(vm, snapshot);
+
+        for (uint32_t page = 0; shared >= 0 && page < PAGE_COUNT; ++page) {
+            if (!(vm->device_pages & (1u << page))) {
+                decoded_map(vm, shared, page, 1);
+            }
+        }
+    }
+
+    return snapshot;
+}
+
+
+struct lc3_vm *lc3_clone(struct lc3_snapshot *snapshot) {
+    struct lc3_vm *vm = lc3_create();
+
+    if (vm && !lc3_restore(vm, snapshot)) {
+        lc3_destroy(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+
+// The "LC3S" form of a state, from the current position of `file`.
+static bool write_state(FILE *file, const uint16_t *memory, const uint16_t *registers,
+                        uint32_t flags_result, bool halted) {
+    uint16_t page_buffer[PAGE_WORDS];
+    uint16_t header[HEADER_WORDS] = {0};
+    uint32_t pages = 0;
+
+    for (uint32_t page = 0; page < PAGE_COUNT; ++page) {
+        const uint16_t *words = memory + page * PAGE_WORDS;
+
+        for (size_t i = 0; i < PAGE_WORDS; ++i) {
+            if (words[i]) {
+                pages |= 1u << page;
+                break;
+            }
+        }
+    }
+
+    header[HEADER_VERSION] = SNAPSHOT_VERSION;
+    memcpy(header + HEADER_REGISTERS, registers, R_COUNT * sizeof(uint16_t));
+    header[HEADER_FLAGS_HIGH] = flags_result >> 16;
+    header[HEADER_FLAGS_LOW]  = flags_result & 0xFFFF;
+    header[HEADER_PAGES_HIGH] = pages >> 16;
+    header[HEADER_PAGES_LOW]  = pages & 0xFFFF;
+    header[HEADER_HALTED]     = halted;
+    swap16_block(header, header, HEADER_WORDS);
+
+    bool ok = fwrite(SNAPSHOT_MAGIC, 1, 4, file) == 4
+              && fwrite(header, sizeof(header), 1, file) == 1;
+
+    for (uint32_t page = 0; ok && page < PAGE_COUNT; ++page) {
+        if (pages & (1u << page)) {
+            swap16_block(page_buffer, memory + page * PAGE_WORDS, PAGE_WORDS);
+            ok = fwrite(page_buffer, PAGE_BYTES, 1, file) == 1;
+        }
+    }
+
+    return ok;
+}
+
+
+bool snapshot_write_vm(const struct lc3_vm *vm, FILE *file) {
+    return write_state(file, vm->memory, vm->registers, vm->flags_result, vm->halted);
+}
+
+
+struct lc3_snapshot *snapshot_read(FILE *file) {
+    char magic[4];
+    uint16_t header[HEADER_WORDS];
+
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0
+        || fread(header, sizeof(header), 1, file) != 1) {
+        return NULL;
+    }
+
+    swap16_block(header, header, HEADER_WORDS);
+
+    if (header[HEADER_VERSION] != SNAPSHOT_VERSION) {
+        return NULL;
+    }
+
+    uint16_t *memory = calloc(MEMORY_MAX, sizeof(uint16_t));
+    uint32_t pages = (uint32_t) header[HEADER_PAGES_HIGH] << 16 | header[HEADER_PAGES_LOW];
+    bool ok = memory != NULL;
+
+    for (uint32_t page = 0; ok && page < PAGE_COUNT; ++page) {
+        if (pages & (1u << page)) {
+            uint16_t *words = memory + page * PAGE_WORDS;
+            ok = fread(words, PAGE_BYTES, 1, file) == 1;
+            swap16_block(words, words, PAGE_WORDS);
+        }
+    }
+
+    struct lc3_snapshot *snapshot = ok ? snapshot_create(memory) : NULL;
+    free(memory);
+
+    if (snapshot) {
+        memcpy(snapshot->registers, header + HEADER_REGISTERS, sizeof(snapshot->registers));
+        snapshot->flags_result = (uint32_t) header[HEADER_FLAGS_HIGH] << 16 | header[HEADER_FLAGS_LOW];
+        snapshot->halted       = header[HEADER_HALTED];
+    }
+
+    return snapshot;
+}
+
+
+int lc3_snapshot_save(const struct lc3_snapshot *snapshot, const char *path) {
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        return 0;
+    }
+
+    bool ok = write_state(file, snapshot->data, snapshot->registers,
+                          snapshot->flags_result, snapshot->halted);
+
+    return fclose(file) == 0 && ok;
+}
+
+
+struct lc3_snapshot *lc3_snapshot_open(const char *path) {
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        return NULL;
+    }
+
+    struct lc3_snapshot *snapshot = snapshot_read(file);
+    fclose(file);
+
+    return snapshot;
+}
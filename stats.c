@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "lc3.h"
+
+
+/*
+ * Host performance counters
+ *
+ * One perf_event group per VM: cycles leads, retired host instructions and
+ * branch misses follow, all user-space only. The group is opened on the
+ * first lc3_run() with perf_counters set and counts the thread that opened
+ * it, so runs from any other thread (another scheduler worker) are left
+ * out rather than mixed in.
+*/
+#if defined(__linux__)
+
+enum {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_COUNT
+};
+
+static const uint64_t perf_configs[PERF_COUNT] = {
+    [PERF_CYCLES]        = PERF_COUNT_HW_CPU_CYCLES,
+    [PERF_INSTRUCTIONS]  = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+
+static int perf_open(uint64_t config, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = config;
+    attr.disabled       = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+
+void perf_start(struct lc3_vm *vm) {
+    if (!vm->perf_counters) {
+        return;
+    }
+
+    // asked once: if the kernel says no, the fds stay -1
+    if (!vm->perf_opened) {
+        vm->perf_opened = true;
+        vm->perf_thread = gettid();
+
+        for (int i = 0; i < PERF_COUNT; ++i) {
+            vm->perf_fds[i] = -1;
+        }
+
+        for (int i = 0; i < PERF_COUNT; ++i) {
+            vm->perf_fds[i] = perf_open(perf_configs[i], i == 0 ? -1 : vm->perf_fds[0]);
+
+            if (vm->perf_fds[i] < 0) {
+                perf_close(vm);
+                break;
+            }
+        }
+    }
+
+    if (vm->perf_fds[0] >= 0 && vm->perf_thread == gettid()) {
+        ioctl(vm->perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+
+void perf_stop(struct lc3_vm *vm) {
+    if (vm->perf_opened && vm->perf_fds[0] >= 0 && vm->perf_thread == gettid()) {
+        ioctl(vm->perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+
+void perf_close(struct lc3_vm *vm) {
+    for (int i = 0; vm->perf_opened && i < PERF_COUNT; ++i) {
+        if (vm->perf_fds[i] >= 0) {
+            close(vm->perf_fds[i]);
+        }
+        vm->perf_fds[i] = -1;
+    }
+}
+
+
+static bool perf_read(const struct lc3_vm *vm, struct lc3_stats *stats) {
+    uint64_t values[1 + PERF_COUNT]; // the group format leads with the count
+
+    if (!vm->perf_opened || vm->perf_fds[0] < 0
+        || read(vm->perf_fds[0], values, sizeof(values)) != sizeof(values)) {
+        return false;
+    }
+
+    stats->cycles            = values[1 + PERF_CYCLES];
+    stats->host_instructions = values[1 + PERF_INSTRUCTIONS];
+    stats->branch_misses     = values[1 + PERF_BRANCH_MISSES];
+
+    return true;
+}
+
+#else
+
+void perf_start(struct lc3_vm *vm) {
+}
+
+
+void perf_stop(struct lc3_vm *vm) {
+}
+
+
+void perf_close(struct lc3_vm *vm) {
+}
+
+
+static bool perf_read(const struct lc3_vm *vm, struct lc3_stats *stats) {
+    return false;
+}
+
+#endif
+
+
+/*
+ * Statistics
+*/
+
+void lc3_get_stats(const struct lc3_vm *vm, struct lc3_stats *stats) {
+    *stats = vm->stats;
+    stats->instructions = vm->instructions;
+    stats->trap_ns      = 0;
+
+    for (int vector = 0; vector < 256; ++vector) {
+        stats->trap_ns += vm->traps[vector].ns;
+    }
+
+    stats->perf_valid = perf_read(vm, stats);
+}
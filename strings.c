@@ -0,0 +1,288 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lc3.h"
+
+
+/*
+ * Guest string kernels
+ *
+ * What PUTS, PUTSP and the extension traps do to runs of memory words:
+ * find the terminating zero, take the low byte of each word, or take both
+ * bytes of each word with zero high bytes dropped. As with the byte swap,
+ * the kernels are picked once at run time from what the CPU supports, and
+ * none of them reads past the count it is given, so callers bound them by
+ * the end of memory.
+*/
+struct string_kernels {
+    size_t (*length)(const uint16_t *words, size_t max);
+    void   (*pack)(char *dst, const uint16_t *src, size_t count);
+    size_t (*pairs)(char *dst, const uint16_t *src, size_t count);
+};
+
+
+static size_t length_scalar(const uint16_t *words, size_t max) {
+    size_t i = 0;
+
+    while (i < max && words[i]) {
+        ++i;
+    }
+
+    return i;
+}
+
+
+static void pack_scalar(char *dst, const uint16_t *src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = (char) src[i];
+    }
+}
+
+
+static size_t pairs_scalar(char *dst, const uint16_t *src, size_t count) {
+    size_t used = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        dst[used++] = src[i] & 0xFF;
+
+        if (src[i] >> 8) {
+            dst[used++] = src[i] >> 8;
+        }
+    }
+
+    return used;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static size_t length_sse2(const uint16_t *words, size_t max) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= max; i += 8) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (words + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, zero));
+
+        if (mask) {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+
+    return i + length_scalar(words + i, max - i);
+}
+
+
+__attribute__((target("sse2")))
+static void pack_sse2(char *dst, const uint16_t *src, size_t count) {
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+
+    // masked first, as the pack saturates instead of truncating
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i)), low);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + i + 8)), low);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(a, b));
+    }
+
+    pack_scalar(dst + i, src + i, count - i);
+}
+
+
+// On a little-endian host the words already hold their bytes in output
+// order, so runs without a zero high byte are copied as they are.
+__attribute__((target("sse2")))
+static size_t pairs_sse2(char *dst, const uint16_t *src, size_t count) {
+    const __m128i high = _mm_set1_epi16((short) 0xFF00);
+    const __m128i zero = _mm_setzero_si128();
+    size_t used = 0, i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (src + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chunk, high), zero))) {
+            used += pairs_scalar(dst + used, src + i, 8);
+        }
+        else {
+            _mm_storeu_si128((__m128i *) (dst + used), chunk);
+            used += 16;
+        }
+    }
+
+    return used + pairs_scalar(dst + used, src + i, count - i);
+}
+
+
+__attribute__((target("avx2")))
+static size_t length_avx2(const uint16_t *words, size_t max) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= max; i += 16) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (words + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chunk, zero));
+
+        if (mask) {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+
+    return i + length_sse2(words + i, max - i);
+}
+
+
+__attribute__((target("avx2")))
+static void pack_avx2(char *dst, const uint16_t *src, size_t count) {
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    size_t i = 0;
+
+    // the pack works within 128-bit lanes, so the quarters are put back in order
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (src + i)), low);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (src + i + 16)), low);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *) (dst + i), packed);
+    }
+
+    pack_sse2(dst + i, src + i, count - i);
+}
+
+
+__attribute__((target("avx2")))
+static size_t pairs_avx2(char *dst, const uint16_t *src, size_t count) {
+    const __m256i high = _mm256_set1_epi16((short) 0xFF00);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t used = 0, i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (src + i));
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(chunk, high), zero))) {
+            used += pairs_sse2(dst + used, src + i, 16);
+        }
+        else {
+            _mm256_storeu_si256((__m256i *) (dst + used), chunk);
+            used += 32;
+        }
+    }
+
+    return used + pairs_sse2(dst + used, src + i, count - i);
+}
+
+#endif
+
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+
+// A byte per word of the comparison, 0xFF where it held.
+static uint64_t narrow_mask(uint16x8_t compared) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(compared, 4)), 0);
+}
+
+
+static size_t length_neon(const uint16_t *words, size_t max) {
+    size_t i = 0;
+
+    for (; i + 8 <= max; i += 8) {
+        uint64_t mask = narrow_mask(vceqq_u16(vld1q_u16(words + i), vdupq_n_u16(0)));
+
+        if (mask) {
+            return i + (__builtin_ctzll(mask) >> 3);
+        }
+    }
+
+    return i + length_scalar(words + i, max - i);
+}
+
+
+static void pack_neon(char *dst, const uint16_t *src, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        vst1_u8((uint8_t *) (dst + i), vmovn_u16(vld1q_u16(src + i)));
+    }
+
+    pack_scalar(dst + i, src + i, count - i);
+}
+
+
+static size_t pairs_neon(char *dst, const uint16_t *src, size_t count) {
+    size_t used = 0, i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t chunk = vld1q_u16(src + i);
+
+        if (narrow_mask(vcltq_u16(chunk, vdupq_n_u16(0x100)))) {
+            used += pairs_scalar(dst + used, src + i, 8);
+        }
+        else {
+            vst1q_u8((uint8_t *) (dst + used), vreinterpretq_u8_u16(chunk));
+            used += 16;
+        }
+    }
+
+    return used + pairs_scalar(dst + used, src + i, count - i);
+}
+
+#endif
+
+
+static struct string_kernels string_kernels_selected;
+
+
+static void pick_string_kernels() {
+    struct string_kernels kernels = { length_scalar, pack_scalar, pairs_scalar };
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // the vector pairs copy bytes in little-endian order
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = (struct string_kernels) { length_avx2, pack_avx2, pairs_avx2 };
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        kernels = (struct string_kernels) { length_sse2, pack_sse2, pairs_sse2 };
+    }
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+    kernels = (struct string_kernels) { length_neon, pack_neon, pairs_neon };
+#endif
+
+    string_kernels_selected = kernels;
+}
+
+
+static const struct string_kernels *string_kernels(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, pick_string_kernels);
+
+    return &string_kernels_selected;
+}
+
+
+size_t words_length(const uint16_t *words, size_t max) {
+    return string_kernels()->length(words, max);
+}
+
+
+void words_pack(char *dst, const uint16_t *src, size_t count) {
+    string_kernels()->pack(dst, src, count);
+}
+
+
+size_t words_pairs(char *dst, const uint16_t *src, size_t count) {
+    return string_kernels()->pairs(dst, src, count);
+}
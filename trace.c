@@ -0,0 +1,364 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "lc3.h"
+
+
+/*
+ * Execution trace
+ *
+ * The VM's thread is the only producer and the writer thread the only
+ * consumer of the ring, so a record costs a copy and a release store of
+ * the head. The writer sleeps until the ring is half full, or for at most
+ * TRACE_FLUSH_NS, and the VM sleeps only when the ring is full; each side
+ * raises a flag before sleeping and the other checks it after moving its
+ * index, so neither wakeup is lost.
+ *
+ * "LC3T" and a version word, in host byte order like cached images, then
+ * the records. Each is XOR-ed with the one before it (zeros before the
+ * first) and stored as a 16-bit mask of its non-zero bytes, low byte
+ * first, followed by those bytes. Consecutive records mostly differ in the
+ * low bytes of the count, the PC and the instruction, so a record takes
+ * a little over half its size.
+*/
+#define TRACE_RING     (1 << 16)   // records, a power of two
+#define TRACE_FLUSH_NS 10000000    // longest a record waits for the writer
+#define TRACE_CHUNK    65536       // bytes encoded per write
+
+struct lc3_trace {
+    struct lc3_trace_record ring[TRACE_RING];
+    atomic_uint head;           // next slot the VM fills
+    atomic_uint tail;           // next slot the writer takes
+    atomic_bool producer_waiting;
+    atomic_bool writer_waiting;
+    atomic_bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t  filled;     // the ring is half full, or stopping
+    pthread_cond_t  drained;    // the ring has room again
+    pthread_t       writer;
+
+    FILE    *file;
+    bool     failed;            // a write failed; records are dropped from then on
+
+    uint16_t first_pc;
+    uint16_t last_pc;
+    uint64_t from;
+    uint64_t to;
+    uint32_t epoch;             // high half of the counts since the last TRACE_EPOCH
+};
+
+
+static void encode_flush(struct lc3_trace *trace, uint8_t *chunk, size_t *used) {
+    if (*used && !trace->failed && fwrite(chunk, *used, 1, trace->file) != 1) {
+        trace->failed = true;
+    }
+
+    *used = 0;
+}
+
+
+// The record as the mask and the bytes that differ from `previous`. Returns its length.
+static size_t encode_record(uint8_t *out, const struct lc3_trace_record *record,
+                            const struct lc3_trace_record *previous) {
+    const uint8_t *now = (const uint8_t *) record;
+    const uint8_t *before = (const uint8_t *) previous;
+    uint16_t mask = 0;
+    size_t length = 2;
+
+    for (size_t i = 0; i < sizeof(*record); ++i) {
+        if (now[i] != before[i]) {
+            mask |= 1u << i;
+            out[length++] = now[i] ^ before[i];
+        }
+    }
+
+    out[0] = mask & 0xFF;
+    out[1] = mask >> 8;
+
+    return length;
+}
+
+
+static void *trace_writer(void *argument) {
+    struct lc3_trace *trace = argument;
+    struct lc3_trace_record previous = {0};
+    uint8_t *chunk = malloc(TRACE_CHUNK);
+    size_t used = 0;
+
+    if (!chunk) {
+        trace->failed = true;
+    }
+
+    for (;;) {
+        unsigned tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+        if (head == tail) {
+            encode_flush(trace, chunk, &used);
+
+            // records pushed before `stopping` was set may have come in
+            // since `head` was read, so the ring has to be empty after it
+            if (atomic_load(&trace->stopping)) {
+                if (atomic_load(&trace->head) == tail) {
+                    break;
+                }
+                continue;
+            }
+
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += TRACE_FLUSH_NS;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_nsec -= 1000000000;
+                ++until.tv_sec;
+            }
+
+            pthread_mutex_lock(&trace->lock);
+            atomic_store(&trace->writer_waiting, true);
+            if (atomic_load(&trace->head) == tail && !atomic_load(&trace->stopping)) {
+                pthread_cond_timedwait(&trace->filled, &trace->lock, &until);
+            }
+            atomic_store(&trace->writer_waiting, false);
+            pthread_mutex_unlock(&trace->lock);
+            continue;
+        }
+
+        for (; tail != head; ++tail) {
+            const struct lc3_trace_record *record = &trace->ring[tail & (TRACE_RING - 1)];
+
+            if (!trace->failed) {
+                if (used + 2 + sizeof(*record) > TRACE_CHUNK) {
+                    encode_flush(trace, chunk, &used);
+                }
+
+                used += encode_record(chunk + used, record, &previous);
+            }
+
+            previous = *record;
+        }
+
+        atomic_store(&trace->tail, tail);
+
+        if (atomic_load(&trace->producer_waiting)) {
+            pthread_mutex_lock(&trace->lock);
+            pthread_cond_signal(&trace->drained);
+            pthread_mutex_unlock(&trace->lock);
+        }
+    }
+
+    free(chunk);
+
+    return NULL;
+}
+
+
+static void trace_push(struct lc3_trace *trace, const struct lc3_trace_record *record) {
+    unsigned head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING) {
+        pthread_mutex_lock(&trace->lock);
+        atomic_store(&trace->producer_waiting, true);
+        while (head - atomic_load(&trace->tail) == TRACE_RING) {
+            pthread_cond_wait(&trace->drained, &trace->lock);
+        }
+        atomic_store(&trace->producer_waiting, false);
+        pthread_mutex_unlock(&trace->lock);
+    }
+
+    trace->ring[head & (TRACE_RING - 1)] = *record;
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+
+    // wake the writer once per fill, not per record
+    if (head + 1 - atomic_load_explicit(&trace->tail, memory_order_relaxed) == TRACE_RING / 2) {
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (atomic_load(&trace->writer_waiting)) {
+            pthread_mutex_lock(&trace->lock);
+            pthread_cond_signal(&trace->filled);
+            pthread_mutex_unlock(&trace->lock);
+        }
+    }
+}
+
+
+bool trace_on(const struct lc3_vm *vm) {
+    const struct lc3_trace *trace = vm->trace;
+
+    return trace && vm->instructions >= trace->from && vm->instructions < trace->to;
+}
+
+
+uint64_t trace_boundary(const struct lc3_vm *vm, uint64_t limit) {
+    const struct lc3_trace *trace = vm->trace;
+
+    if (vm->instructions < trace->from) {
+        return trace->from < limit ? trace->from : limit;
+    }
+
+    if (vm->instructions < trace->to) {
+        return trace->to < limit ? trace->to : limit;
+    }
+
+    return limit;
+}
+
+
+bool trace_before(struct lc3_vm *vm, uint16_t pc, const struct decoded *op, struct trace_step *step) {
+    const struct lc3_trace *trace = vm->trace;
+
+    if (pc < trace->first_pc || pc > trace->last_pc) {
+        return false;
+    }
+
+    step->pc     = pc;
+    step->word   = op->instruction;
+    step->opcode = op->opcode;
+    step->dest   = op->register0;
+    memcpy(step->registers, vm->registers, sizeof(step->registers));
+
+    // the address is worked out now, as the store may change what it comes from
+    uint16_t next = pc + 1;
+
+    switch (op->opcode) {
+        case OP_ST:
+            step->address = next + op->offset;
+            break;
+
+        case OP_STR:
+            step->address = vm->registers[op->register1] + op->offset;
+            break;
+
+        case OP_STI:
+            // memory as stored, without the side effects of a device read
+            step->address = vm->memory[(uint16_t) (next + op->offset)];
+            break;
+    }
+
+    return true;
+}
+
+
+void trace_after(struct lc3_vm *vm, const struct trace_step *step) {
+    struct lc3_trace *trace = vm->trace;
+    struct lc3_trace_record record = {0};
+    uint32_t epoch = vm->instructions >> 32;
+
+    if (epoch != trace->epoch) {
+        record.instruction = epoch;
+        record.flags       = TRACE_EPOCH;
+        trace_push(trace, &record);
+        trace->epoch = epoch;
+        memset(&record, 0, sizeof(record));
+    }
+
+    record.instruction = (uint32_t) vm->instructions;
+    record.pc          = step->pc;
+    record.word        = step->word;
+
+    switch (step->opcode) {
+        case OP_ADD:
+        case OP_AND:
+        case OP_NOT:
+        case OP_LD:
+        case OP_LDR:
+        case OP_LDI:
+        case OP_LEA:
+            record.reg    = step->dest;
+            record.flags |= TRACE_REGISTER;
+            break;
+
+        case OP_ST:
+        case OP_STR:
+        case OP_STI:
+            record.address = step->address;
+            record.stored  = vm->memory[step->address];
+            record.flags  |= TRACE_STORE;
+            break;
+
+        default:
+            // JSR and TRAP set R7, GETC and IN also R0: the lowest one that changed
+            for (uint8_t r = R0; r <= R7; ++r) {
+                if (vm->registers[r] != step->registers[r]) {
+                    record.reg    = r;
+                    record.flags |= TRACE_REGISTER;
+                    break;
+                }
+            }
+    }
+
+    if (record.flags & TRACE_REGISTER) {
+        record.result = vm->registers[record.reg];
+    }
+
+    trace_push(trace, &record);
+}
+
+
+int lc3_trace_start(struct lc3_vm *vm, const char *path, uint16_t first_pc, uint16_t last_pc,
+                    uint64_t from, uint64_t to) {
+    lc3_trace_stop(vm);
+
+    struct lc3_trace *trace = calloc(1, sizeof(*trace));
+    uint16_t version = TRACE_VERSION;
+
+    if (!trace || !(trace->file = fopen(path, "wb"))) {
+        free(trace);
+        return 0;
+    }
+
+    trace->first_pc = first_pc;
+    trace->last_pc  = last_pc;
+    trace->from     = from;
+    trace->to       = to;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->filled, NULL);
+    pthread_cond_init(&trace->drained, NULL);
+
+    if (fwrite(TRACE_MAGIC, 4, 1, trace->file) != 1
+        || fwrite(&version, sizeof(version), 1, trace->file) != 1
+        || pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+        fclose(trace->file);
+        pthread_mutex_destroy(&trace->lock);
+        pthread_cond_destroy(&trace->filled);
+        pthread_cond_destroy(&trace->drained);
+        free(trace);
+        return 0;
+    }
+
+    vm->trace = trace;
+
+    return 1;
+}
+
+
+int lc3_trace_stop(struct lc3_vm *vm) {
+    struct lc3_trace *trace = vm->trace;
+
+    if (!trace) {
+        return 1;
+    }
+
+    vm->trace = NULL;
+
+    // the writer drains what is left before it sees this
+    pthread_mutex_lock(&trace->lock);
+    atomic_store(&trace->stopping, true);
+    pthread_cond_signal(&trace->filled);
+    pthread_mutex_unlock(&trace->lock);
+
+    pthread_join(trace->writer, NULL);
+
+    bool ok = fclose(trace->file) == 0 && !trace->failed;
+
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->filled);
+    pthread_cond_destroy(&trace->drained);
+    free(trace);
+
+    return ok;
+}
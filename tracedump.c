@@ -0,0 +1,169 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lc3.h"
+
+
+/*
+ * Trace decoder
+ *
+ *   gcc -O2 -o lc3-trace tracedump.c
+ *   ./lc3-trace trace.lc3t
+ *
+ * Prints one line per record of a trace written by lc3_trace_start(): the
+ * instruction count, the PC, the instruction word and its disassembly, and
+ * then the register and the memory word it changed, if any.
+*/
+
+static const char *const opcode_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+
+static int sext(uint16_t x, int bits) {
+    return (int) (x << (32 - bits)) >> (32 - bits);
+}
+
+
+static void disassemble(uint16_t pc, uint16_t word, char *text, size_t size) {
+    int op = word >> 12;
+    int r0 = (word >> 9) & 7;
+    int r1 = (word >> 6) & 7;
+    uint16_t target = pc + 1 + sext(word & 0x1FF, 9);
+
+    switch (op) {
+        case OP_BR:
+            snprintf(text, size, "BR%s%s%s x%04X", word & 0x800 ? "n" : "", word & 0x400 ? "z" : "",
+                     word & 0x200 ? "p" : "", target);
+            break;
+
+        case OP_ADD:
+        case OP_AND:
+            if (word & 0x20) {
+                snprintf(text, size, "%s R%d, R%d, #%d", opcode_names[op], r0, r1, sext(word & 0x1F, 5));
+            }
+            else {
+                snprintf(text, size, "%s R%d, R%d, R%d", opcode_names[op], r0, r1, word & 7);
+            }
+            break;
+
+        case OP_LD:
+        case OP_ST:
+        case OP_LDI:
+        case OP_STI:
+        case OP_LEA:
+            snprintf(text, size, "%s R%d, x%04X", opcode_names[op], r0, target);
+            break;
+
+        case OP_LDR:
+        case OP_STR:
+            snprintf(text, size, "%s R%d, R%d, #%d", opcode_names[op], r0, r1, sext(word & 0x3F, 6));
+            break;
+
+        case OP_JSR:
+            if (word & 0x800) {
+                snprintf(text, size, "JSR x%04X", (uint16_t) (pc + 1 + sext(word & 0x7FF, 11)));
+            }
+            else {
+                snprintf(text, size, "JSRR R%d", r1);
+            }
+            break;
+
+        case OP_NOT:
+            snprintf(text, size, "NOT R%d, R%d", r0, r1);
+            break;
+
+        case OP_JMP:
+            snprintf(text, size, r1 == R7 ? "RET" : "JMP R%d", r1);
+            break;
+
+        case OP_TRAP:
+            snprintf(text, size, "TRAP x%02X", word & 0xFF);
+            break;
+
+        default:
+            snprintf(text, size, "%s", opcode_names[op]);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("Forma de usar:\n ./lc3-trace trace.lc3t\n");
+        return 2;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    char magic[4];
+    uint16_t version;
+
+    if (!file) {
+        printf("falha ao abrir o trace: %s\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, 4) != 0
+        || fread(&version, sizeof(version), 1, file) != 1 || version != TRACE_VERSION) {
+        printf("trace inválido ou de outra ordem de bytes: %s\n", argv[1]);
+        return 1;
+    }
+
+    struct lc3_trace_record record = {0};
+    uint8_t *bytes = (uint8_t *) &record;
+    uint64_t epoch = 0;
+    int low;
+
+    while ((low = fgetc(file)) != EOF) {
+        int high = fgetc(file);
+
+        if (high == EOF) {
+            printf("trace truncado\n");
+            return 1;
+        }
+
+        // the bytes that changed since the last record
+        uint16_t mask = low | high << 8;
+
+        for (size_t i = 0; i < sizeof(record); ++i) {
+            if (mask >> i & 1) {
+                int byte = fgetc(file);
+
+                if (byte == EOF) {
+                    printf("trace truncado\n");
+                    return 1;
+                }
+
+                bytes[i] ^= byte;
+            }
+        }
+
+        if (record.flags & TRACE_EPOCH) {
+            epoch = (uint64_t) record.instruction << 32;
+            continue;
+        }
+
+        char text[32];
+        disassemble(record.pc, record.word, text, sizeof(text));
+
+        printf("%12llu  x%04X  x%04X  %-18s", (unsigned long long) (epoch | record.instruction),
+               record.pc, record.word, text);
+
+        if (record.flags & TRACE_REGISTER) {
+            printf("  R%d=x%04X", record.reg, record.result);
+        }
+
+        if (record.flags & TRACE_STORE) {
+            printf("  [x%04X]=x%04X", record.address, record.stored);
+        }
+
+        printf("\n");
+    }
+
+    fclose(file);
+
+    return 0;
+}